@@ -1,13 +1,15 @@
 PKGS := glib-2.0    \
-        libxml-2.0  \
         libssl      \
         libcrypto   \
         libseccomp
 
 SRCS :=                                                         \
+        src/base64.c                                            \
         src/common.c                                            \
         src/depriv.c                                            \
         src/log.c                                               \
+        src/persist.c                                           \
+        src/pool.c                                              \
         src/serializer.c                                        \
         src/storage.c                                           \
         src/uefi/auth.c                                         \
@@ -19,4 +21,5 @@ SRCS :=                                                         \
         src/varnames.c                                          \
         src/variable.c                                          \
         src/xapi.c                                              \
-        src/xen_variable_server.c
+        src/xen_variable_server.c                               \
+        src/xmlrpc.c
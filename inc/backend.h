@@ -10,7 +10,8 @@ struct backend {
     void (*cleanup)(void);
     int (*parse_arg)(char *arg);
     int (*save)(void);
-    int (*set)(void);
+    void *(*snapshot)(void);
+    int (*set)(void *snapshot);
 };
 
 extern struct backend *backend;
@@ -23,7 +24,7 @@ static inline int backend_parse_arg(char *arg)
     }
 
     if (backend->parse_arg)
-        return backend->parse_arg(optarg);
+        return backend->parse_arg(arg);
 
     return 0;
 }
@@ -55,8 +56,27 @@ static inline int backend_init(bool resume)
 /* backend_save */
 DEFINE_BACKEND_CHECKED_CALL(save);
 
-/* backend_set */
-DEFINE_BACKEND_CHECKED_CALL(set);
+/*
+ * Persisting the variables takes two steps, so that the store only needs to
+ * be locked while they are serialized: backend_snapshot() with the store
+ * locked, then backend_set() with the snapshot, which frees it and
+ * returns 0 once the backend has the variables, otherwise -1.
+ */
+static inline void *backend_snapshot(void)
+{
+    if (backend && backend->snapshot)
+        return backend->snapshot();
+
+    return NULL;
+}
+
+static inline int backend_set(void *snapshot)
+{
+    if (backend && backend->set)
+        return backend->set(snapshot);
+
+    return 0;
+}
 
 /* backend_cleanup */
 DEFINE_BACKEND_CHECKED_CALL(cleanup);
@@ -9,6 +9,13 @@
 
 #define smp_mb() __sync_synchronize()
 
+/* Hint to the CPU that this is a spin-wait loop */
+#if defined(__x86_64__)
+# define cpu_relax() __builtin_ia32_pause()
+#else
+# define cpu_relax() barrier()
+#endif
+
 static inline
 void __read_once_size(const volatile void *p, void *res, int size)
 {
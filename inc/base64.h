@@ -0,0 +1,16 @@
+#ifndef __H_BASE64_
+#define __H_BASE64_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The length of the base64 encoding of n bytes, without a NUL terminator */
+#define BASE64_ENCODED_SIZE(n) ((((n) + 2) / 3) * 4)
+
+size_t base64_encode(char *out, const uint8_t *in, size_t n);
+ssize_t base64_decode(uint8_t *out, const char *in, size_t len);
+void base64_set_simd(bool enable);
+
+#endif // __H_BASE64_
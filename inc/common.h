@@ -24,6 +24,7 @@
 #define UTF16_CHAR_SZ sizeof(UTF16)
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
 
 #define UEFISTORED_ERROR 1
 #define VAR_NOT_FOUND (-10)
@@ -3,15 +3,50 @@
 
 #define UEFISTORED_VERSION 1
 
+/* Version of a shared buffer holding a ring of requests, see ring_header */
+#define UEFISTORED_RING_VERSION 2
+
 /* utility macros for configs */
 #define KB(x) (x * 1024)
 #define MB(x) (KB(x) * 1024)
 
-#define MAX_VAR_COUNT 128
+/* Variables per storage slab chunk, the store grows and shrinks by chunks */
+#define VAR_CHUNK_SIZE 32
 #define MAX_VARIABLE_NAME_SIZE 256
 #define MAX_VARIABLE_NAME_CHARS (MAX_VARIABLE_NAME_SIZE / 2)
 #define MAX_VARIABLE_DATA_SIZE KB(32)
 #define MAX_VARIABLE_SIZE (MAX_VARIABLE_NAME_SIZE + MAX_VARIABLE_DATA_SIZE)
-#define MAX_STORAGE_SIZE (MAX_VAR_COUNT * MAX_VARIABLE_NAME_SIZE * MAX_VARIABLE_DATA_SIZE)
+
+/*
+ * Largest data a variable may hold.  Above MAX_VARIABLE_DATA_SIZE, it can only
+ * be transferred in chunks (COMMAND_SET_VARIABLE_CHUNK and
+ * COMMAND_GET_VARIABLE_CHUNK).
+ */
+#define MAX_CHUNKED_DATA_SIZE KB(128)
+
+/* Bytes of all partially received chunked SetVariable requests together */
+#define CHUNK_STAGING_BUDGET (2 * MAX_CHUNKED_DATA_SIZE)
+
+/* Variables per COMMAND_GET_VARIABLES_BATCH or COMMAND_SET_VARIABLES_BATCH */
+#define MAX_BATCH_ENTRIES 64
+
+/*
+ * Bytes of variable storage a domain may use unless overridden with --quota,
+ * see storage_set_quota().
+ */
+#define DEFAULT_STORAGE_QUOTA MB(1)
+
+/*
+ * Milliseconds without a change to a non-volatile variable before persisting
+ * the changes, unless overridden with --persist-delay, see persist_start().
+ */
+#define DEFAULT_PERSIST_DELAY_MS 100
+
+/*
+ * Milliseconds after a change to a non-volatile variable by which it is
+ * persisted however many more come in, unless overridden with
+ * --persist-max-delay.
+ */
+#define DEFAULT_PERSIST_MAX_DELAY_MS 1000
 
 #endif // __H_CONFIG_
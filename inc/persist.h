@@ -0,0 +1,25 @@
+#ifndef __H_PERSIST_
+#define __H_PERSIST_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Counters since startup, see persist_get_stats() */
+struct persist_stats {
+    uint64_t changes;        /* Changes reported with persist_changed() */
+    uint64_t flushes;        /* Updates of the backend */
+    uint64_t failures;       /* Updates the backend failed, tried again */
+    uint64_t immediate;      /* Of which made without waiting for more */
+    uint64_t latency_ns;     /* Sum over updates of the time since the
+                                oldest change they persisted */
+    uint64_t max_latency_ns; /* The longest of those times */
+};
+
+int persist_start(unsigned int delay_ms, unsigned int max_delay_ms,
+                  bool sb_barrier);
+void persist_stop(void);
+void persist_changed(bool secure_boot);
+int persist_flush(void);
+void persist_get_stats(struct persist_stats *out);
+
+#endif // __H_PERSIST_
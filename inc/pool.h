@@ -0,0 +1,23 @@
+#ifndef __H_POOL_
+#define __H_POOL_
+
+#include <stddef.h>
+
+#include "config.h"
+
+/* The smallest block handed out by the pool, every size class doubles it */
+#define POOL_MIN_BLOCK 16
+
+/* Blocks are carved out of slabs of this size, a power of two */
+#define POOL_SLAB_SIZE KB(16)
+
+/* The largest block carved out of a slab, larger ones come from the heap */
+#define POOL_MAX_SLAB_BLOCK KB(4)
+
+void *pool_alloc(size_t size, size_t *capacity);
+void pool_free(void *block, size_t capacity);
+size_t pool_capacity(size_t size);
+size_t pool_held(void);
+void pool_destroy(void);
+
+#endif // __H_POOL_
@@ -8,21 +8,51 @@
 #include "common.h"
 #include "uefi/types.h"
 
+void storage_read_lock(void);
+void storage_write_lock(void);
+void storage_unlock(void);
+
 size_t storage_count(void);
+size_t storage_count_nonvolatile(void);
+size_t storage_capacity(void);
 EFI_STATUS storage_get(const UTF16 *name, size_t namesz, const EFI_GUID *guid, uint32_t *attrs, void *data, size_t *data_size);
 EFI_STATUS storage_set(const UTF16 *name, size_t namesz, const EFI_GUID *guid, const void *val,
                        size_t len, uint32_t attrs);
+EFI_STATUS storage_set_hashed(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
+                              uint32_t hash, const void *val, size_t len, uint32_t attrs);
 EFI_STATUS storage_set_with_timestamp(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
         const void *val, size_t len, uint32_t attrs, EFI_TIME
         *timestamp);
+void storage_limit_data(size_t max);
 void storage_destroy(void);
 variable_t *storage_next_variable(UTF16 *name, size_t namesz, EFI_GUID *guid);
 bool storage_exists(const UTF16 *name, size_t namesz, const EFI_GUID *guid);
 uint64_t storage_used(void);
+uint64_t storage_quota(void);
+uint64_t storage_remaining(void);
+void storage_set_quota(uint64_t bytes);
 EFI_STATUS storage_remove(const UTF16 *name, size_t namesz, const EFI_GUID *guid);
 EFI_STATUS storage_get_var_ptr(variable_t **var, const UTF16 *name, size_t namesz, const EFI_GUID *guid);
-EFI_STATUS storage_iter(variable_t *var);
+size_t storage_snapshot(variable_t *vars, size_t n, bool nonvolatile);
 variable_t *storage_find_variable(const UTF16 *name, size_t namesz, const EFI_GUID *guid);
+variable_t *storage_find_variable_hashed(const UTF16 *name, size_t namesz,
+                                         const EFI_GUID *guid, uint32_t hash);
+variable_t *storage_find_variable_cached(const UTF16 *name, size_t namesz,
+                                         const EFI_GUID *guid, uint32_t hash);
+
+/* Called for each change reported by storage_changes_since() */
+typedef void (*storage_change_fn)(const variable_t *var, bool deleted,
+                                  void *opaque);
+
+EFI_STATUS storage_begin(void);
+void storage_commit(void);
+void storage_abort(void);
+
+uint64_t storage_generation(void);
+uint64_t storage_nv_generation(void);
+int storage_changes_since(uint64_t since, storage_change_fn fn, void *opaque);
+void storage_prune_tombstones(uint64_t upto);
+
 void storage_print_all(void);
 void storage_print_all_data_only(void);
 
@@ -191,6 +191,11 @@ typedef enum command {
     COMMAND_GET_NEXT_VARIABLE,
     COMMAND_QUERY_VARIABLE_INFO,
     COMMAND_NOTIFY_SB_FAILURE,
+    COMMAND_GET_VARIABLES_BATCH,
+    COMMAND_SET_VARIABLES_BATCH,
+    COMMAND_GET_ALL_NAMES,
+    COMMAND_SET_VARIABLE_CHUNK,
+    COMMAND_GET_VARIABLE_CHUNK,
 } command_t;
 
 typedef struct _WIN_CERTIFICATE {
@@ -10,30 +10,58 @@
 
 #define SHA256_DIGEST_SIZE 32
 
+/*
+ * Variable data.  A payload can be shared by several variable_t (see
+ * variable_share()), and is never modified while it is: variable_set_data()
+ * copies it first.
+ */
+struct payload {
+    uint32_t refs;
+
+    /* The size of the pool block bytes points to */
+    uint64_t cap;
+
+    uint8_t *bytes;
+};
+
 typedef struct variable {
-    /* The variable name */
-    UTF16 name[MAX_VARIABLE_NAME_CHARS];
+    /*
+     * Hot fields first: matching a key and checking access only needs the
+     * first cache line, the name bytes are compared after that only on a
+     * match (see storage_find_variable()).
+     */
 
     /* namesz is not strictly needed, but we use it to speed up comparisons */
     uint64_t namesz;
 
-    /* Pointer to the data itself */
+    /* The variable GUID */
+    EFI_GUID guid;
+
+    /* The variable attributes */
+    uint32_t attrs;
+
+    /* Pointer to the data itself, i.e. payload->bytes */
     uint8_t *data;
 
     /* The size of the variable's data or value */
     uint64_t datasz;
 
-    /* The variable GUID */
-    EFI_GUID guid;
+    /* Where the data lives, see variable_set_data() */
+    struct payload *payload;
 
-    /* The variable attributes */
-    uint32_t attrs;
+    /* Cold fields */
+
+    /* The variable name */
+    UTF16 name[MAX_VARIABLE_NAME_CHARS];
 
     /* EFI timestamp for time based auth */
     EFI_TIME timestamp;
 
     /* SHA-256 digest of signer's CN and top-level tbs cert */
     uint8_t cert[SHA256_DIGEST_SIZE];
+
+    /* Store generation of the last change, see storage_generation() */
+    uint64_t last_modified_gen;
 } variable_t;
 
 #define for_each_variable(vars, var, __i)                              \
@@ -52,6 +80,7 @@ void variable_destroy(variable_t *var);
 void variable_destroy_noalloc(variable_t *var);
 
 int variable_copy(variable_t *dst, const variable_t *src);
+int variable_share(variable_t *dst, const variable_t *src);
 bool variable_eq(const variable_t *a, const variable_t *b);
 
 int variable_set_attrs(variable_t *var, const uint32_t attrs);
@@ -63,13 +92,22 @@ uint64_t variable_size(const variable_t *var);
 variable_t *variable_create_unserialize(const uint8_t **ptr);
 
 int from_bytes_to_vars(variable_t *vars, size_t n, const uint8_t *bytes, size_t bytes_sz);
+int variable_list_count(const uint8_t *bytes, size_t bytes_sz);
 
 static inline bool variable_is_valid(const variable_t *var) {
     return (var && var->name && var->name[0] && var->namesz != 0);
 }
 
-variable_t *find_variable(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
-                          variable_t *variables, size_t n);
+/* The size of name as stored, without its null-terminator if it has one */
+static inline size_t variable_stored_namesz(const UTF16 *name, size_t namesz)
+{
+    if (namesz >= sizeof(UTF16) && name[namesz / sizeof(UTF16) - 1] == 0)
+        return namesz - sizeof(UTF16);
+
+    return namesz;
+}
+
+uint32_t variable_hash(const UTF16 *name, size_t namesz, const EFI_GUID *guid);
 
 /* Get the namesz with no end of string char '\0' */
 #define variable_serialized_namesz(var) ((var)->namesz)
@@ -8,11 +8,12 @@
 #define MSG_SIZE (64 * PAGE_SIZE)
 
 int xapi_init(bool);
-int xapi_set(void);
+void *xapi_snapshot(void);
+int xapi_set(void *snapshot);
 int xapi_connect(void);
 int xapi_parse_arg(char *arg);
-int xapi_variables_request(variable_t *variables, size_t n);
-int xapi_variables_read_file(variable_t *vars, size_t n, char *fname);
+int xapi_variables_request(variable_t **variables);
+int xapi_variables_read_file(variable_t **vars, char *fname);
 int xapi_write_save_file(void);
 int xapi_sb_notify(void);
 void xapi_cleanup(void);
@@ -9,6 +9,36 @@
 #define INPUT_SNAPSHOT "uefistored-input.dat"
 #define OUTPUT_SNAPSHOT "uefistored-output.dat"
 
+/*
+ * Instead of a single request, the shared buffer may hold a ring of request
+ * slots, which the guest announces with UEFISTORED_RING_VERSION in place of a
+ * request's version.  Every kick serves all the requests queued, so vCPUs can
+ * queue requests while another one is being served, and only the first of
+ * them needs to trap.
+ *
+ * The header is followed at RING_HEADER_SIZE by slot_count slots of slot_size
+ * bytes, each of which holds a request as sent in the single request mode
+ * and then its response.  The guest queues requests by filling slots and
+ * advancing req_prod, and kicks uefistored (the usual port IO write) if
+ * req_prod moved past req_event.  uefistored advances rsp_prod as each
+ * response is written, and sets req_event before it stops looking for more.
+ *
+ * A malformed ring is answered like a request with a bad version, with
+ * EFI_DEVICE_ERROR over the start of the header, which is how a guest also
+ * finds out uefistored does not support rings.
+ */
+#define RING_HEADER_SIZE 64
+#define RING_MIN_SLOT_SIZE 512
+
+struct ring_header {
+    uint32_t version;
+    uint32_t slot_count; /* Power of 2 */
+    uint32_t slot_size;  /* Multiple of 8 */
+    uint32_t req_prod;
+    uint32_t req_event;
+    uint32_t rsp_prod;
+};
+
 void xen_variable_server_handle_request(void *comm_buff);
 
 EFI_STATUS set_variable(UTF16 *variable, EFI_GUID *guid, uint32_t attrs,
@@ -0,0 +1,14 @@
+#ifndef __H_XMLRPC_
+#define __H_XMLRPC_
+
+#include <stddef.h>
+
+/* Status of an XAPI response, see xmlrpc_parse_response() */
+#define XMLRPC_SUCCESS 0
+#define XMLRPC_FAILURE 1
+#define XMLRPC_MISSING 2
+
+int xmlrpc_parse_response(const char *xml, size_t len, const char *key,
+                          char *out, size_t size);
+
+#endif // __H_XMLRPC_
@@ -0,0 +1,285 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#include "base64.h"
+
+/*
+ * Base64 as carried by VM.get_NVRAM and VM.set_NVRAM_EFI_variables: the
+ * standard alphabet, with padding and without line breaks.
+ *
+ * The variable lists are up to a few hundred KiB, encoded on every update
+ * sent to XAPI and decoded at startup, so both run on the caller's buffers
+ * with no allocation.  Blocks of 24 bytes, or 32 characters, are translated
+ * with AVX2 when the CPU has it, the rest with lookup tables.
+ */
+
+#define INVALID 0xff
+
+static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* The value of each character, INVALID if it is not in the alphabet */
+static const uint8_t values[256] = {
+    [0 ... 255] = INVALID,
+    ['A'] = 0,  ['B'] = 1,  ['C'] = 2,  ['D'] = 3,  ['E'] = 4,  ['F'] = 5,
+    ['G'] = 6,  ['H'] = 7,  ['I'] = 8,  ['J'] = 9,  ['K'] = 10, ['L'] = 11,
+    ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15, ['Q'] = 16, ['R'] = 17,
+    ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+    ['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29,
+    ['e'] = 30, ['f'] = 31, ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
+    ['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39, ['o'] = 40, ['p'] = 41,
+    ['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+    ['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53,
+    ['2'] = 54, ['3'] = 55, ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
+    ['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
+};
+
+#ifdef HAVE_AVX2
+
+/* -1 until checked, then whether the AVX2 loops are used */
+static int use_avx2 = -1;
+
+static bool avx2(void)
+{
+    if (use_avx2 < 0)
+        use_avx2 = __builtin_cpu_supports("avx2");
+
+    return use_avx2;
+}
+
+/*
+ * Encode blocks of 24 bytes while at least 28 can be loaded, and return how
+ * many bytes were encoded.  Each 128-bit lane takes 12 bytes, which are
+ * split into 16 6-bit indices and translated to characters by their range.
+ */
+__attribute__((target("avx2")))
+static size_t encode_avx2(char *out, const uint8_t *in, size_t n)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7,
+                                          10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+                                          4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                             -4, -4, -4, -4, -19, -16, 0, 0,
+                                             65, 71, -4, -4, -4, -4, -4, -4,
+                                             -4, -4, -4, -4, -19, -16, 0, 0);
+    __m256i v, t0, t1, t2, t3, range;
+    size_t done = 0;
+
+    while (n - done >= 28) {
+        v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *)(in + done))),
+                _mm_loadu_si128((const __m128i *)(in + done + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuf);
+
+        /* Move each 6-bit field to a byte of its own */
+        t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        v = _mm256_or_si256(t1, t3);
+
+        /* 0 for A-Z, 1 for a-z, 2-11 for 0-9, 12 for + and 13 for / */
+        range = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+        range = _mm256_sub_epi8(range,
+                                _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, range));
+
+        _mm256_storeu_si256((__m256i *)out, v);
+        out += 32;
+        done += 24;
+    }
+
+    return done;
+}
+
+/*
+ * Decode blocks of 32 characters, and return how many were decoded, or -1
+ * if one is not in the alphabet.  Characters are classified by their high
+ * and low nibbles, which also give the offset to their value.  Each block is
+ * read whole before its 24 bytes are written, so out may be in.
+ */
+__attribute__((target("avx2")))
+static ssize_t decode_avx2(uint8_t *out, const char *in, size_t len)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13,
+            0x1a, 0x1b, 0x1b, 0x1b, 0x1a, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+            0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10,
+            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+            0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0, 0, 16,
+                                              19, 4, -65, -65, -71, -71, 0, 0,
+                                              0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13,
+                                          12, -1, -1, -1, -1, 2, 1, 0, 6, 5,
+                                          4, 10, 9, 8, 14, 13, 12, -1, -1, -1,
+                                          -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+    __m256i v, hi, lo, roll;
+    size_t done = 0;
+
+    while (len - done >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)(in + done));
+        hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x0f));
+        lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+
+        if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo),
+                                _mm256_shuffle_epi8(lut_hi, hi)))
+            return -1;
+
+        /* '/' shares its high nibble with '+' but has its own offset */
+        roll = _mm256_add_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                               hi);
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, roll));
+
+        /* Pack four 6-bit values into three bytes, then the lanes together */
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        v = _mm256_permutevar8x32_epi32(v, lanes);
+
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i *)(out + 16), _mm256_extracti128_si256(v, 1));
+        out += 24;
+        done += 32;
+    }
+
+    return done;
+}
+
+#endif // HAVE_AVX2
+
+/**
+ * Turn the AVX2 loops on, if the CPU has AVX2, or off.  For tests and
+ * benchmarks, they are used whenever possible otherwise.
+ */
+void base64_set_simd(bool enable)
+{
+#ifdef HAVE_AVX2
+    use_avx2 = enable && __builtin_cpu_supports("avx2");
+#else
+    (void)enable;
+#endif
+}
+
+/**
+ * Encode n bytes in base64.
+ *
+ * @parm out the buffer for the encoding, of at least
+ *           BASE64_ENCODED_SIZE(n) + 1 bytes
+ * @parm in the bytes to encode
+ * @parm n the number of bytes
+ *
+ * @return the length of the encoding, which is NUL terminated.
+ */
+size_t base64_encode(char *out, const uint8_t *in, size_t n)
+{
+    char *start = out;
+    size_t done = 0;
+    uint32_t v;
+
+#ifdef HAVE_AVX2
+    if (n >= 28 && avx2()) {
+        done = encode_avx2(out, in, n);
+        out += done / 3 * 4;
+    }
+#endif
+
+    for (; n - done >= 3; done += 3) {
+        v = in[done] << 16 | in[done + 1] << 8 | in[done + 2];
+        *out++ = alphabet[v >> 18];
+        *out++ = alphabet[(v >> 12) & 0x3f];
+        *out++ = alphabet[(v >> 6) & 0x3f];
+        *out++ = alphabet[v & 0x3f];
+    }
+
+    if (n - done) {
+        v = in[done] << 16 | (n - done == 2 ? in[done + 1] << 8 : 0);
+        *out++ = alphabet[v >> 18];
+        *out++ = alphabet[(v >> 12) & 0x3f];
+        *out++ = n - done == 2 ? alphabet[(v >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+
+    *out = '\0';
+
+    return out - start;
+}
+
+/**
+ * Decode base64, with or without padding.
+ *
+ * @parm out the buffer for the bytes, of at least len / 4 * 3 + 2 bytes,
+ *           which may be in itself
+ * @parm in the encoding
+ * @parm len the length of the encoding
+ *
+ * @return the number of bytes decoded, or -1 if in is not base64.
+ */
+ssize_t base64_decode(uint8_t *out, const char *in, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)in;
+    uint8_t *start = out;
+    size_t done = 0;
+    uint32_t v, a, b, c, d;
+
+    if (len % 4 == 0 && len > 0 && in[len - 1] == '=')
+        len -= in[len - 2] == '=' ? 2 : 1;
+
+    if (len % 4 == 1)
+        return -1;
+
+#ifdef HAVE_AVX2
+    if (len >= 32 && avx2()) {
+        ssize_t ret = decode_avx2(out, in, len);
+
+        if (ret < 0)
+            return -1;
+
+        done = ret;
+        out += done / 4 * 3;
+    }
+#endif
+
+    for (; len - done >= 4; done += 4) {
+        a = values[s[done]];
+        b = values[s[done + 1]];
+        c = values[s[done + 2]];
+        d = values[s[done + 3]];
+
+        if ((a | b | c | d) & 0xc0)
+            return -1;
+
+        v = a << 18 | b << 12 | c << 6 | d;
+        *out++ = v >> 16;
+        *out++ = v >> 8;
+        *out++ = v;
+    }
+
+    if (len - done >= 2) {
+        a = values[s[done]];
+        b = values[s[done + 1]];
+        c = len - done == 3 ? values[s[done + 2]] : 0;
+
+        if ((a | b | c) & 0xc0)
+            return -1;
+
+        v = a << 18 | b << 12 | c << 6;
+        *out++ = v >> 16;
+
+        if (len - done == 3)
+            *out++ = v >> 8;
+    }
+
+    return out - start;
+}
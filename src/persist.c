@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "common.h"
+#include "log.h"
+#include "persist.h"
+#include "storage.h"
+
+/*
+ * Persistence of the non-volatile variables.
+ *
+ * Handing the variables to the backend is slow (for XAPI, a full varstore
+ * message over a socket and a wait for the reply), and the guest's vCPU is
+ * stalled for as long as its request is being served.  So a change only marks
+ * the state dirty, and a writer thread persists it once no other change came
+ * in for delay milliseconds, along with every change made in the meantime.  A
+ * burst of changes, like the Boot#### variables written during an OS install,
+ * then results in a single update and every request completes as soon as the
+ * store is updated.  A state kept changing is still persisted max_delay
+ * milliseconds after it first changed.
+ *
+ * Changes to secure boot variables are still persisted before the request
+ * completes, unless the barrier is disabled, so that they are never lost
+ * after the guest was told they succeeded.
+ *
+ * Until persist_start() is called, every change is persisted synchronously.
+ *
+ * A state the backend failed to take stays dirty.  The writer tries again
+ * after a backoff, and persist_flush() a few times before giving up.  Once it
+ * took a state, the store forgets the deletions it covers.
+ */
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static bool running;
+static bool alive;
+static bool stopping;
+static bool busy;
+static bool barrier = true;
+static unsigned int delay;
+static unsigned int max_delay;
+
+/* storage_nv_generation() of the latest change, and of the last persisted */
+static uint64_t dirty_gen;
+static uint64_t persisted_gen;
+
+/* persisted_gen when the store last forgot the deletions up to it */
+static uint64_t pruned_gen;
+
+/* When the oldest and the latest change not persisted yet were made */
+static uint64_t first_dirty_ns;
+static uint64_t last_dirty_ns;
+
+/* How long the writer waits before trying again a failed update, and when */
+static unsigned int backoff_ms;
+static uint64_t retry_ns;
+
+static struct persist_stats stats;
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+#define RETRY_MIN_MS 100
+#define RETRY_MAX_MS 30000
+#define FLUSH_ATTEMPTS 5
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Wait with lock held until no change came in for delay, or max_delay after
+ * the oldest change not persisted yet, so that more changes can come in.  Not
+ * before the backoff after a failed update is over.
+ */
+static void coalesce(void)
+{
+    struct timespec deadline;
+    uint64_t due;
+
+    while (!stopping && dirty_gen > persisted_gen) {
+        due = min(last_dirty_ns + delay * NS_PER_MS,
+                  first_dirty_ns + max_delay * NS_PER_MS);
+        due = max(due, retry_ns);
+
+        if (now_ns() >= due)
+            break;
+
+        deadline.tv_sec = due / NS_PER_SEC;
+        deadline.tv_nsec = due % NS_PER_SEC;
+
+        /* Every change wakes us up to push the deadline back */
+        pthread_cond_timedwait(&cond, &lock, &deadline);
+    }
+}
+
+/*
+ * Take a snapshot of everything up to now for the backend, with lock held and
+ * the store locked.  Returns when the oldest change in it was made, 0 if not
+ * known.
+ */
+static uint64_t snapshot(void **snap)
+{
+    uint64_t first = first_dirty_ns;
+
+    /* Changes from here on are dirty again */
+    first_dirty_ns = 0;
+    busy = true;
+    *snap = backend_snapshot();
+
+    return first;
+}
+
+/*
+ * Account for a flush of everything up to gen, with lock held.  first is when
+ * the oldest change it persisted was made, start when the flush started, and
+ * ret what backend_set() returned.
+ */
+static void flushed(uint64_t gen, uint64_t first, uint64_t start,
+                    bool immediate, int ret)
+{
+    uint64_t latency;
+
+    busy = false;
+    pthread_cond_broadcast(&cond);
+
+    /* Still dirty since its oldest change, the writer tries again later */
+    if (ret < 0) {
+        if (!first_dirty_ns || (first && first < first_dirty_ns))
+            first_dirty_ns = first ? first : start;
+
+        dirty_gen = max(dirty_gen, gen);
+        backoff_ms = backoff_ms ? min(backoff_ms * 2, RETRY_MAX_MS) :
+                                  RETRY_MIN_MS;
+        retry_ns = now_ns() + backoff_ms * NS_PER_MS;
+        stats.failures++;
+        return;
+    }
+
+    backoff_ms = 0;
+    retry_ns = 0;
+    persisted_gen = gen;
+
+    /* Unless a change came in while the backend was updated */
+    if (!first_dirty_ns)
+        dirty_gen = gen;
+
+    latency = now_ns() - (first ? first : start);
+
+    stats.flushes++;
+    stats.immediate += immediate;
+    stats.latency_ns += latency;
+    stats.max_latency_ns = max(stats.max_latency_ns, latency);
+}
+
+/*
+ * Let the store forget the deletions the backend has, with lock held and the
+ * store locked for writing.  The writer only locks the store for reading, so
+ * what it persisted is pruned on the next change.
+ */
+static void prune(void)
+{
+    if (persisted_gen != pruned_gen) {
+        storage_prune_tombstones(persisted_gen);
+        pruned_gen = persisted_gen;
+    }
+}
+
+/*
+ * Persist everything up to gen on the caller's thread, with the store locked
+ * for writing so nothing changes until it is persisted.  Returns what
+ * backend_set() returned.
+ */
+static int flush_now(uint64_t gen)
+{
+    uint64_t first, start = now_ns();
+    void *snap;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+
+    /* The writer's update is older, it must not overwrite this one */
+    while (busy)
+        pthread_cond_wait(&cond, &lock);
+
+    first = snapshot(&snap);
+    pthread_mutex_unlock(&lock);
+
+    ret = backend_set(snap);
+
+    pthread_mutex_lock(&lock);
+    flushed(gen, first, start, true, ret);
+    prune();
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+static void *writer(void *opaque)
+{
+    uint64_t gen, first, start;
+    void *snap;
+    int ret;
+
+    (void)opaque;
+
+    pthread_mutex_lock(&lock);
+
+    while (!stopping) {
+        if (dirty_gen <= persisted_gen) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+
+        coalesce();
+        pthread_mutex_unlock(&lock);
+
+        /* Changes are made with the store locked for writing */
+        storage_read_lock();
+        pthread_mutex_lock(&lock);
+
+        gen = storage_nv_generation();
+
+        if (stopping || gen <= persisted_gen) {
+            storage_unlock();
+            continue;
+        }
+
+        /* Only the snapshot needs the store, guest writes go on meanwhile */
+        start = now_ns();
+        first = snapshot(&snap);
+        storage_unlock();
+        pthread_mutex_unlock(&lock);
+
+        ret = backend_set(snap);
+
+        pthread_mutex_lock(&lock);
+        flushed(gen, first, start, false, ret);
+
+        if (ret < 0)
+            WARNING("Failed to persist the variables, retrying in %ums\n",
+                    backoff_ms);
+    }
+
+    alive = false;
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/**
+ * Start persisting changes from a writer thread.
+ *
+ * @parm delay_ms how long without a change before changes are persisted
+ * @parm max_delay_ms how long after a change it is persisted at the latest,
+ *                    at least delay_ms
+ * @parm sb_barrier if true, changes to secure boot variables are persisted
+ *                  before persist_changed() returns
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int persist_start(unsigned int delay_ms, unsigned int max_delay_ms,
+                  bool sb_barrier)
+{
+    pthread_condattr_t attr;
+    sigset_t all, old;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+
+    /* A stopped writer may still be waiting for the store to exit */
+    if (running || alive) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    alive = true;
+    pthread_mutex_unlock(&lock);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    delay = delay_ms;
+    max_delay = max(delay_ms, max_delay_ms);
+    barrier = sb_barrier;
+    stopping = false;
+
+    /* Signals are handled by the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&thread, NULL, writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    pthread_mutex_lock(&lock);
+
+    if (ret != 0) {
+        ERROR("Failed to start persistence thread: %d\n", ret);
+        alive = false;
+        pthread_mutex_unlock(&lock);
+        pthread_cond_destroy(&cond);
+        return -1;
+    }
+
+    running = true;
+    pthread_mutex_unlock(&lock);
+    pthread_detach(thread);
+
+    INFO("Persisting variables %ums after the last change, %ums after the "
+         "first at most%s\n", delay, max_delay,
+         sb_barrier ? ", secure boot variables immediately" : "");
+
+    return 0;
+}
+
+/**
+ * Stop the writer thread.
+ *
+ * Waits for an update in progress to complete, so that whatever the caller
+ * persists next is not overwritten by an older state.  The writer thread
+ * persists nothing afterwards, so the caller is expected to call
+ * persist_flush() if the state may be dirty.
+ */
+void persist_stop(void)
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+
+    while (busy)
+        pthread_cond_wait(&cond, &lock);
+
+    running = false;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Persist a change to the non-volatile variables, or schedule it.
+ *
+ * Must be called with the store locked for writing, see storage_write_lock().
+ *
+ * @parm secure_boot true if the change was to a secure boot variable
+ */
+void persist_changed(bool secure_boot)
+{
+    uint64_t gen = storage_nv_generation();
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&lock);
+    prune();
+
+    if (!first_dirty_ns)
+        first_dirty_ns = now;
+
+    last_dirty_ns = now;
+    dirty_gen = gen;
+    stats.changes++;
+
+    if (!running || (secure_boot && barrier)) {
+        pthread_mutex_unlock(&lock);
+        flush_now(gen);
+        return;
+    }
+
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Persist right away whatever was not persisted yet, at startup and shutdown
+ * for instance.  A failed update is tried again a few times, there may be
+ * nothing left to retry it afterwards.
+ *
+ * Must be called with the store locked for writing, or with no other thread
+ * using it.
+ *
+ * @return 0 on success, otherwise -1 and the state is still dirty.
+ */
+int persist_flush(void)
+{
+    uint64_t gen = storage_nv_generation();
+    unsigned int i, wait_ms = RETRY_MIN_MS;
+    bool dirty;
+
+    pthread_mutex_lock(&lock);
+    dirty = gen != persisted_gen || !stats.flushes;
+    pthread_mutex_unlock(&lock);
+
+    if (!dirty)
+        return 0;
+
+    for (i = 1; flush_now(gen) < 0; i++) {
+        if (i == FLUSH_ATTEMPTS) {
+            ERROR("Failed to persist the variables after %u attempts\n", i);
+            return -1;
+        }
+
+        usleep(wait_ms * 1000);
+        wait_ms *= 2;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the persistence counters since startup.
+ *
+ * @parm out set to the counters
+ */
+void persist_get_stats(struct persist_stats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
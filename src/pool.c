@@ -0,0 +1,279 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/*
+ * Pool allocator for variable data.
+ *
+ * Blocks come in power-of-two size classes from POOL_MIN_BLOCK up to
+ * MAX_CHUNKED_DATA_SIZE.  The classes up to POOL_MAX_SLAB_BLOCK carve their
+ * blocks out of slabs, each keeping its freed blocks on a free list, so
+ * rewriting or appending to a variable reuses memory instead of going back to
+ * malloc for every change, and the heap is not fragmented by payloads of every
+ * possible size.  Larger blocks come straight from the heap, a slab would only
+ * hold a couple of them.
+ *
+ * A slab whose blocks are all free is released, except for one per class kept
+ * for the next allocation, so the memory held follows the variables present
+ * rather than the most there ever were.
+ *
+ * Freed blocks are wiped before they go back on their free list so that
+ * variable data does not linger in memory after it is deleted.  It also means
+ * every block is handed out zeroed.
+ */
+#define POOL_CLASSES 14
+
+_Static_assert(((size_t)POOL_MIN_BLOCK << (POOL_CLASSES - 1)) ==
+                       MAX_CHUNKED_DATA_SIZE,
+               "the largest size class must be MAX_CHUNKED_DATA_SIZE");
+
+#define class_size(i) ((size_t)POOL_MIN_BLOCK << (i))
+
+struct free_block {
+    struct free_block *next;
+};
+
+/*
+ * The header at the start of each slab, which is aligned on its size so that
+ * a block's slab is found from its address.
+ */
+struct slab {
+    /* In the list of all slabs */
+    struct slab *next, *prev;
+    /* In the list of its class's slabs with free blocks */
+    struct slab *next_free, *prev_free;
+    struct free_block *free;
+    unsigned int class;
+    unsigned int used;
+} __attribute__((aligned(16)));
+
+#define SLAB_BLOCKS(i) ((POOL_SLAB_SIZE - sizeof(struct slab)) / class_size(i))
+
+_Static_assert((POOL_SLAB_SIZE - sizeof(struct slab)) >=
+                       2 * POOL_MAX_SLAB_BLOCK,
+               "a slab must hold at least two of its largest blocks");
+
+#define slab_of(block)                                                  \
+    ((struct slab *)((uintptr_t)(block) & ~((uintptr_t)POOL_SLAB_SIZE - 1)))
+
+static struct slab *slabs;
+static struct slab *free_slabs[POOL_CLASSES];
+static unsigned int empty_slabs[POOL_CLASSES];
+
+/* Bytes taken from the heap, slabs and large blocks */
+static size_t held;
+
+/* Returns the smallest size class that fits size */
+static unsigned int class_of(size_t size)
+{
+    unsigned int i = 0;
+
+    while (class_size(i) < size)
+        i++;
+
+    return i;
+}
+
+static void free_slabs_remove(struct slab *slab)
+{
+    if (slab->prev_free)
+        slab->prev_free->next_free = slab->next_free;
+    else
+        free_slabs[slab->class] = slab->next_free;
+
+    if (slab->next_free)
+        slab->next_free->prev_free = slab->prev_free;
+
+    slab->next_free = slab->prev_free = NULL;
+}
+
+static void free_slabs_add(struct slab *slab)
+{
+    slab->prev_free = NULL;
+    slab->next_free = free_slabs[slab->class];
+
+    if (slab->next_free)
+        slab->next_free->prev_free = slab;
+
+    free_slabs[slab->class] = slab;
+}
+
+static struct slab *slab_new(unsigned int i)
+{
+    struct slab *slab;
+    struct free_block *block;
+    size_t size = class_size(i), j;
+
+    if (posix_memalign((void **)&slab, POOL_SLAB_SIZE, POOL_SLAB_SIZE))
+        return NULL;
+
+    memset(slab, 0, POOL_SLAB_SIZE);
+    slab->class = i;
+
+    for (j = SLAB_BLOCKS(i); j > 0; j--) {
+        block = (struct free_block *)((uint8_t *)(slab + 1) + (j - 1) * size);
+        block->next = slab->free;
+        slab->free = block;
+    }
+
+    slab->next = slabs;
+
+    if (slabs)
+        slabs->prev = slab;
+
+    slabs = slab;
+    free_slabs_add(slab);
+    empty_slabs[i]++;
+    held += POOL_SLAB_SIZE;
+
+    return slab;
+}
+
+/* Release a slab whose blocks are all free, and wiped */
+static void slab_release(struct slab *slab)
+{
+    free_slabs_remove(slab);
+    empty_slabs[slab->class]--;
+
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        slabs = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    held -= POOL_SLAB_SIZE;
+    free(slab);
+}
+
+/**
+ * Returns the capacity of the block pool_alloc() would return for size.
+ */
+size_t pool_capacity(size_t size)
+{
+    return class_size(class_of(size));
+}
+
+/**
+ * Allocate a zeroed block of at least size bytes.
+ *
+ * @parm size the number of bytes needed, at most MAX_CHUNKED_DATA_SIZE
+ * @parm capacity if not NULL, set to the actual size of the block
+ *
+ * @return the block, or NULL on failure.
+ */
+void *pool_alloc(size_t size, size_t *capacity)
+{
+    struct free_block *block;
+    struct slab *slab;
+    unsigned int i;
+
+    if (size == 0 || size > MAX_CHUNKED_DATA_SIZE)
+        return NULL;
+
+    i = class_of(size);
+
+    if (class_size(i) > POOL_MAX_SLAB_BLOCK) {
+        block = calloc(1, class_size(i));
+
+        if (!block)
+            return NULL;
+
+        held += class_size(i);
+    } else {
+        slab = free_slabs[i];
+
+        if (!slab && !(slab = slab_new(i)))
+            return NULL;
+
+        if (!slab->used++)
+            empty_slabs[i]--;
+
+        block = slab->free;
+        slab->free = block->next;
+        block->next = NULL;
+
+        if (!slab->free)
+            free_slabs_remove(slab);
+    }
+
+    if (capacity)
+        *capacity = class_size(i);
+
+    return block;
+}
+
+/**
+ * Wipe a block and return it to the pool.
+ *
+ * @parm block a block from pool_alloc(), or NULL
+ * @parm capacity the capacity pool_alloc() returned for the block
+ */
+void pool_free(void *block, size_t capacity)
+{
+    struct free_block *p = block;
+    struct slab *slab;
+    unsigned int i;
+
+    if (!block)
+        return;
+
+    i = class_of(capacity);
+
+    explicit_bzero(block, class_size(i));
+
+    if (class_size(i) > POOL_MAX_SLAB_BLOCK) {
+        held -= class_size(i);
+        free(block);
+        return;
+    }
+
+    slab = slab_of(block);
+
+    if (!slab->free)
+        free_slabs_add(slab);
+
+    p->next = slab->free;
+    slab->free = p;
+
+    if (--slab->used)
+        return;
+
+    /* One empty slab per class is kept for the next allocation */
+    if (empty_slabs[i]++)
+        slab_release(slab);
+}
+
+/**
+ * Returns the bytes the pool took from the heap, for the blocks handed out and
+ * those it keeps free.
+ */
+size_t pool_held(void)
+{
+    return held;
+}
+
+/**
+ * Wipe and release all slabs held by the pool.
+ *
+ * Every block handed out by the pool from a slab becomes invalid.  Larger
+ * blocks are only released by pool_free().
+ */
+void pool_destroy(void)
+{
+    struct slab *slab, *next;
+
+    for (slab = slabs; slab; slab = next) {
+        next = slab->next;
+        explicit_bzero(slab, POOL_SLAB_SIZE);
+        free(slab);
+        held -= POOL_SLAB_SIZE;
+    }
+
+    slabs = NULL;
+    memset(free_slabs, 0, sizeof(free_slabs));
+    memset(empty_slabs, 0, sizeof(empty_slabs));
+}
@@ -249,10 +249,9 @@ int unserialize_var_cached(const uint8_t **ptr, variable_t *var)
     EFI_TIME timestamp;
     UTF16 name[MAX_VARIABLE_NAME_SIZE] = { 0 };
     EFI_GUID guid;
-    uint8_t *data;
+    const uint8_t *data;
     uint64_t namesz, datasz;
     uint32_t attrs;
-    int ret;
 
     if (!ptr || !var)
         return -1;
@@ -270,12 +269,8 @@ int unserialize_var_cached(const uint8_t **ptr, variable_t *var)
     if (datasz == 0)
         return -1;
 
-    data = malloc(datasz);
-
-    if (!data)
-        return -1;
-
-    memcpy(data, *ptr, datasz);
+    /* Copied straight out of the buffer by variable_create_noalloc() */
+    data = *ptr;
     *ptr += datasz;
 
     unserialize_guid(ptr, &guid);
@@ -283,12 +278,8 @@ int unserialize_var_cached(const uint8_t **ptr, variable_t *var)
     unserialize_timestamp(ptr, &timestamp);
     unserialize_cert(ptr, cert);
 
-    ret = variable_create_noalloc(var, name, namesz, data, datasz, &guid, attrs,
-                                  &timestamp, cert);
-
-    free(data);
-
-    return ret;
+    return variable_create_noalloc(var, name, namesz, data, datasz, &guid,
+                                   attrs, &timestamp, cert);
 }
 
 void unserialize_timestamp(const uint8_t **p, EFI_TIME *timestamp)
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
 
 #include "storage.h"
 #include "common.h"
@@ -16,47 +18,861 @@
 #define rt_deny_access(attrs)                                                  \
     (efi_at_runtime && !(attrs & EFI_VARIABLE_RUNTIME_ACCESS))
 
-extern bool efi_at_runtime;
+extern __thread bool efi_at_runtime;
+
+/*
+ * Requests may be served by several threads at once (see handler_loop()).
+ * They share the store through this lock: lookups and enumeration hold it for
+ * reading, and anything that changes the store holds it for writing, see
+ * storage_read_lock() and storage_write_lock().  The store itself does no
+ * locking.
+ */
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Variables live in slab chunks of VAR_CHUNK_SIZE entries that are allocated
+ * as the store grows and freed again once they empty out, so memory use
+ * follows the number of variables actually present.  An entry never moves
+ * while its variable is alive, so variable_t pointers handed out by the store
+ * stay valid until that variable is removed.
+ *
+ * Chunks with free entries are kept at the front of the chunk list and full
+ * chunks at the back, so both allocating and freeing an entry are O(1).
+ *
+ * Entries are cache line aligned, and everything a lookup or an enumeration
+ * step looks at (the order links, the cached hash and the hot half of
+ * variable_t) fits in the first line.
+ */
+#define CACHE_LINE 64
+
+struct var_chunk;
+
+/*
+ * Besides the enumeration order, every live variable is on the membership
+ * list of each attribute class it belongs to, see class_lists.  A variable is
+ * either non-volatile or volatile, so both share one link, and it may also be
+ * runtime-accessible.
+ */
+enum {
+    LINK_PERSISTENCE,
+    LINK_RUNTIME,
+    LINK_COUNT
+};
+
+struct class_link {
+    struct entry *next;
+    struct entry *prev;
+};
+
+struct entry {
+    /* Enumeration order, see order_append() */
+    struct entry *next;
+    struct entry *prev;
+
+    /* variable_hash() of the key, so the index can be rebuilt without it */
+    uint32_t hash;
+
+    variable_t var;
+
+    struct class_link links[LINK_COUNT];
+
+    struct var_chunk *chunk;
+    struct entry *next_free;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct var_chunk {
+    struct var_chunk *prev;
+    struct var_chunk *next;
+    struct entry *free;
+    size_t live;
+    struct entry entries[VAR_CHUNK_SIZE];
+};
+
+#define entry_of(v)                                                            \
+    ((struct entry *)((uint8_t *)(v) - offsetof(struct entry, var)))
+
+_Static_assert(offsetof(struct entry, var) + offsetof(variable_t, data) <=
+               CACHE_LINE, "hot fields must fit in the first cache line");
+
+static struct var_chunk *chunks_head;
+static struct var_chunk *chunks_tail;
+static size_t chunk_count;
 
-static variable_t variables[MAX_VAR_COUNT];
 static size_t total;
+
+/*
+ * Bytes charged to the domain for its variables, see footprint().  Kept up to
+ * date on every change so that storage_used() is O(1).
+ */
 static uint64_t used;
+static uint64_t quota = DEFAULT_STORAGE_QUOTA;
+
+/*
+ * The fixed cost of a variable beyond its name and data: the rest of its entry,
+ * i.e. GUID, attributes, timestamp, cert and the store's own bookkeeping.
+ */
+#define VARIABLE_OVERHEAD (sizeof(struct entry) - MAX_VARIABLE_NAME_SIZE)
+
+static inline uint64_t footprint(size_t namesz, size_t datasz)
+{
+    return namesz + datasz + VARIABLE_OVERHEAD;
+}
+
+/* The most data a change by this thread may leave a variable with */
+static __thread size_t data_limit = MAX_CHUNKED_DATA_SIZE;
+
+/*
+ * Every change to the store gets the next generation number.  Live variables
+ * record the generation of their last change in last_modified_gen, deletions
+ * are remembered as tombstones, so that backends can find out what changed
+ * since a given generation (see storage_changes_since()).
+ *
+ * Tombstones are kept in generation order until the deletions are persisted
+ * (see persist.c).  At most MAX_TOMBSTONES are kept, dropping the oldest ones
+ * first, after which changes before tombstone_floor can no longer be
+ * reported.
+ */
+#define MAX_TOMBSTONES 1024
+
+struct tombstone {
+    struct tombstone *next;
+    uint64_t gen;
+    EFI_GUID guid;
+    uint32_t attrs;
+    uint64_t namesz;
+    UTF16 name[];
+};
+
+static uint64_t generation;
+static uint64_t tombstone_floor;
+static struct tombstone *tombstones_head;
+static struct tombstone *tombstones_tail;
+static size_t tombstone_count;
+
+static void tombstone_drop_oldest(void)
+{
+    struct tombstone *t = tombstones_head;
+
+    tombstones_head = t->next;
+
+    if (!tombstones_head)
+        tombstones_tail = NULL;
+
+    tombstone_floor = t->gen;
+    tombstone_count--;
+    free(t);
+}
+
+/*
+ * Remember that var is being deleted.  If no memory is left for it, the
+ * deletion is still carried out but changes up to it can no longer be
+ * reported.
+ */
+static void tombstone_add(const variable_t *var, uint64_t gen)
+{
+    struct tombstone *t;
+
+    t = malloc(sizeof(*t) + var->namesz);
+
+    if (!t) {
+        while (tombstones_head)
+            tombstone_drop_oldest();
+
+        tombstone_floor = gen;
+        return;
+    }
+
+    t->next = NULL;
+    t->gen = gen;
+    memcpy(&t->guid, &var->guid, sizeof(t->guid));
+    t->attrs = var->attrs;
+    t->namesz = var->namesz;
+    memcpy(t->name, var->name, var->namesz);
+
+    if (tombstones_tail)
+        tombstones_tail->next = t;
+    else
+        tombstones_head = t;
+
+    tombstones_tail = t;
+
+    if (++tombstone_count > MAX_TOMBSTONES)
+        tombstone_drop_oldest();
+}
+
+/*
+ * A transaction groups several changes so that they are either all kept or
+ * all undone, see storage_begin().  Changes are applied to the store as they
+ * are made, and the previous state of every key touched is kept in an undo
+ * log (most recent first).  Thanks to copy-on-write payloads, saving the
+ * previous state of a variable does not copy its data.
+ */
+struct undo {
+    struct undo *next;
+    uint32_t hash;
+
+    /* If false, only the key of old is set and the variable did not exist */
+    bool existed;
+    variable_t old;
+};
+
+static struct {
+    bool active;
+    uint64_t start_gen;
+    uint64_t start_nv_gen;
+    struct undo *log;
+} txn;
+
+/* All changes made in one transaction share a generation */
+static uint64_t next_generation(void)
+{
+    if (txn.active) {
+        if (generation == txn.start_gen)
+            generation++;
+
+        return generation;
+    }
+
+    return ++generation;
+}
+
+/*
+ * The generation of the last change to a non-volatile variable.  Changes to
+ * volatile variables leave it alone, so they never need to be persisted.
+ */
+static uint64_t nv_generation;
+
+/* Returns the generation of a new change to var */
+static uint64_t change_generation(const variable_t *var)
+{
+    uint64_t gen = next_generation();
+
+    if (var->attrs & EFI_VARIABLE_NON_VOLATILE)
+        nv_generation = gen;
+
+    return gen;
+}
+
+static void txn_end(void)
+{
+    struct undo *undo, *next;
+
+    for (undo = txn.log; undo; undo = next) {
+        next = undo->next;
+        variable_destroy_noalloc(&undo->old);
+        free(undo);
+    }
+
+    txn.log = NULL;
+    txn.active = false;
+}
+
+/* Returns true if bytes more can be used without exceeding the quota */
+static inline bool quota_allows(uint64_t bytes)
+{
+    return used <= quota && bytes <= quota - used;
+}
+
+static void chunk_unlink(struct var_chunk *chunk)
+{
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        chunks_head = chunk->next;
+
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+    else
+        chunks_tail = chunk->prev;
+
+    chunk->prev = NULL;
+    chunk->next = NULL;
+}
+
+static void chunk_push_front(struct var_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = chunks_head;
+
+    if (chunks_head)
+        chunks_head->prev = chunk;
+    else
+        chunks_tail = chunk;
+
+    chunks_head = chunk;
+}
+
+static void chunk_push_back(struct var_chunk *chunk)
+{
+    chunk->prev = chunks_tail;
+    chunk->next = NULL;
+
+    if (chunks_tail)
+        chunks_tail->next = chunk;
+    else
+        chunks_head = chunk;
+
+    chunks_tail = chunk;
+}
+
+static struct var_chunk *chunk_new(void)
+{
+    struct var_chunk *chunk;
+    size_t i;
+
+    if (posix_memalign((void **)&chunk, CACHE_LINE, sizeof(*chunk)) != 0)
+        return NULL;
+
+    memset(chunk, 0, sizeof(*chunk));
+
+    for (i = 0; i < VAR_CHUNK_SIZE; i++) {
+        chunk->entries[i].chunk = chunk;
+        chunk->entries[i].next_free =
+                i + 1 < VAR_CHUNK_SIZE ? &chunk->entries[i + 1] : NULL;
+    }
+
+    chunk->free = &chunk->entries[0];
+    chunk_push_front(chunk);
+    chunk_count++;
+
+    return chunk;
+}
+
+static struct entry *entry_alloc(void)
+{
+    struct var_chunk *chunk = chunks_head;
+    struct entry *e;
+
+    if (!chunk || !chunk->free) {
+        chunk = chunk_new();
+
+        if (!chunk)
+            return NULL;
+    }
+
+    e = chunk->free;
+    chunk->free = e->next_free;
+    chunk->live++;
+    e->next_free = NULL;
+
+    /* Full chunks go to the back */
+    if (!chunk->free && chunk != chunks_tail) {
+        chunk_unlink(chunk);
+        chunk_push_back(chunk);
+    }
+
+    return e;
+}
+
+/*
+ * Bumped whenever an entry is freed, which invalidates every thread's
+ * last_lookup (see storage_find_variable_cached()).
+ */
+static uint64_t free_epoch;
+
+static void entry_free(struct entry *e)
+{
+    struct var_chunk *chunk = e->chunk;
+    bool was_full = !chunk->free;
+
+    free_epoch++;
+
+    memset(e, 0, sizeof(*e));
+    e->chunk = chunk;
+    e->next_free = chunk->free;
+    chunk->free = e;
+    chunk->live--;
+
+    /* Keep one chunk around so a set/delete cycle does not thrash malloc */
+    if (chunk->live == 0 && chunk_count > 1) {
+        chunk_unlink(chunk);
+        free(chunk);
+        chunk_count--;
+        return;
+    }
+
+    if (was_full && chunk != chunks_head) {
+        chunk_unlink(chunk);
+        chunk_push_front(chunk);
+    }
+}
+
+/*
+ * Live variables are kept on a doubly linked list in insertion order.  This is
+ * the order GetNextVariableName() returns them in, so every enumeration step is
+ * a hash lookup of the previous name followed by one link traversal.  Deleting
+ * a variable unlinks it without disturbing the order of the others, and new
+ * variables are appended to the tail so an enumeration in progress picks them
+ * up at the end.
+ */
+static struct entry *order_head;
+static struct entry *order_tail;
+
+/*
+ * The key of the most recently removed variable and its successor.
+ *
+ * Callers commonly delete the variable they just got from GetNextVariableName()
+ * and then pass it back in as the previous name.  This lets the enumeration
+ * resume where it left off instead of ending early.
+ */
+static struct {
+    bool valid;
+    UTF16 name[MAX_VARIABLE_NAME_CHARS];
+    uint64_t namesz;
+    EFI_GUID guid;
+    struct entry *next;
+} removed_cursor;
+
+static void order_append(struct entry *e)
+{
+    e->prev = order_tail;
+    e->next = NULL;
+
+    if (order_tail)
+        order_tail->next = e;
+    else
+        order_head = e;
+
+    order_tail = e;
+
+    /* The removed variable was last, its new successor is this one */
+    if (removed_cursor.valid && !removed_cursor.next)
+        removed_cursor.next = e;
+}
+
+static void order_unlink(struct entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        order_head = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        order_tail = e->prev;
+
+    if (removed_cursor.next == e)
+        removed_cursor.next = e->next;
+
+    removed_cursor.valid = true;
+    memcpy(removed_cursor.name, e->var.name, e->var.namesz);
+    removed_cursor.namesz = e->var.namesz;
+    memcpy(&removed_cursor.guid, &e->var.guid, sizeof(removed_cursor.guid));
+    removed_cursor.next = e->next;
+
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+/*
+ * Membership lists of the attribute classes.  Attributes never change while a
+ * variable is alive (see storage_set_hashed()), so a variable joins its lists
+ * when it is added and leaves them when it is removed.  Each list keeps the
+ * enumeration order, so serializing the non-volatile variables or enumerating
+ * at runtime only visits the variables concerned.
+ */
+enum {
+    CLASS_NONVOLATILE,
+    CLASS_VOLATILE,
+    CLASS_RUNTIME,
+    CLASS_COUNT
+};
+
+struct class_list {
+    struct entry *head;
+    struct entry *tail;
+    size_t count;
+};
+
+static struct class_list class_lists[CLASS_COUNT];
+
+static const unsigned int class_link[CLASS_COUNT] = {
+    [CLASS_NONVOLATILE] = LINK_PERSISTENCE,
+    [CLASS_VOLATILE] = LINK_PERSISTENCE,
+    [CLASS_RUNTIME] = LINK_RUNTIME,
+};
+
+static void class_append(unsigned int class, struct entry *e)
+{
+    struct class_list *list = &class_lists[class];
+    struct class_link *link = &e->links[class_link[class]];
+
+    link->prev = list->tail;
+    link->next = NULL;
+
+    if (list->tail)
+        list->tail->links[class_link[class]].next = e;
+    else
+        list->head = e;
+
+    list->tail = e;
+    list->count++;
+}
+
+static void class_unlink(unsigned int class, struct entry *e)
+{
+    struct class_list *list = &class_lists[class];
+    struct class_link *link = &e->links[class_link[class]];
+
+    if (link->prev)
+        link->prev->links[class_link[class]].next = link->next;
+    else
+        list->head = link->next;
+
+    if (link->next)
+        link->next->links[class_link[class]].prev = link->prev;
+    else
+        list->tail = link->prev;
+
+    link->prev = NULL;
+    link->next = NULL;
+    list->count--;
+}
+
+static void classes_add(struct entry *e)
+{
+    if (e->var.attrs & EFI_VARIABLE_NON_VOLATILE)
+        class_append(CLASS_NONVOLATILE, e);
+    else
+        class_append(CLASS_VOLATILE, e);
+
+    if (e->var.attrs & EFI_VARIABLE_RUNTIME_ACCESS)
+        class_append(CLASS_RUNTIME, e);
+}
+
+static void classes_remove(struct entry *e)
+{
+    if (e->var.attrs & EFI_VARIABLE_NON_VOLATILE)
+        class_unlink(CLASS_NONVOLATILE, e);
+    else
+        class_unlink(CLASS_VOLATILE, e);
+
+    if (e->var.attrs & EFI_VARIABLE_RUNTIME_ACCESS)
+        class_unlink(CLASS_RUNTIME, e);
+}
+
+/*
+ * Open-addressing (linear probing) hash index over the live entries, keyed on
+ * the variable's (GUID, name).  Each slot caches the full hash so that a probe
+ * only touches a variable_t when the hashes match.  The table is kept at most
+ * half full by doubling it as variables are added, and is halved again when it
+ * drops below an eighth full, so probe sequences stay short.
+ */
+#define INDEX_MIN_SIZE 64
+
+_Static_assert((INDEX_MIN_SIZE & (INDEX_MIN_SIZE - 1)) == 0,
+               "INDEX_MIN_SIZE must be a power of 2");
+
+struct index_slot {
+    uint32_t hash;
+    struct entry *entry; /* NULL if empty */
+};
+
+static struct index_slot *var_index;
+static size_t index_size;
+
+#define index_mask() (index_size - 1)
+
+/* The name is compared last, it is the only part outside the hot line */
+static inline bool key_eq(const variable_t *var, const UTF16 *name,
+                          size_t namesz, const EFI_GUID *guid)
+{
+    /* Names are stored without their null-terminator */
+    namesz = variable_stored_namesz(name, namesz);
+
+    return var->namesz == namesz &&
+           memcmp(&var->guid, guid, sizeof(var->guid)) == 0 &&
+           memcmp(var->name, name, namesz) == 0;
+}
+
+/**
+ * Returns the index slot holding the variable with key (name, guid), or the
+ * empty slot that ends its probe sequence if the variable does not exist.
+ *
+ * The index must have been allocated.
+ */
+static struct index_slot *index_probe(const UTF16 *name, size_t namesz,
+                                      const EFI_GUID *guid, uint32_t hash)
+{
+    struct index_slot *slot;
+    size_t i;
+
+    for (i = hash & index_mask();; i = (i + 1) & index_mask()) {
+        slot = &var_index[i];
+
+        if (!slot->entry)
+            return slot;
+
+        if (slot->hash == hash &&
+            key_eq(&slot->entry->var, name, namesz, guid))
+            return slot;
+    }
+}
+
+static variable_t *index_lookup(const UTF16 *name, size_t namesz,
+                                const EFI_GUID *guid, uint32_t hash)
+{
+    struct index_slot *slot;
+
+    if (!name || !guid || !var_index)
+        return NULL;
+
+    slot = index_probe(name, namesz, guid, hash);
+
+    if (!slot->entry)
+        return NULL;
+
+    return &slot->entry->var;
+}
+
+/*
+ * The last variable found by storage_find_variable_cached() in this thread.
+ * Entries never move, so it stays valid until one is freed.
+ */
+struct lookup_cache {
+    uint64_t epoch;
+    uint32_t hash;
+    variable_t *var;
+};
+
+static __thread struct lookup_cache last_lookup;
+
+static void index_place(struct entry *e, uint32_t hash)
+{
+    size_t i;
+
+    for (i = hash & index_mask(); var_index[i].entry;
+         i = (i + 1) & index_mask())
+        ;
+
+    var_index[i].hash = hash;
+    var_index[i].entry = e;
+}
+
+/**
+ * Reallocate the index with size slots and reinsert every live variable.
+ *
+ * Returns 0 on success, or -1 if the new table could not be allocated, in which
+ * case the current index is left untouched.
+ */
+static int index_resize(size_t size)
+{
+    struct index_slot *old = var_index;
+    struct entry *e;
+
+    var_index = calloc(size, sizeof(*var_index));
+
+    if (!var_index) {
+        var_index = old;
+        return -1;
+    }
+
+    free(old);
+    index_size = size;
+
+    for (e = order_head; e; e = e->next)
+        index_place(e, e->hash);
+
+    return 0;
+}
+
+/**
+ * Make sure the index has room for one more variable.
+ */
+static int index_reserve(void)
+{
+    if (!var_index)
+        return index_resize(INDEX_MIN_SIZE);
+
+    if ((total + 1) * 2 > index_size)
+        return index_resize(index_size * 2);
+
+    return 0;
+}
+
+/**
+ * Shrink the index after deletes.  Failing to shrink is harmless.
+ */
+static void index_trim(void)
+{
+    if (index_size > INDEX_MIN_SIZE && total * 8 < index_size)
+        index_resize(index_size / 2);
+}
+
+/**
+ * Remove a slot from the index.
+ *
+ * Uses backward-shift deletion so that no tombstones are needed: any entry
+ * further along the probe sequence that could live in the freed slot is moved
+ * back into it.
+ */
+static void index_delete(struct index_slot *slot)
+{
+    size_t i, j, home;
+
+    i = slot - var_index;
+    j = i;
+
+    while (true) {
+        j = (j + 1) & index_mask();
+
+        if (!var_index[j].entry)
+            break;
+
+        home = var_index[j].hash & index_mask();
+
+        /* Skip entries whose home slot lies cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        var_index[i] = var_index[j];
+        i = j;
+    }
+
+    var_index[i].hash = 0;
+    var_index[i].entry = NULL;
+}
+
+/* The variable held by e, or NULL */
+static inline variable_t *entry_var(struct entry *e)
+{
+    return e ? &e->var : NULL;
+}
 
 static inline bool is_delete(uint32_t attrs, size_t datasz)
 {
     return datasz == 0 || attrs == 0;
 }
 
+/**
+ * Lock the store for reading.  Any number of readers may hold it at once, as
+ * long as there is no writer.
+ */
+void storage_read_lock(void)
+{
+    pthread_rwlock_rdlock(&store_lock);
+}
+
+/**
+ * Lock the store for writing, excluding every other reader and writer.
+ */
+void storage_write_lock(void)
+{
+    pthread_rwlock_wrlock(&store_lock);
+}
+
+void storage_unlock(void)
+{
+    pthread_rwlock_unlock(&store_lock);
+}
+
 size_t storage_count(void)
 {
     return total;
 }
 
+/**
+ * Returns the number of non-volatile variables.
+ */
+size_t storage_count_nonvolatile(void)
+{
+    return class_lists[CLASS_NONVOLATILE].count;
+}
+
+/**
+ * Returns the number of variables the store can hold without allocating.
+ */
+size_t storage_capacity(void)
+{
+    return chunk_count * VAR_CHUNK_SIZE;
+}
+
 void storage_destroy(void)
 {
-    size_t i;
-    variable_t *var;
+    struct entry *e;
+    struct var_chunk *chunk, *next;
+
+    for (e = order_head; e; e = e->next)
+        variable_destroy_noalloc(&e->var);
 
+    for (chunk = chunks_head; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    free(var_index);
+    var_index = NULL;
+    index_size = 0;
+    free_epoch++;
+
+    chunks_head = NULL;
+    chunks_tail = NULL;
+    chunk_count = 0;
     total = 0;
     used = 0;
+    quota = DEFAULT_STORAGE_QUOTA;
 
-    for_each_variable(variables, var, i)
-    {
-        variable_destroy_noalloc(var);
-    }
+    memset(&removed_cursor, 0, sizeof(removed_cursor));
+    order_head = NULL;
+    order_tail = NULL;
+    memset(class_lists, 0, sizeof(class_lists));
+
+    txn_end();
 
-    memset(variables, 0, sizeof(variables));
+    while (tombstones_head)
+        tombstone_drop_oldest();
+
+    generation = 0;
+    nv_generation = 0;
+    tombstone_floor = 0;
 }
 
 bool storage_exists(const UTF16 *name, size_t namesz, const EFI_GUID *guid)
 {
-    return !!find_variable(name, namesz, guid, variables, MAX_VAR_COUNT);
+    return !!storage_find_variable(name, namesz, guid);
 }
 
 variable_t *storage_find_variable(const UTF16 *name, size_t namesz,
                                   const EFI_GUID *guid)
 {
-    return find_variable(name, namesz, guid, variables, MAX_VAR_COUNT);
+    return index_lookup(name, namesz, guid, variable_hash(name, namesz, guid));
+}
+
+/**
+ * Same as storage_find_variable(), but with the key's hash already computed
+ * by the caller (see variable_hash()).
+ */
+variable_t *storage_find_variable_hashed(const UTF16 *name, size_t namesz,
+                                         const EFI_GUID *guid, uint32_t hash)
+{
+    return index_lookup(name, namesz, guid, hash);
+}
+
+/**
+ * Same as storage_find_variable_hashed(), but remembers the variable found so
+ * that looking it up again skips the index.  This serves the guest's usual
+ * GetVariable() of the size followed by the read of the data.
+ */
+variable_t *storage_find_variable_cached(const UTF16 *name, size_t namesz,
+                                         const EFI_GUID *guid, uint32_t hash)
+{
+    variable_t *var;
+
+    if (last_lookup.var && last_lookup.epoch == free_epoch &&
+        last_lookup.hash == hash && name && guid &&
+        key_eq(last_lookup.var, name, namesz, guid))
+        return last_lookup.var;
+
+    var = index_lookup(name, namesz, guid, hash);
+
+    if (var) {
+        last_lookup.epoch = free_epoch;
+        last_lookup.hash = hash;
+        last_lookup.var = var;
+    }
+
+    return var;
 }
 
 EFI_STATUS storage_get(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
@@ -68,7 +884,7 @@ EFI_STATUS storage_get(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
         return EFI_DEVICE_ERROR;
     }
 
-    var = find_variable(name, namesz, guid, variables, MAX_VAR_COUNT);
+    var = storage_find_variable(name, namesz, guid);
 
     if (!var) {
         return EFI_NOT_FOUND;
@@ -102,7 +918,7 @@ EFI_STATUS storage_get_var_ptr(variable_t **var, const UTF16 *name,
         return EFI_DEVICE_ERROR;
     }
 
-    *var = find_variable(name, namesz, guid, variables, MAX_VAR_COUNT);
+    *var = storage_find_variable(name, namesz, guid);
 
     if (!*var) {
         return EFI_NOT_FOUND;
@@ -111,89 +927,154 @@ EFI_STATUS storage_get_var_ptr(variable_t **var, const UTF16 *name,
     return EFI_SUCCESS;
 }
 
-static size_t storage_iter_index = 0;
-
-EFI_STATUS storage_iter(variable_t *var)
+/**
+ * Take a snapshot of the store, in enumeration order.
+ *
+ * Variables are shared into vars with variable_share(), so no data is copied,
+ * and later changes to the store do not affect the snapshot.  The caller
+ * releases it by calling variable_destroy_noalloc() on each variable.
+ *
+ * @parm vars an array of at least n zeroed variables
+ * @parm n the size of vars
+ * @parm nonvolatile if true, only include non-volatile variables
+ *
+ * @return the number of variables stored in vars.
+ */
+size_t storage_snapshot(variable_t *vars, size_t n, bool nonvolatile)
 {
-    variable_t *p;
+    struct entry *e;
+    size_t cnt = 0;
 
-    while (storage_iter_index < MAX_VAR_COUNT) {
-        p = &variables[storage_iter_index];
+    if (!vars)
+        return 0;
 
-        if (!p)
-            goto err;
+    if (nonvolatile) {
+        for (e = class_lists[CLASS_NONVOLATILE].head; e && cnt < n;
+             e = e->links[LINK_PERSISTENCE].next)
+            variable_share(&vars[cnt++], &e->var);
 
-        storage_iter_index++;
+        return cnt;
+    }
 
-        if (!variable_is_valid(p))
-            continue;
+    for (e = order_head; e && cnt < n; e = e->next)
+        variable_share(&vars[cnt++], &e->var);
 
-        if (variable_copy(var, p) < 0)
-            goto err;
+    return cnt;
+}
 
-        break;
-    }
+/**
+ * Save the current state of the key (name, guid) in the undo log, if a
+ * transaction is active.
+ *
+ * Returns 0 on success, otherwise -1.
+ */
+static int txn_record(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
+                      uint32_t hash)
+{
+    struct undo *undo;
+    variable_t *var;
 
-    /* Reached all variables */
-    if (storage_iter_index >= MAX_VAR_COUNT) {
-        storage_iter_index = 0;
-        return EFI_NOT_FOUND;
+    if (!txn.active)
+        return 0;
+
+    undo = calloc(1, sizeof(*undo));
+
+    if (!undo)
+        return -1;
+
+    var = index_lookup(name, namesz, guid, hash);
+
+    if (var) {
+        variable_share(&undo->old, var);
+        undo->existed = true;
+    } else {
+        memcpy(undo->old.name, name, namesz);
+        undo->old.namesz = namesz;
+        memcpy(&undo->old.guid, guid, sizeof(undo->old.guid));
     }
 
-    return EFI_SUCCESS;
+    undo->hash = hash;
+    undo->next = txn.log;
+    txn.log = undo;
 
-err:
-    storage_iter_index = 0;
-    return EFI_DEVICE_ERROR;
+    return 0;
 }
 
-EFI_STATUS storage_remove(const UTF16 *name, size_t namesz,
-                          const EFI_GUID *guid)
+/* Remove the variable in slot from the store, without leaving a tombstone */
+static void entry_remove(struct index_slot *slot)
 {
-    size_t i;
-    variable_t *var;
+    struct entry *e = slot->entry;
+
+    used -= footprint(e->var.namesz, e->var.datasz);
+    index_delete(slot);
+    order_unlink(e);
+    classes_remove(e);
+    variable_destroy_noalloc(&e->var);
+    entry_free(e);
+    total--;
+
+    index_trim();
+}
+
+static EFI_STATUS storage_remove_hashed(const UTF16 *name, size_t namesz,
+                                        const EFI_GUID *guid, uint32_t hash)
+{
+    struct index_slot *slot;
 
     if (!name || !guid)
         return EFI_DEVICE_ERROR;
 
-    for_each_variable(variables, var, i)
-    {
-        if (var->namesz != namesz)
-            continue;
+    if (!var_index)
+        return EFI_NOT_FOUND;
 
-        if (memcmp(var->name, name, var->namesz) == 0 &&
-            memcmp(&var->guid, guid, sizeof(var->guid)) == 0) {
-            variable_destroy_noalloc(var);
-            used -= (MAX_VARIABLE_NAME_SIZE + MAX_VARIABLE_DATA_SIZE);
-            total--;
-            return EFI_SUCCESS;
-        }
-    }
+    slot = index_probe(name, namesz, guid, hash);
 
     /* Not found */
-    return EFI_NOT_FOUND;
+    if (!slot->entry)
+        return EFI_NOT_FOUND;
+
+    if (txn_record(name, namesz, guid, hash) < 0)
+        return EFI_OUT_OF_RESOURCES;
+
+    /* txn_record() may not move index slots, so slot is still valid */
+    tombstone_add(&slot->entry->var, change_generation(&slot->entry->var));
+    entry_remove(slot);
+
+    return EFI_SUCCESS;
 }
 
-EFI_STATUS storage_set(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
-                       const void *data, size_t datasz, uint32_t attrs)
+EFI_STATUS storage_remove(const UTF16 *name, size_t namesz,
+                          const EFI_GUID *guid)
+{
+    return storage_remove_hashed(name, namesz, guid,
+                                 variable_hash(name, namesz, guid));
+}
+
+/**
+ * Same as storage_set(), but with the key's hash already computed by the
+ * caller (see variable_hash()).
+ */
+EFI_STATUS storage_set_hashed(const UTF16 *name, size_t namesz,
+                              const EFI_GUID *guid, uint32_t hash,
+                              const void *data, size_t datasz, uint32_t attrs)
 {
     bool append;
-    size_t i;
     int ret;
+    uint64_t oldsz, newsz;
     variable_t *var;
+    struct entry *e;
 
     if (!name || !guid)
         return EFI_DEVICE_ERROR;
 
-    if (namesz > MAX_VARIABLE_NAME_SIZE || datasz > MAX_VARIABLE_DATA_SIZE ||
-        datasz + namesz + storage_used() > MAX_STORAGE_SIZE)
+    if (namesz > MAX_VARIABLE_NAME_SIZE || datasz > data_limit)
         return EFI_OUT_OF_RESOURCES;
 
     append = !!(attrs & EFI_VARIABLE_APPEND_WRITE);
 
     /* As specified by the UEFI spec */
     if ((datasz == 0 && !append) || attrs == 0)
-        return storage_remove(name, namesz, guid);
+        return storage_remove_hashed(name, namesz, guid, hash);
 
     /* Caller passed in a null pointer as data */
     if (!data)
@@ -201,55 +1082,90 @@ EFI_STATUS storage_set(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
 
     attrs &= ~EFI_VARIABLE_APPEND_WRITE;
 
+    if (txn_record(name, namesz, guid, hash) < 0)
+        return EFI_OUT_OF_RESOURCES;
+
     /* If it already exists, replace it */
-    for_each_variable(variables, var, i)
-    {
-        if (var->namesz != namesz) {
-            continue;
-        }
+    var = index_lookup(name, namesz, guid, hash);
 
-        if (memcmp(var->name, name, var->namesz) == 0 &&
-            memcmp(&var->guid, guid, sizeof(EFI_GUID)) == 0) {
+    if (var) {
+        if (var->attrs != attrs)
+            return EFI_INVALID_PARAMETER;
 
-            if (var->attrs != attrs)
-                return EFI_INVALID_PARAMETER;
+        oldsz = var->datasz;
+        newsz = append ? oldsz + datasz : datasz;
 
-            ret = variable_set_name(var, name, namesz);
+        if (newsz > oldsz &&
+            (newsz > data_limit || !quota_allows(newsz - oldsz)))
+            return EFI_OUT_OF_RESOURCES;
 
-            if (ret == -2)
-                return EFI_OUT_OF_RESOURCES;
-            else if (ret < 0)
-                return EFI_DEVICE_ERROR;
+        ret = variable_set_data(var, data, datasz, append);
 
-            ret = variable_set_data(var, data, datasz, append);
+        if (ret == -2)
+            return EFI_OUT_OF_RESOURCES;
+        else if (ret < 0)
+            return EFI_DEVICE_ERROR;
 
-            if (ret == -2)
-                return EFI_OUT_OF_RESOURCES;
-            else if (ret < 0)
-                return EFI_DEVICE_ERROR;
+        used = used - oldsz + var->datasz;
+        var->last_modified_gen = change_generation(var);
 
-            memcpy(&var->attrs, &attrs, sizeof(var->attrs));
-            return EFI_SUCCESS;
-        }
+        return EFI_SUCCESS;
     }
 
-    /* If it is completely new, place it in the first found empty slot */
-    for_each_variable(variables, var, i)
-    {
-        if (var->name[0] == 0) {
-            ret = variable_create_noalloc(var, name, namesz, data, datasz, guid,
-                                          attrs, NULL, NULL);
+    if (!quota_allows(footprint(variable_stored_namesz(name, namesz), datasz)))
+        return EFI_OUT_OF_RESOURCES;
+
+    /* It is completely new, so make room for it */
+    if (index_reserve() < 0)
+        return EFI_OUT_OF_RESOURCES;
 
-            if (ret < 0)
-                return EFI_DEVICE_ERROR;
+    e = entry_alloc();
 
-            total++;
-            used += MAX_VARIABLE_NAME_SIZE + MAX_VARIABLE_DATA_SIZE;
-            return EFI_SUCCESS;
-        }
+    if (!e)
+        return EFI_OUT_OF_RESOURCES;
+
+    ret = variable_create_noalloc(&e->var, name, namesz, data, datasz, guid,
+                                  attrs, NULL, NULL);
+
+    if (ret < 0) {
+        variable_destroy_noalloc(&e->var);
+        entry_free(e);
+        return EFI_DEVICE_ERROR;
     }
 
-    return EFI_DEVICE_ERROR;
+    /* Over the name as it was stored, like every lookup */
+    e->hash = variable_hash(e->var.name, e->var.namesz, &e->var.guid);
+    e->var.last_modified_gen = change_generation(&e->var);
+    index_place(e, e->hash);
+    order_append(e);
+    classes_add(e);
+    total++;
+    used += footprint(e->var.namesz, e->var.datasz);
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * Limit the data that changes made by this thread may leave a variable with,
+ * MAX_CHUNKED_DATA_SIZE at most, which is also the default.
+ *
+ * A variable above MAX_VARIABLE_DATA_SIZE can only be read in chunks, so the
+ * guest's SetVariable requests are limited to that, appends included, unless
+ * the data came in chunks.
+ *
+ * @parm max the most bytes of data
+ */
+void storage_limit_data(size_t max)
+{
+    data_limit = min(max, (size_t)MAX_CHUNKED_DATA_SIZE);
+}
+
+EFI_STATUS storage_set(const UTF16 *name, size_t namesz, const EFI_GUID *guid,
+                       const void *data, size_t datasz, uint32_t attrs)
+{
+    return storage_set_hashed(name, namesz, guid,
+                              variable_hash(name, namesz, guid), data, datasz,
+                              attrs);
 }
 
 EFI_STATUS storage_set_with_timestamp(const UTF16 *name, size_t namesz,
@@ -265,8 +1181,8 @@ EFI_STATUS storage_set_with_timestamp(const UTF16 *name, size_t namesz,
 
     status = storage_set(name, namesz, guid, data, datasz, attrs);
 
-    /* If this variable was deleted, then we are done */
-    if (is_delete(attrs, datasz))
+    /* If this variable was deleted, or nothing was set, then we are done */
+    if (status != EFI_SUCCESS || is_delete(attrs, datasz))
         return status;
 
     /* Set the timestamp */
@@ -278,85 +1194,323 @@ EFI_STATUS storage_set_with_timestamp(const UTF16 *name, size_t namesz,
     if (variable_set_timestamp(var, timestamp) < 0)
         return EFI_DEVICE_ERROR;
 
+    /* Part of the same change as the data, so no new generation */
+    var->last_modified_gen = generation;
+
     return EFI_SUCCESS;
 }
 
-uint64_t storage_used(void)
+/*
+ * Put a variable saved by txn_record() back into the store as it was.
+ */
+static int entry_restore(const variable_t *old, uint32_t hash)
 {
-    return used;
+    variable_t *var;
+    struct entry *e;
+    bool relink;
+
+    var = index_lookup(old->name, old->namesz, &old->guid, hash);
+
+    if (var) {
+        e = entry_of(var);
+        relink = var->attrs != old->attrs;
+
+        /* The class lists follow the attributes being restored */
+        if (relink)
+            classes_remove(e);
+
+        used -= var->datasz;
+        variable_share(var, old);
+        used += var->datasz;
+
+        if (relink)
+            classes_add(e);
+
+        return 0;
+    }
+
+    if (index_reserve() < 0)
+        return -1;
+
+    e = entry_alloc();
+
+    if (!e)
+        return -1;
+
+    variable_share(&e->var, old);
+    e->hash = hash;
+    index_place(e, hash);
+    order_append(e);
+    classes_add(e);
+    total++;
+    used += footprint(e->var.namesz, e->var.datasz);
+
+    return 0;
 }
 
-static variable_t *storage_get_first(void)
+/* Forget tombstones of deletions after generation gen */
+static void tombstones_truncate(uint64_t gen)
 {
-    int i;
+    struct tombstone *t, *next, *last = NULL;
 
-    if (total == 0)
-        return NULL;
+    for (t = tombstones_head; t && t->gen <= gen; t = t->next)
+        last = t;
 
-    /* Find the first variable */
-    for (i = 0; i < MAX_VAR_COUNT; i++) {
-        if (variable_is_valid(&variables[i]) &&
-            !rt_deny_access(variables[i].attrs)) {
-            break;
-        }
+    for (t = last ? last->next : tombstones_head; t; t = next) {
+        next = t->next;
+        free(t);
+        tombstone_count--;
     }
 
-    if (i >= MAX_VAR_COUNT)
-        return NULL;
+    if (last)
+        last->next = NULL;
+    else
+        tombstones_head = NULL;
 
-    return &variables[i];
+    tombstones_tail = last;
 }
 
-variable_t *storage_next_variable(UTF16 *name, size_t namesz, EFI_GUID *guid)
+/**
+ * Start a transaction.
+ *
+ * Until storage_commit() or storage_abort(), every change to the store is
+ * part of the transaction.  All of them share one generation, so persistence
+ * sees them as one change set.
+ *
+ * @return EFI_SUCCESS, or EFI_ALREADY_STARTED if a transaction is already
+ *         active (transactions do not nest).
+ */
+EFI_STATUS storage_begin(void)
 {
-    size_t i;
-    const variable_t *var;
+    if (txn.active)
+        return EFI_ALREADY_STARTED;
 
-    if (name[0] == 0 || namesz == 0) {
-        return storage_get_first();
+    txn.active = true;
+    txn.start_gen = generation;
+    txn.start_nv_gen = nv_generation;
+    txn.log = NULL;
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * Keep all changes made since storage_begin().
+ */
+void storage_commit(void)
+{
+    if (txn.active)
+        txn_end();
+}
+
+/**
+ * Undo all changes made since storage_begin().
+ *
+ * The store, its generation and its tombstones are put back as they were.
+ * Variables that were deleted during the transaction are restored at the end
+ * of the enumeration order.
+ */
+void storage_abort(void)
+{
+    struct undo *undo;
+    struct index_slot *slot;
+
+    if (!txn.active)
+        return;
+
+    /* Most recent first, so each key ends up in its oldest saved state */
+    for (undo = txn.log; undo; undo = undo->next) {
+        if (undo->existed) {
+            if (entry_restore(&undo->old, undo->hash) < 0)
+                ERROR("Failed to restore variable on abort\n");
+
+            continue;
+        }
+
+        if (!var_index)
+            continue;
+
+        slot = index_probe(undo->old.name, undo->old.namesz, &undo->old.guid,
+                           undo->hash);
+
+        if (slot->entry)
+            entry_remove(slot);
     }
 
-    /* Find the previous variable (passed in from caller) */
-    for (i = 0; i < MAX_VAR_COUNT; i++) {
-        var = &variables[i];
+    tombstones_truncate(txn.start_gen);
+    generation = txn.start_gen;
+    nv_generation = txn.start_nv_gen;
+
+    txn_end();
+}
+
+/**
+ * Returns the generation of the most recent change to a non-volatile variable.
+ *
+ * If it has not moved since the store was last persisted, there is nothing
+ * new to persist.
+ */
+uint64_t storage_nv_generation(void)
+{
+    return nv_generation;
+}
+
+/**
+ * Returns the generation of the most recent change to the store.
+ *
+ * It starts at zero for an empty store and increases with every set,
+ * append or delete.
+ */
+uint64_t storage_generation(void)
+{
+    return generation;
+}
+
+/**
+ * Report every change made to the store after generation since.
+ *
+ * fn is called with each variable deleted after since, as a variable_t with
+ * only its key, attrs and last_modified_gen set and deleted = true, in the
+ * order they were deleted.  It is then called with each live variable
+ * changed after since, with deleted = false.  A variable that was deleted and
+ * then set again is reported in both, so applying the changes in the order
+ * they are reported gives the current state.
+ *
+ * @return 0 on success, or -1 if changes that old are no longer known (see
+ *         storage_prune_tombstones()), in which case fn is not called and the
+ *         caller has to start over from the whole store.
+ */
+int storage_changes_since(uint64_t since, storage_change_fn fn, void *opaque)
+{
+    struct tombstone *t;
+    struct entry *e;
+    variable_t dead;
+
+    if (!fn || since < tombstone_floor)
+        return -1;
 
-        if (var->namesz != namesz)
+    for (t = tombstones_head; t; t = t->next) {
+        if (t->gen <= since)
             continue;
 
-        if (memcmp(var->name, name, var->namesz) == 0 &&
-            memcmp(guid, &var->guid, sizeof(EFI_GUID)) == 0) {
-            break;
-        }
+        memset(&dead, 0, sizeof(dead));
+        memcpy(dead.name, t->name, t->namesz);
+        dead.namesz = t->namesz;
+        memcpy(&dead.guid, &t->guid, sizeof(dead.guid));
+        dead.attrs = t->attrs;
+        dead.last_modified_gen = t->gen;
+
+        fn(&dead, true, opaque);
     }
 
-    /* Go to the next variable, the one we want to return! */
-    i++;
+    for (e = order_head; e; e = e->next) {
+        if (e->var.last_modified_gen > since)
+            fn(&e->var, false, opaque);
+    }
 
-    /* Find the next variable */
-    for (; i < MAX_VAR_COUNT; i++) {
-        if (variable_is_valid(&variables[i]) &&
-            !rt_deny_access(variables[i].attrs)) {
-            break;
-        }
+    return 0;
+}
+
+/**
+ * Forget deletions up to and including generation upto, once a backend no
+ * longer needs them.  storage_changes_since() fails for older generations
+ * afterwards.
+ */
+void storage_prune_tombstones(uint64_t upto)
+{
+    while (tombstones_head && tombstones_head->gen <= upto)
+        tombstone_drop_oldest();
+
+    if (upto > tombstone_floor)
+        tombstone_floor = upto;
+}
+
+uint64_t storage_used(void)
+{
+    return used;
+}
+
+uint64_t storage_quota(void)
+{
+    return quota;
+}
+
+/**
+ * Returns the number of bytes the domain may still use before reaching its
+ * quota.
+ */
+uint64_t storage_remaining(void)
+{
+    return used < quota ? quota - used : 0;
+}
+
+/**
+ * Limit the storage used by the domain's variables to bytes.
+ *
+ * Lowering the quota below what is already in use does not remove anything,
+ * but all changes that would need more space fail until enough is freed.
+ */
+void storage_set_quota(uint64_t bytes)
+{
+    quota = bytes;
+}
+
+/* Return e, or the first variable after it, that is accessible right now */
+static variable_t *next_accessible(struct entry *e)
+{
+    while (e && rt_deny_access(e->var.attrs))
+        e = e->next;
+
+    return entry_var(e);
+}
+
+/* Return the first variable after e that is accessible right now */
+static variable_t *accessible_after(struct entry *e)
+{
+    /* At runtime, step straight to the next runtime-accessible variable */
+    if (efi_at_runtime && (e->var.attrs & EFI_VARIABLE_RUNTIME_ACCESS))
+        return entry_var(e->links[LINK_RUNTIME].next);
+
+    return next_accessible(e->next);
+}
+
+variable_t *storage_next_variable(UTF16 *name, size_t namesz, EFI_GUID *guid)
+{
+    variable_t *var;
+
+    if (name[0] == 0 || namesz == 0) {
+        if (efi_at_runtime)
+            return entry_var(class_lists[CLASS_RUNTIME].head);
+
+        return entry_var(order_head);
     }
 
-    /* If we are at the end of the array, return NULL */
-    if (i >= MAX_VAR_COUNT)
-        return NULL;
+    /* Find the previous variable (passed in from caller) */
+    var = storage_find_variable(name, namesz, guid);
 
-    return &variables[i];
+    if (var)
+        return accessible_after(entry_of(var));
+
+    /* The previous variable was deleted during the enumeration */
+    namesz = variable_stored_namesz(name, namesz);
+
+    if (removed_cursor.valid && removed_cursor.namesz == namesz &&
+        memcmp(removed_cursor.name, name, namesz) == 0 &&
+        memcmp(&removed_cursor.guid, guid, sizeof(*guid)) == 0)
+        return next_accessible(removed_cursor.next);
+
+    return NULL;
 }
 
 void storage_print_all(void)
 {
-    size_t i;
-    variable_t *var;
+    size_t i = 0;
+    struct entry *e;
 
     DBG("All UEFI Variables:\n");
-    for_each_variable(variables, var, i)
+    for (e = order_head; e; e = e->next)
     {
-        DPRINTF("%lu: ", i);
-        dprint_variable(var);
+        DPRINTF("%lu: ", i++);
+        dprint_variable(&e->var);
     }
     DPRINTF("\n");
 }
@@ -41,7 +41,7 @@ extern EFI_GUID gEfiSecureBootEnableDisableGuid;
 bool auth_enforce = true;
 bool secure_boot_enabled;
 
-extern bool efi_at_runtime;
+extern __thread bool efi_at_runtime;
 
 extern SHA256_CTX *hash_ctx;
 extern uint8_t setup_mode;
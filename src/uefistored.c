@@ -7,8 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -28,6 +31,8 @@
 #include "common.h"
 #include "config.h"
 #include "log.h"
+#include "persist.h"
+#include "pool.h"
 #include "storage.h"
 #include "uefi/authlib.h"
 #include "uefi/image_authentication.h"
@@ -44,6 +49,14 @@
 struct backend *backend = NULL;
 struct backend xapidb;
 static bool resume;
+static bool threaded;
+static unsigned long persist_delay = DEFAULT_PERSIST_DELAY_MS;
+static unsigned long persist_max_delay = DEFAULT_PERSIST_MAX_DELAY_MS;
+static unsigned long busy_poll_us;
+static bool sb_barrier = true;
+
+/* Set once the variables are loaded, a partial store is never persisted */
+static bool loaded;
 
 static size_t vcpu_count = 1;
 static xc_evtchn_port_or_error_t *ioreq_local_ports;
@@ -63,6 +76,7 @@ static gid_t gid;
 static char *root_path = NULL;
 static char *pidfile;
 
+extern __thread bool efi_at_runtime;
 extern bool secure_boot_enabled;
 extern EFI_GUID gEfiGlobalVariableGuid;
 extern EFI_GUID gEfiImageSecurityDatabaseGuid;
@@ -82,6 +96,35 @@ static int _domid = -1;
 static ioservid_t _ioservid;
 static unsigned long io_port_addr;
 
+/*
+ * The guest's shared memory buffer, as last mapped by get_guest_memory().
+ * OVMF keeps using the same buffer, so it stays mapped between requests.
+ * There is one per vCPU so that workers do not share mappings.
+ */
+struct shmem_mapping {
+    void *addr;
+    int domid;
+    xen_pfn_t gfn;
+};
+
+static struct shmem_mapping *shmem_mappings;
+
+/*
+ * In threaded mode, each vCPU's requests are served by its own worker, see
+ * handler_loop().
+ */
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool pending;
+    size_t vcpu;
+    evtchn_port_t port;
+    shared_iopage_t *shared_iopage;
+};
+
+static struct worker *workers;
+
 #define UNUSED(var) ((void)var);
 
 #define USAGE                                                                  \
@@ -96,6 +139,12 @@ static unsigned long io_port_addr;
     "    --chroot <chroot> \n"                                                 \
     "    --pidfile <pidfile> \n"                                               \
     "    --backend <backend> \n"                                               \
+    "    --quota <bytes> \n"                                                   \
+    "    --threaded \n"                                                        \
+    "    --persist-delay <ms> \n"                                              \
+    "    --persist-max-delay <ms> \n"                                          \
+    "    --no-sb-barrier \n"                                                   \
+    "    --busy-poll <us> \n"                                                  \
     "    --arg <name>:<val> \n\n"
 
 #define UNIMPLEMENTED(opt) INFO(opt " option not implemented!\n")
@@ -318,7 +367,40 @@ static void *map_guest_memory(xen_pfn_t start)
                                 SHMEM_PAGES, shmem, NULL);
 }
 
-void handle_ioreq(struct ioreq *ioreq)
+/**
+ * unmap_guest_memory - Drop a cached mapping of the guest's buffer, if any
+ */
+static void unmap_guest_memory(struct shmem_mapping *mapping)
+{
+    if (!mapping->addr)
+        return;
+
+    xenforeignmemory_unmap(_fmem, mapping->addr, SHMEM_PAGES);
+    mapping->addr = NULL;
+}
+
+/**
+ * get_guest_memory - Return the guest's buffer starting at GFN start
+ *
+ * The mapping is reused for as long as the guest keeps sending the same GFN,
+ * so that steady state requests need no mapping hypercalls.  A request with a
+ * different GFN replaces it.
+ */
+static void *get_guest_memory(struct shmem_mapping *mapping, xen_pfn_t start)
+{
+    if (mapping->addr && mapping->domid == _domid && mapping->gfn == start)
+        return mapping->addr;
+
+    unmap_guest_memory(mapping);
+
+    mapping->addr = map_guest_memory(start);
+    mapping->domid = _domid;
+    mapping->gfn = start;
+
+    return mapping->addr;
+}
+
+void handle_ioreq(struct ioreq *ioreq, size_t vcpu)
 {
     void *shmem;
     uint64_t port_addr = ioreq->addr;
@@ -345,7 +427,7 @@ void handle_ioreq(struct ioreq *ioreq)
         return;
     }
 
-    shmem = map_guest_memory(gfn);
+    shmem = get_guest_memory(&shmem_mappings[vcpu], gfn);
 
     if (!shmem) {
         ERROR("failed to map guest memory!\n");
@@ -356,9 +438,6 @@ void handle_ioreq(struct ioreq *ioreq)
     smp_mb();
     xen_variable_server_handle_request(shmem);
     smp_mb();
-
-    /* Free up mappable space */
-    xenforeignmemory_unmap(_fmem, shmem, SHMEM_PAGES);
 }
 
 static void handle_shared_iopage(shared_iopage_t *shared_iopage,
@@ -385,7 +464,7 @@ static void handle_shared_iopage(shared_iopage_t *shared_iopage,
     barrier();
     ioreq->state = STATE_IOREQ_INPROCESS;
 
-    handle_ioreq(ioreq);
+    handle_ioreq(ioreq, vcpu);
     barrier();
 
     ioreq->state = STATE_IORESP_READY;
@@ -394,9 +473,23 @@ static void handle_shared_iopage(shared_iopage_t *shared_iopage,
     xenevtchn_notify(xce, port);
 }
 
-static void signal_handler(int sig)
+/**
+ * Persist the variables, release everything and exit as if killed by sig.
+ */
+static void teardown(int sig)
 {
-    INFO("uefistored received signal: %s\n", strsignal(sig));
+    sigset_t set;
+
+    /* Whatever it had not persisted is persisted by persist_flush() below */
+    persist_stop();
+
+    /*
+     * This runs on the main thread, which never holds the store lock in
+     * threaded mode.  Taking it waits for requests in flight and keeps the
+     * workers out while the store is torn down.
+     */
+    if (threaded)
+        storage_write_lock();
 
     if (ioreq_local_ports) {
         for (int i = 0; i < vcpu_count; i++) {
@@ -406,9 +499,18 @@ static void signal_handler(int sig)
         free(ioreq_local_ports);
     }
 
-    backend_set();
-    backend_save();
+    if (loaded) {
+        persist_flush();
+        backend_save();
+    }
+
     storage_destroy();
+    pool_destroy();
+
+    if (shmem_mappings) {
+        for (int i = 0; i < vcpu_count; i++)
+            unmap_guest_memory(&shmem_mappings[i]);
+    }
 
     if (fmem && fmem_resource)
         xenforeignmemory_unmap_resource(fmem, fmem_resource);
@@ -441,10 +543,23 @@ static void signal_handler(int sig)
     auth_lib_deinit(auth_files, ARRAY_SIZE(auth_files));
 
     signal(sig, SIG_DFL);
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
     raise(sig);
     exit(0);
 }
 
+/*
+ * Until the event loop starts, and for SIGABRT, signals are handled here.
+ * Once it runs, the shutdown signals go through its signalfd instead.
+ */
+static void signal_handler(int sig)
+{
+    INFO("uefistored received signal: %s\n", strsignal(sig));
+    teardown(sig);
+}
+
 static struct sigaction *get_old(int sig)
 {
     switch (sig) {
@@ -542,34 +657,404 @@ static int write_pid(void)
     return 0;
 }
 
-void handler_loop(shared_iopage_t *shared_iopage)
+static void *worker_loop(void *opaque)
 {
+    struct worker *worker = opaque;
+
+    while (true) {
+        pthread_mutex_lock(&worker->lock);
+
+        while (!worker->pending)
+            pthread_cond_wait(&worker->cond, &worker->lock);
+
+        worker->pending = false;
+        pthread_mutex_unlock(&worker->lock);
+
+        handle_shared_iopage(worker->shared_iopage, worker->port,
+                             worker->vcpu);
+    }
+
+    return NULL;
+}
+
+static int start_workers(shared_iopage_t *shared_iopage)
+{
+    sigset_t all, old;
     size_t i;
-    int ret;
-    struct pollfd pollfd;
+    int ret = 0;
+
+    workers = calloc(vcpu_count, sizeof(*workers));
+
+    if (!workers)
+        return -1;
+
+    /* Workers inherit this mask, so signals are only handled by this thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 0; i < vcpu_count; i++) {
+        workers[i].vcpu = i;
+        workers[i].port = ioreq_local_ports[i];
+        workers[i].shared_iopage = shared_iopage;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].cond, NULL);
+
+        if (pthread_create(&workers[i].thread, NULL, worker_loop,
+                           &workers[i]) != 0) {
+            ERROR("Failed to start worker for vCPU%lu\n", i);
+            ret = -1;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret == 0)
+        INFO("Serving requests with %lu workers\n", vcpu_count);
+
+    return ret;
+}
+
+static void dispatch(struct worker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    worker->pending = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * The event loop.  Everything the main thread reacts to is a file descriptor
+ * in one epoll set: the event channels of the vCPUs' ioreqs, the shutdown
+ * signals (through a signalfd, so that shutdown runs in normal context) and a
+ * timerfd that drives periodic_work.  New asynchronous work hangs off one of
+ * these, or gets its own source.
+ */
+enum {
+    SOURCE_EVTCHN,
+    SOURCE_SIGNAL,
+    SOURCE_TIMER,
+};
+
+/* Signals that shut uefistored down, see handle_signal() */
+static const int shutdown_signals[] = { SIGHUP, SIGINT, SIGTERM };
+
+#define LOOP_TICK_MS 1000
+
+/*
+ * ioreqs served from the loop, in total and those picked up by busy_poll(),
+ * and the time spent serving each kind (only when served on this thread).
+ */
+static struct {
+    uint64_t wakeups;
+    uint64_t ioreqs;
+    uint64_t polled;
+    uint64_t ioreq_ns;
+    uint64_t polled_ns;
+} loop_stats, loop_stats_reported;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t avg(uint64_t total, uint64_t n)
+{
+    return n ? total / n : 0;
+}
+
+static void dump_loop_stats(void)
+{
+    uint64_t ioreqs, polled;
+
+    if (loop_stats.wakeups == loop_stats_reported.wakeups &&
+        loop_stats.polled == loop_stats_reported.polled)
+        return;
+
+    ioreqs = loop_stats.ioreqs - loop_stats_reported.ioreqs;
+    polled = loop_stats.polled - loop_stats_reported.polled;
+
+    DBG("%lu ioreqs in %lu wakeups, %lu polled, avg %luns (evtchn) %luns (polled)\n",
+        ioreqs, loop_stats.wakeups - loop_stats_reported.wakeups, polled,
+        avg(loop_stats.ioreq_ns - loop_stats_reported.ioreq_ns,
+            ioreqs - polled),
+        avg(loop_stats.polled_ns - loop_stats_reported.polled_ns, polled));
+
+    loop_stats_reported = loop_stats;
+}
+
+static void dump_persist_stats(void)
+{
+    static struct persist_stats reported;
+    struct persist_stats stats;
+    uint64_t flushes;
+
+    persist_get_stats(&stats);
+
+    if (stats.changes == reported.changes &&
+        stats.flushes == reported.flushes &&
+        stats.failures == reported.failures)
+        return;
+
+    flushes = stats.flushes - reported.flushes;
+
+    DBG("%lu changes persisted in %lu flushes, %lu immediate, %lu failed, "
+        "avg %luns from change to flush, max %luns\n",
+        stats.changes - reported.changes, flushes,
+        stats.immediate - reported.immediate,
+        stats.failures - reported.failures,
+        avg(stats.latency_ns - reported.latency_ns, flushes),
+        stats.max_latency_ns);
+
+    reported = stats;
+}
+
+/* Work run from the event loop every interval ticks of LOOP_TICK_MS */
+static struct {
+    unsigned int interval;
+    unsigned int elapsed;
+    void (*fn)(void);
+} periodic_work[] = {
+    { 60, 0, dump_loop_stats },
+    { 60, 0, dump_persist_stats },
+};
+
+static void serve(shared_iopage_t *shared_iopage, size_t vcpu, bool polled)
+{
+    uint64_t start = now_ns();
+
+    handle_shared_iopage(shared_iopage, ioreq_local_ports[vcpu], vcpu);
+
+    loop_stats.ioreqs++;
+
+    if (polled) {
+        loop_stats.polled++;
+        loop_stats.polled_ns += now_ns() - start;
+    } else {
+        loop_stats.ioreq_ns += now_ns() - start;
+    }
+}
+
+/**
+ * Spin on the vCPUs' ioreq states for up to busy_poll_us after the last
+ * request, serving requests as they show up without waiting for their event
+ * channel notification.  Only used when requests are served on this thread,
+ * not with --threaded.
+ *
+ * During boot OVMF makes hundreds of variable calls back to back, and this
+ * saves each one the wakeup latency.  Once the guest is at runtime requests
+ * are rare, so it returns straight away and the loop blocks as usual.
+ */
+static void busy_poll(shared_iopage_t *shared_iopage)
+{
+    uint64_t deadline;
+    size_t i;
+
+    deadline = now_ns() + busy_poll_us * 1000;
+
+    while (!efi_at_runtime && now_ns() < deadline) {
+        for (i = 0; i < vcpu_count; i++) {
+            barrier();
+
+            if (shared_iopage->vcpu_ioreq[i].state != STATE_IOREQ_READY)
+                continue;
+
+            serve(shared_iopage, i, true);
+            deadline = now_ns() + busy_poll_us * 1000;
+        }
+
+        cpu_relax();
+    }
+}
+
+/**
+ * Serve every event channel port that fired since the last wakeup.
+ */
+static void handle_evtchn(shared_iopage_t *shared_iopage)
+{
     xc_evtchn_port_or_error_t port;
+    size_t i;
+
+    while ((port = xenevtchn_pending(xce)) >= 0) {
+        xenevtchn_unmask(xce, port);
+
+        for (i = 0; i < vcpu_count; i++) {
+            if (ioreq_local_ports[i] != port)
+                continue;
+
+            if (threaded) {
+                loop_stats.ioreqs++;
+                dispatch(&workers[i]);
+                break;
+            }
+
+            /* Already served by busy_poll() */
+            barrier();
+            if (busy_poll_us &&
+                shared_iopage->vcpu_ioreq[i].state != STATE_IOREQ_READY)
+                break;
+
+            serve(shared_iopage, i, false);
+            break;
+        }
+    }
+
+    if (errno != EAGAIN && errno != EINTR) {
+        ERROR("xenevtchn_pending() failed: %d, %s\n", errno, strerror(errno));
+        exit(1);
+    }
+}
+
+static void handle_signal(int fd)
+{
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info))
+        return;
+
+    INFO("uefistored received signal: %s\n", strsignal(info.ssi_signo));
+
+    /* No return */
+    teardown(info.ssi_signo);
+}
+
+static void handle_timer(int fd)
+{
+    uint64_t ticks;
+    size_t i;
+
+    if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+
+    for (i = 0; i < ARRAY_SIZE(periodic_work); i++) {
+        periodic_work[i].elapsed += ticks;
+
+        if (periodic_work[i].elapsed >= periodic_work[i].interval) {
+            periodic_work[i].elapsed = 0;
+            periodic_work[i].fn();
+        }
+    }
+}
+
+static int add_source(int epfd, int fd, uint32_t source)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u32 = source,
+    };
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int open_signalfd(void)
+{
+    sigset_t set;
+    size_t i;
+
+    sigemptyset(&set);
+
+    for (i = 0; i < ARRAY_SIZE(shutdown_signals); i++)
+        sigaddset(&set, shutdown_signals[i]);
+
+    /* From now on these are only delivered through the signalfd */
+    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0)
+        return -1;
+
+    return signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+static int open_timerfd(void)
+{
+    struct itimerspec its = {
+        .it_interval = { LOOP_TICK_MS / 1000, (LOOP_TICK_MS % 1000) * 1000000 },
+        .it_value = { LOOP_TICK_MS / 1000, (LOOP_TICK_MS % 1000) * 1000000 },
+    };
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+        close(fd);
+        return -1;
+    }
 
-    pollfd.fd = xenevtchn_fd(xce);
-    pollfd.events = POLLIN | POLLERR | POLLHUP;
-    pollfd.revents = 0;
+    return fd;
+}
+
+/**
+ * Wait for ioreqs and serve them.
+ *
+ * By default every vCPU's requests are served in turn on this thread.  In
+ * threaded mode (--threaded), this thread only waits for event channel
+ * notifications and hands each one to the worker of the vCPU it came from.
+ * Lookups and enumerations from different vCPUs then run in parallel, and
+ * only requests that change the store exclude each other (see
+ * xen_variable_server_handle_request()).
+ */
+void handler_loop(shared_iopage_t *shared_iopage)
+{
+    struct epoll_event events[4];
+    int epfd, evtchn_fd, signal_fd, timer_fd;
+    int i, n;
+
+    evtchn_fd = xenevtchn_fd(xce);
+
+    /* So that handle_evtchn() can drain it */
+    if (fcntl(evtchn_fd, F_SETFL, fcntl(evtchn_fd, F_GETFL) | O_NONBLOCK) < 0) {
+        ERROR("Failed to make evtchn fd non-blocking: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    /* Before any thread is started, so that they all inherit the mask */
+    signal_fd = open_signalfd();
+    timer_fd = open_timerfd();
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (signal_fd < 0 || timer_fd < 0 || epfd < 0 ||
+        add_source(epfd, evtchn_fd, SOURCE_EVTCHN) < 0 ||
+        add_source(epfd, signal_fd, SOURCE_SIGNAL) < 0 ||
+        add_source(epfd, timer_fd, SOURCE_TIMER) < 0) {
+        ERROR("Failed to set up event loop: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (threaded && start_workers(shared_iopage) < 0)
+        exit(1);
 
     while (true) {
-        ret = poll(&pollfd, 1, 5000);
+        n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
 
-        if (ret < 0 && errno != EINTR) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            ERROR("epoll_wait() failed: %s\n", strerror(errno));
             exit(1);
         }
 
-        if (ret <= 0 || !(pollfd.revents & POLLIN)) {
-            continue;
-        }
+        loop_stats.wakeups++;
 
-        port = xenevtchn_pending(xce);
+        for (i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case SOURCE_EVTCHN:
+                handle_evtchn(shared_iopage);
 
-        for (i = 0; i < vcpu_count; i++) {
-            xenevtchn_unmask(xce, port);
-            if (ioreq_local_ports[i] == port) {
-                    handle_shared_iopage(shared_iopage, port, i);
+                if (busy_poll_us && !threaded)
+                    busy_poll(shared_iopage);
+                break;
+            case SOURCE_SIGNAL:
+                handle_signal(signal_fd);
+                break;
+            case SOURCE_TIMER:
+                handle_timer(timer_fd);
+                break;
             }
         }
     }
@@ -585,6 +1070,7 @@ int main(int argc, char **argv)
     char c;
     EFI_STATUS status;
     char *end;
+    unsigned long long quota;
 
     const struct option options[] = {
         { "domain", required_argument, 0, 'd' },
@@ -597,6 +1083,12 @@ int main(int argc, char **argv)
         { "pidfile", required_argument, 0, 'i' },
         { "backend", required_argument, 0, 'b' },
         { "arg", required_argument, 0, 'a' },
+        { "quota", required_argument, 0, 'q' },
+        { "threaded", no_argument, 0, 't' },
+        { "persist-delay", required_argument, 0, 'D' },
+        { "persist-max-delay", required_argument, 0, 'M' },
+        { "no-sb-barrier", no_argument, 0, 'S' },
+        { "busy-poll", required_argument, 0, 'P' },
         { "help", no_argument, 0, 'h' },
         { 0, 0, 0, 0 },
     };
@@ -610,7 +1102,7 @@ int main(int argc, char **argv)
     install_sighandlers();
 
     while (1) {
-        c = getopt_long(argc, argv, "d:rnpu:g:c:i:b:ha:", options,
+        c = getopt_long(argc, argv, "d:rnpu:g:c:i:b:ha:q:tD:M:SP:", options,
                         &option_index);
 
         /* Detect the end of the options. */
@@ -638,6 +1130,10 @@ int main(int argc, char **argv)
             resume = true;
             break;
 
+        case 't':
+            threaded = true;
+            break;
+
         case 'n':
             UNIMPLEMENTED("nonpersistent");
             break;
@@ -691,6 +1187,61 @@ int main(int argc, char **argv)
             break;
         }
 
+        case 'q':
+            if (optarg) {
+                errno = 0;
+                quota = strtoull(optarg, &end, 0);
+
+                if (*end != '\0' || errno) {
+                    fprintf(stderr, "invalid quota '%s'\n", optarg);
+                    exit(1);
+                }
+
+                storage_set_quota(quota);
+            }
+            break;
+
+        case 'D':
+            if (optarg) {
+                errno = 0;
+                persist_delay = strtoul(optarg, &end, 0);
+
+                if (*end != '\0' || errno || persist_delay > UINT_MAX) {
+                    fprintf(stderr, "invalid persist delay '%s'\n", optarg);
+                    exit(1);
+                }
+            }
+            break;
+
+        case 'M':
+            if (optarg) {
+                errno = 0;
+                persist_max_delay = strtoul(optarg, &end, 0);
+
+                if (*end != '\0' || errno || persist_max_delay > UINT_MAX) {
+                    fprintf(stderr, "invalid persist max delay '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+            }
+            break;
+
+        case 'S':
+            sb_barrier = false;
+            break;
+
+        case 'P':
+            if (optarg) {
+                errno = 0;
+                busy_poll_us = strtoul(optarg, &end, 0);
+
+                if (*end != '\0' || errno) {
+                    fprintf(stderr, "invalid busy poll window '%s'\n", optarg);
+                    exit(1);
+                }
+            }
+            break;
+
         case 'h':
         case '?':
         default:
@@ -808,6 +1359,13 @@ int main(int argc, char **argv)
         goto err;
     }
 
+    shmem_mappings = calloc(vcpu_count, sizeof(*shmem_mappings));
+
+    if (!shmem_mappings) {
+        ERROR("Failed to alloc shmem_mappings\n");
+        goto err;
+    }
+
     for (i = 0; i < vcpu_count; i++) {
         ret = xenevtchn_bind_interdomain(xce, domid,
                                          shared_iopage->vcpu_ioreq[i].vp_eport);
@@ -860,6 +1418,8 @@ int main(int argc, char **argv)
         goto err;
     }
 
+    loaded = true;
+
     status = auth_lib_initialize(auth_files, ARRAY_SIZE(auth_files));
 
     if (status != EFI_SUCCESS) {
@@ -894,7 +1454,12 @@ int main(int argc, char **argv)
     }
 
     /* Update backend with new auth variables prior to entrying normal runtime */
-    backend_set();
+    persist_flush();
+
+    /* With no delay, every change is persisted before its request completes */
+    if (persist_delay > 0 &&
+        persist_start(persist_delay, persist_max_delay, sb_barrier) < 0)
+        goto err;
 
     if (write_pid() < 0)
         goto err;
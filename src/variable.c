@@ -5,6 +5,7 @@
 
 #include "common.h"
 #include "log.h"
+#include "pool.h"
 #include "storage.h"
 #include "uefi/types.h"
 #include "serializer.h"
@@ -20,41 +21,103 @@ int variable_set_attrs(variable_t *var, const uint32_t attrs)
     return 0;
 }
 
+static struct payload *payload_new(size_t size)
+{
+    struct payload *payload;
+    size_t cap;
+
+    payload = pool_alloc(sizeof(*payload), NULL);
+
+    if (!payload)
+        return NULL;
+
+    payload->bytes = pool_alloc(size, &cap);
+
+    if (!payload->bytes) {
+        pool_free(payload, sizeof(*payload));
+        return NULL;
+    }
+
+    payload->cap = cap;
+    payload->refs = 1;
+
+    return payload;
+}
+
+static void payload_put(struct payload *payload)
+{
+    if (!payload)
+        return;
+
+    if (__atomic_sub_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pool_free(payload->bytes, payload->cap);
+        pool_free(payload, sizeof(*payload));
+    }
+}
+
+static inline bool payload_shared(const struct payload *payload)
+{
+    return payload && __atomic_load_n(&payload->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/**
+ * Set or append to the variable's data.
+ *
+ * The data lives in a payload block from the pool (see pool_alloc()).  The
+ * current block is reused whenever the new data fits in it, and replaced by
+ * one of the right size class otherwise.  Because size classes double,
+ * appending grows the block geometrically.  A block is also replaced when the
+ * data shrinks to under a quarter of it, so small variables do not pin large
+ * blocks.
+ *
+ * A payload shared with another variable_t is never written to, the variable
+ * gets a fresh payload instead (copy-on-write).
+ */
 int variable_set_data(variable_t *var, const uint8_t *data, uint64_t datasz, bool append)
 {
+    uint64_t newsz, cap;
+    struct payload *payload, *old = NULL;
+
     if (!var || !data || datasz == 0)
         return -1;
 
-    if (datasz > MAX_VARIABLE_DATA_SIZE)
+    if (datasz > MAX_CHUNKED_DATA_SIZE)
         return -2;
 
-    if (!append) {
-        if (var->datasz != datasz) {
-            if (var->data) {
-                free(var->data);
-                var->data = NULL;
-            }
+    newsz = append ? var->datasz + datasz : datasz;
 
-            var->data = malloc(datasz);
-        }
+    if (newsz > MAX_CHUNKED_DATA_SIZE)
+        return -ENOMEM;
 
-        var->datasz = datasz;
-        memcpy(var->data, data, datasz);
-    } else {
-        uint64_t newsz;
+    cap = var->payload ? var->payload->cap : 0;
+
+    if (payload_shared(var->payload) || newsz > cap ||
+        pool_capacity(newsz) * 4 <= cap) {
+        payload = payload_new(newsz);
 
-        newsz = var->datasz + datasz;
-        if (newsz > MAX_VARIABLE_DATA_SIZE)
+        if (!payload)
             return -ENOMEM;
 
-        /* Reallocate var->data to be newsz sized */
-        var->data = realloc(var->data, newsz);
+        if (append && var->datasz)
+            memcpy(payload->bytes, var->data, var->datasz);
 
-        /* Do the append */
+        old = var->payload;
+        var->payload = payload;
+        var->data = payload->bytes;
+    } else if (!append && newsz < var->datasz) {
+        /* Do not leave the tail of the old value behind in the block */
+        explicit_bzero(&var->data[newsz], var->datasz - newsz);
+    }
+
+    if (append)
         memcpy(&var->data[var->datasz], data, datasz);
+    else
+        memcpy(var->data, data, datasz);
 
-        var->datasz = newsz;
-    }
+    var->datasz = newsz;
+
+    /* Only now, data may point into the old payload */
+    payload_put(old);
 
     return 0;
 }
@@ -80,9 +143,7 @@ static inline void sanitize_namesz(variable_t *var)
         return;
 
     /* Leave out null-terminator if it exists */
-    if (var->name[(var->namesz / sizeof(UTF16) - 1)] == 0) {
-        var->namesz = var->namesz - sizeof(UTF16);
-    }
+    var->namesz = variable_stored_namesz(var->name, var->namesz);
 }
 
 int variable_set_name(variable_t *var, const UTF16 *name, size_t namesz)
@@ -227,8 +288,9 @@ void variable_destroy_noalloc(variable_t *var)
         var->namesz = 0;
     }
 
-    if (var->data) {
-        free(var->data);
+    if (var->payload) {
+        payload_put(var->payload);
+        var->payload = NULL;
         var->data = NULL;
         var->datasz = 0;
     }
@@ -279,6 +341,37 @@ int variable_copy(variable_t *dst, const variable_t *src)
     return 0;
 }
 
+/**
+ * Make dst a copy of src that shares src's data instead of copying it.
+ *
+ * Any data dst held before is released.  The shared payload stays immutable
+ * until one of the two is changed with variable_set_data(), which gives that
+ * one a private copy, or until both are destroyed.
+ */
+int variable_share(variable_t *dst, const variable_t *src)
+{
+    if (!dst || !src || dst == src)
+        return -1;
+
+    if (src->payload)
+        __atomic_add_fetch(&src->payload->refs, 1, __ATOMIC_RELAXED);
+
+    payload_put(dst->payload);
+
+    dst->namesz = src->namesz;
+    memcpy(dst->name, src->name, src->namesz);
+    memcpy(&dst->guid, &src->guid, sizeof(dst->guid));
+    dst->attrs = src->attrs;
+    dst->payload = src->payload;
+    dst->data = src->data;
+    dst->datasz = src->datasz;
+    memcpy(&dst->timestamp, &src->timestamp, sizeof(dst->timestamp));
+    memcpy(dst->cert, src->cert, sizeof(dst->cert));
+    dst->last_modified_gen = src->last_modified_gen;
+
+    return 0;
+}
+
 bool variable_eq(const variable_t *a, const variable_t *b)
 {
     if (!a || !b)
@@ -372,25 +465,67 @@ int from_bytes_to_vars(variable_t *vars, size_t n, const uint8_t *bytes, size_t
     return (int)(i > INT_MAX ? -1 : i);
 }
 
-variable_t *find_variable(const UTF16 *name, size_t namesz,
-                          const EFI_GUID *guid, variable_t *variables, size_t n)
+/**
+ * Returns the number of variables in a byte-serialized variable list, as given
+ * by its header.
+ *
+ * The count is checked against the smallest possible serialized variable, so
+ * that a corrupt header cannot make the caller allocate more variables than
+ * bytes_sz could possibly hold.
+ *
+ * @return the number of variables on success, otherwise -1.
+ */
+int variable_list_count(const uint8_t *bytes, size_t bytes_sz)
 {
-    variable_t *var;
+    const uint8_t *ptr = bytes;
+    struct variable_list_header hdr;
+    size_t min;
+
+    if (!bytes || bytes_sz < sizeof(hdr))
+        return -1;
+
+    unserialize_variable_list_header(&ptr, &hdr);
+
+    /* Name and data length, one UTF16 name, one data byte, and metadata */
+    min = 2 * sizeof(uint64_t) + sizeof(UTF16) + 1 + sizeof(EFI_GUID) +
+          sizeof(uint32_t) + sizeof(EFI_TIME) + sizeof(((variable_t *)0)->cert);
+
+    if (hdr.variable_count > (bytes_sz - sizeof(hdr)) / min ||
+        hdr.variable_count > INT_MAX)
+        return -1;
+
+    return (int)hdr.variable_count;
+}
+
+/**
+ * Returns the FNV-1a hash of a variable's (GUID, name) key.
+ *
+ * This is the key used by the storage index, callers that look up the
+ * same variable more than once may compute it once and reuse it.  The name
+ * is hashed as it is stored, so with or without its null-terminator.
+ */
+uint32_t variable_hash(const UTF16 *name, size_t namesz, const EFI_GUID *guid)
+{
+    const uint8_t *p;
+    uint32_t hash = 2166136261u;
     size_t i;
 
-    if (!name || !variables || !guid)
-        return NULL;
+    if (!name || !guid)
+        return 0;
 
-    for (i = 0; i < n; i++) {
-        var = &variables[i];
+    namesz = variable_stored_namesz(name, namesz);
 
-        if (var->namesz != namesz)
-            continue;
+    p = (const uint8_t *)guid;
+    for (i = 0; i < sizeof(*guid); i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
 
-        if (memcmp((UTF16 *)var->name, name, var->namesz) == 0 &&
-            memcmp(guid, &var->guid, sizeof(EFI_GUID)) == 0)
-            return var;
+    p = (const uint8_t *)name;
+    for (i = 0; i < namesz; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
     }
 
-    return NULL;
+    return hash;
 }
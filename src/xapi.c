@@ -1,5 +1,7 @@
-#include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -8,28 +10,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <string.h>
-
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
-#include <openssl/ssl.h>
-#include <openssl/conf.h>
-#include <openssl/err.h>
-#include <openssl/engine.h>
-
-#include <libxml/xmlmemory.h>
-#include <libxml/xpath.h>
-#include <libxml/parser.h>
+#include <strings.h>
 
 #include "backend.h"
+#include "base64.h"
 #include "common.h"
 #include "storage.h"
 #include "log.h"
 #include "serializer.h"
 #include "xapi.h"
 #include "variable.h"
+#include "xmlrpc.h"
 #include "uefi/utils.h"
 #include "uefi/authlib.h"
 
@@ -38,7 +32,13 @@
 
 #define MAX_RESPONSE_SIZE 4096
 #define MAX_REQUEST_SIZE 4096
-#define MAX_RESUME_FILE_SIZE (8 * PAGE_SIZE)
+
+/*
+ * The largest variable list read back, from the resume file or VM.get_NVRAM,
+ * and so the largest written.  Not derived from the quota, the list may have
+ * been saved under a larger one.
+ */
+#define MAX_LIST_SIZE (MB(16) + sizeof(struct variable_list_header))
 
 #define VM_UUID_MAX 36
 #define SOCKET_MAX 108
@@ -59,19 +59,23 @@ static char *resume_path;
     "Host: _var_lib_xcp_xapi\r\n"                                              \
     "Accept-Encoding: identity\r\n"                                            \
     "User-Agent: uefistored/0.1\r\n"                                           \
-    "Connection: close\r\n"                                                    \
+    "Connection: keep-alive\r\n"                                               \
     "Content-Type: text/xml\r\n"                                               \
     "Content-Length: %lu\r\n"                                                  \
     "\r\n"
 
-#define HTTP_BODY_SET_NVRAM_VARS                                               \
+/* VM.set_NVRAM_EFI_variables, the base64 variable list goes in between */
+#define HTTP_BODY_SET_NVRAM_VARS_START                                         \
     "<?xml version='1.0'?>"                                                    \
     "<methodCall>"                                                             \
     "<methodName>VM.set_NVRAM_EFI_variables</methodName>"                      \
     "<params>"                                                                 \
     "<param><value><string>DUMMYSESSION</string></value></param>"              \
     "<param><value><string>DUMMYVM</string></value></param>"                   \
-    "<param><value><string>%s</string></value></param>"                        \
+    "<param><value><string>"
+
+#define HTTP_BODY_SET_NVRAM_VARS_END                                           \
+    "</string></value></param>"                                                \
     "</params>"                                                                \
     "</methodCall>"
 
@@ -98,105 +102,6 @@ static char *resume_path;
     "</params>"                                                                \
     "</methodCall>"
 
-int base64_to_bytes(uint8_t *plaintext, size_t n, char *encoded,
-                    size_t encoded_size)
-{
-    size_t ret;
-
-    if (!plaintext || n == 0 || !encoded || encoded_size == 0)
-        return -1;
-
-    BIO *mem, *b64;
-
-    b64 = BIO_new(BIO_f_base64());
-    mem = BIO_new_mem_buf(encoded, encoded_size);
-
-    mem = BIO_push(b64, mem);
-
-    BIO_set_flags(mem, BIO_FLAGS_BASE64_NO_NL);
-    BIO_set_close(mem, BIO_CLOSE);
-
-    ret = BIO_read(mem, plaintext, encoded_size);
-
-    BIO_free_all(mem);
-
-    if (ret == 0) {
-        ERROR("No data decrypted!\n");
-        return -1;
-    }
-
-    return ret > INT_MAX ? -2 : (int)ret;
-}
-
-char *bytes_to_base64(uint8_t *buffer, size_t length)
-{
-    BIO *bio = NULL, *b64 = NULL;
-    BUF_MEM *buffer_ptr = NULL;
-    char *b64text = NULL;
-
-    if (length <= 0)
-        goto cleanup;
-
-    b64 = BIO_new(BIO_f_base64());
-    if (b64 == NULL)
-        goto cleanup;
-
-    bio = BIO_new(BIO_s_mem());
-    if (bio == NULL)
-        goto cleanup;
-
-    bio = BIO_push(b64, bio);
-
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_set_close(bio, BIO_CLOSE);
-
-    if (BIO_write(bio, (char *)buffer, (int)length) <= 0)
-        goto cleanup;
-
-    if (BIO_flush(bio) != 1)
-        goto cleanup;
-
-    BIO_get_mem_ptr(bio, &buffer_ptr);
-
-    b64text = (char *)malloc((buffer_ptr->length + 1) * sizeof(char));
-    if (b64text == NULL)
-        goto cleanup;
-
-    memcpy(b64text, buffer_ptr->data, buffer_ptr->length);
-    b64text[buffer_ptr->length] = '\0';
-    BIO_set_close(bio, BIO_NOCLOSE);
-
-cleanup:
-    BIO_free_all(bio);
-    BUF_MEM_free(buffer_ptr);
-
-    return b64text;
-}
-
-int read_socket(int fd, char *buf, size_t size)
-{
-    int ret;
-
-    while (size) {
-        ret = read(fd, buf, size > BUFSIZ ? BUFSIZ : size);
-
-        if (ret < 0 && errno == EINTR)
-            continue;
-
-        if (ret < 0)
-            return -1;
-
-        if (ret == 0)
-            break;
-
-        buf += ret;
-        size -= ret;
-    }
-
-    *buf = '\0';
-    return 0;
-}
-
 int xapi_parse_arg(char *arg)
 {
     char *p;
@@ -220,16 +125,55 @@ int xapi_parse_arg(char *arg)
     return 0;
 }
 
+/**
+ * Unserialize a variable list into a newly allocated array sized by the
+ * list's header.
+ *
+ * @parm vars set to the allocated array, which the caller frees
+ * @parm bytes the serialized variable list
+ * @parm size the size of bytes
+ *
+ * @return the number of variables stored in *vars, otherwise -1.
+ */
+static int alloc_vars_from_bytes(variable_t **vars, const uint8_t *bytes,
+                                 size_t size)
+{
+    int i, n, ret;
+
+    *vars = NULL;
+
+    n = variable_list_count(bytes, size);
+
+    if (n <= 0)
+        return n;
+
+    *vars = calloc(n, sizeof(variable_t));
+
+    if (!*vars)
+        return -1;
+
+    ret = from_bytes_to_vars(*vars, n, bytes, size);
+
+    if (ret < 0) {
+        for (i = 0; i < n; i++)
+            variable_destroy_noalloc(&(*vars)[i]);
+
+        free(*vars);
+        *vars = NULL;
+    }
+
+    return ret;
+}
+
 /**
  * This function reads variables from a file into an array of variables.
  *
- * @parm vars an array of variables
- * @parm n the number of variables in the array
+ * @parm vars set to the array of variables, which the caller frees
  * @parm fname the name of the file
  *
- * @return the number of variables stored in vars.
+ * @return the number of variables stored in *vars.
  */
-int xapi_variables_read_file(variable_t *vars, size_t n, char *fname)
+int xapi_variables_read_file(variable_t **vars, char *fname)
 {
     int fd;
     FILE *file = NULL;
@@ -255,8 +199,9 @@ int xapi_variables_read_file(variable_t *vars, size_t n, char *fname)
         goto cleanup1;
     }
 
-    if (stat.st_size > MAX_RESUME_FILE_SIZE) {
-        ret = 0;
+    if ((size_t)stat.st_size > MAX_LIST_SIZE) {
+        ERROR("Resume file larger than %zu bytes\n", MAX_LIST_SIZE);
+        ret = -1;
         goto cleanup1;
     }
 
@@ -274,7 +219,7 @@ int xapi_variables_read_file(variable_t *vars, size_t n, char *fname)
         goto cleanup2;
     }
 
-    ret = from_bytes_to_vars(vars, n, mem, size);
+    ret = alloc_vars_from_bytes(vars, mem, size);
 
 cleanup2:
     free(mem);
@@ -343,85 +288,6 @@ size_t list_size(variable_t *variables, size_t n)
     return sz;
 }
 
-/**
- * Retrieves variables from db and stores in vars arg
- *
- * Returns the count of variables retrieved.
- */
-static int retrieve_nonvolatile_vars(variable_t *vars, size_t n)
-{
-    EFI_STATUS status;
-    size_t cnt = 0;
-    variable_t tmp;
-
-    memset(vars, 0, sizeof(*vars) * n);
-    memset(&tmp, 0, sizeof(tmp));
-
-    while (cnt < n) {
-        status = storage_iter(&tmp);
-
-        /* Error */
-        if (status == EFI_DEVICE_ERROR)
-            return cnt;
-
-        /* Last variable */
-        if (status == EFI_NOT_FOUND)
-            break;
-
-        assert(status == EFI_SUCCESS);
-
-        if (tmp.attrs & EFI_VARIABLE_NON_VOLATILE) {
-            variable_copy(&vars[cnt++], &tmp);
-            memset(&tmp, 0, sizeof(tmp));
-        }
-    }
-
-    /* Too many variables */
-    if (cnt > INT_MAX)
-        return -1;
-
-    return cnt;
-}
-
-/**
- * Retrieves variables from db and stores in vars arg
- *
- * Returns the count of variables retrieved.
- */
-static int retrieve_vars(variable_t *vars, size_t n)
-{
-    EFI_STATUS status;
-    size_t cnt = 0;
-    variable_t *next;
-
-    memset(vars, 0, sizeof(*vars) * n);
-
-    next = &vars[0];
-
-    while (cnt < n) {
-        status = storage_iter(next);
-
-        /* Error */
-        if (status == EFI_DEVICE_ERROR)
-            return status;
-
-        /* Last variable */
-        if (status == EFI_NOT_FOUND)
-            break;
-
-        assert(status == EFI_SUCCESS);
-
-        next++;
-        cnt++;
-    }
-
-    /* Too many variables */
-    if (cnt > INT_MAX)
-        return -1;
-
-    return cnt;
-}
-
 /**
  * Return all variables in storage as a list of bytes, in legacy varstore
  * format with header.
@@ -437,21 +303,28 @@ static uint8_t *variable_list_bytes(size_t *size, bool nonvolatile)
     uint8_t *bytes = NULL;
     uint8_t *p;
     variable_t *vars;
+    size_t n, i;
 
-    vars = calloc(MAX_VAR_COUNT, sizeof(variable_t));
+    n = nonvolatile ? storage_count_nonvolatile() : storage_count();
 
-    if (nonvolatile)
-        ret = retrieve_nonvolatile_vars(vars, MAX_VAR_COUNT);
-    else
-        ret = retrieve_vars(vars, MAX_VAR_COUNT);
+    if (n == 0)
+        return NULL;
 
-    if (ret <= 0) {
+    vars = calloc(n, sizeof(variable_t));
+
+    if (!vars)
+        return NULL;
+
+    /* Shares the variables' data with the store, nothing is copied */
+    n = storage_snapshot(vars, n, nonvolatile);
+
+    if (n == 0) {
         goto out;
     }
 
-    //dprint_variable_list(vars, ret);
+    //dprint_variable_list(vars, n);
 
-    *size = list_size(vars, ret);
+    *size = list_size(vars, n);
     bytes = malloc(*size);
 
     if (!bytes) {
@@ -459,7 +332,7 @@ static uint8_t *variable_list_bytes(size_t *size, bool nonvolatile)
     }
 
     p = bytes;
-    ret = serialize_variable_list(&p, *size, vars, (size_t)ret);
+    ret = serialize_variable_list(&p, *size, vars, n);
 
     if (ret < 0) {
         free(bytes);
@@ -468,192 +341,402 @@ static uint8_t *variable_list_bytes(size_t *size, bool nonvolatile)
     }
 
 out:
+    for (i = 0; i < n; i++)
+        variable_destroy_noalloc(&vars[i]);
+
     free(vars);
     return bytes;
 }
 
-/**
- * Return all stored variables in legacy varstore format
- * as a base64 string.
+static int create_header(size_t body_len, char *message, size_t message_size)
+{
+    return snprintf(message, message_size, HTTP_HEADER, body_len);
+}
+
+/*
+ * The connection to XAPI.
+ *
+ * Every request goes over one HTTP/1.1 keep-alive connection, which is opened
+ * on the first request and again whenever XAPI closes it or it fails.  It is
+ * shared by the main thread, the request handlers and the persistence thread,
+ * and conn_lock serializes whole request/response exchanges on it.
  */
-static char *variable_list_base64(void)
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int conn_fd = -1;
+
+static int conn_open(void)
 {
-    char *base64;
-    uint8_t *bytes;
-    size_t size;
+    struct sockaddr_un saddr;
+    int fd;
 
-    bytes = variable_list_bytes(&size, true);
+    if (strlen(socket_path) >= sizeof(saddr.sun_path)) {
+        ERROR("XAPI socket path too long: %s\n", socket_path);
+        return -1;
+    }
 
-    if (!bytes)
-        return NULL;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, socket_path);
 
-    base64 = bytes_to_base64(bytes, size);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-    free(bytes);
+    if (fd < 0) {
+        ERROR("socket() failed: %d, %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        ERROR("connect() failed: %d, %s\n", errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
 
-    return base64;
+    conn_fd = fd;
+
+    return 0;
 }
 
-static int create_header(size_t body_len, char *message, size_t message_size)
+static void conn_close(void)
 {
-    return snprintf(message, message_size, HTTP_HEADER, body_len);
+    if (conn_fd < 0)
+        return;
+
+    close(conn_fd);
+    conn_fd = -1;
 }
 
-static int build_set_efi_vars_message(char *buffer, size_t n)
+/* The connection was closed by XAPI before it answered */
+#define CONN_CLOSED -2
+
+/*
+ * Send the iovcnt buffers of iov in order, which are updated to skip what
+ * was sent.
+ */
+static int send_iov_all(int fd, struct iovec *iov, size_t iovcnt)
 {
-    int ret;
-    char *base64;
-    char *body;
-    size_t base64_size, body_len;
-    int hdr_len;
+    struct msghdr msg;
+    ssize_t ret;
 
-    base64 = variable_list_base64();
+    while (iovcnt) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
 
-    if (!base64)
-        return -1;
+        /* No SIGPIPE if XAPI closed the connection */
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
 
-    base64_size = strlen(base64);
-    body_len = sizeof(HTTP_BODY_SET_NVRAM_VARS) + base64_size - 1;
+        if (ret < 0 && errno == EINTR)
+            continue;
 
-    body = malloc(body_len);
+        if (ret < 0 && (errno == EPIPE || errno == ECONNRESET))
+            return CONN_CLOSED;
 
-    if (!body) {
-        free(base64);
-        return -1;
-    }
+        if (ret < 0) {
+            ERROR("sendmsg() failed: %d, %s\n", errno, strerror(errno));
+            return -1;
+        }
 
-    ret = snprintf(body, body_len, HTTP_BODY_SET_NVRAM_VARS, base64);
+        while (iovcnt && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
 
-    if (ret < 0) {
-        ret = -1;
-        goto out;
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
     }
 
-    body_len = strlen(body);
+    return 0;
+}
 
-    hdr_len = create_header(body_len, buffer, n);
+static int send_all(int fd, const char *buf, size_t size)
+{
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = size };
 
-    if (hdr_len < 0) {
-        ret = -1;
-        goto out;
+    return send_iov_all(fd, &iov, 1);
+}
+
+/*
+ * Return the value of the header field name in the len bytes of headers at
+ * response, or NULL if there is none.
+ */
+static const char *http_header(const char *response, size_t len,
+                               const char *name)
+{
+    size_t namelen = strlen(name);
+    const char *line, *end = response + len;
+
+    for (line = memchr(response, '\n', len); line && line + 1 < end;
+         line = memchr(line + 1, '\n', end - line - 1)) {
+        if ((size_t)(end - line - 1) > namelen &&
+            strncasecmp(line + 1, name, namelen) == 0 &&
+            line[namelen + 1] == ':')
+            return line + namelen + 2;
     }
 
-    strncpy(buffer + hdr_len, body, n - hdr_len);
-    buffer[body_len + hdr_len] = '\0';
+    return NULL;
+}
 
-    ret = 0;
+/**
+ * Read one HTTP response, framed by its Content-Length, or by the end of the
+ * connection if it has none.
+ *
+ * @parm fd the connection
+ * @parm response the buffer for the response, which is NUL terminated
+ * @parm size the size of response
+ * @parm keep_alive set to false if the connection cannot be used again
+ *
+ * @return 0 on success, CONN_CLOSED if the connection was closed before
+ * anything was read, otherwise -1.
+ */
+static int read_response(int fd, char *response, size_t size, bool *keep_alive)
+{
+    size_t len = 0, hdr_len = 0, total = 0;
+    const char *value;
+    char *end;
+    ssize_t ret;
 
-out:
-    free(body);
-    free(base64);
+    *keep_alive = false;
 
-    return ret;
+    while (total == 0 || len < total) {
+        if (len + 1 >= size) {
+            ERROR("XAPI response larger than %zu bytes\n", size);
+            return -1;
+        }
+
+        ret = recv(fd, response + len, size - len - 1, 0);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0 && len == 0 && (ret == 0 || errno == ECONNRESET))
+            return CONN_CLOSED;
+
+        if (ret < 0) {
+            ERROR("recv() failed: %d, %s\n", errno, strerror(errno));
+            return -1;
+        }
+
+        /* Without a Content-Length, the response ends with the connection */
+        if (ret == 0)
+            break;
+
+        len += ret;
+        response[len] = '\0';
+
+        if (hdr_len || !(end = strstr(response, "\r\n\r\n")))
+            continue;
+
+        hdr_len = end + 4 - response;
+        value = http_header(response, hdr_len, "Content-Length");
+
+        if (!value)
+            continue;
+
+        total = hdr_len + strtoul(value, NULL, 10);
+        value = http_header(response, hdr_len, "Connection");
+        *keep_alive = !value || strncasecmp(value + strspn(value, " "),
+                                            "close", 5) != 0;
+    }
+
+    if (!hdr_len || (total && len != total)) {
+        ERROR("Malformed XAPI response\n");
+        *keep_alive = false;
+        return -1;
+    }
+
+    response[len] = '\0';
+
+    return 0;
 }
 
-static int send_request(char *message, char *response, size_t buffer_size)
+/*
+ * Write one request to the connection fd.  It is called again, on a new
+ * connection, if XAPI closed the previous one before answering.
+ */
+typedef int (*request_writer_t)(int fd, const void *arg);
+
+static int exchange(request_writer_t write_request, const void *arg,
+                    char *response, size_t buffer_size)
 {
-    int ret, fd;
-    struct sockaddr_un saddr;
+    bool reused, keep_alive;
+    int ret = -1;
 
     if (!socket_path)
         return -1;
 
-    saddr.sun_family = AF_UNIX;
-    memcpy(saddr.sun_path, socket_path, sizeof(saddr.sun_path));
+    pthread_mutex_lock(&conn_lock);
 
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    while (true) {
+        reused = conn_fd >= 0;
 
-    if (fd < 0) {
-        ERROR("socket() failed: %d\n", fd);
-        return fd;
-    }
+        if (!reused && conn_open() < 0)
+            break;
 
-    ret = connect(fd, (struct sockaddr *)&saddr, sizeof(saddr));
+        ret = write_request(conn_fd, arg);
 
-    if (ret < 0) {
-        close(fd);
-        ERROR("connect() failed: %d, %s\n", errno, strerror(errno));
-        goto out;
-    }
+        if (ret == 0)
+            ret = read_response(conn_fd, response, buffer_size, &keep_alive);
 
-    ret = write(fd, message, strlen(message));
+        if (ret < 0 || !keep_alive)
+            conn_close();
 
-    if (ret < 0) {
-        ERROR("write() failed: %d\n", ret);
-	goto out;
+        /* XAPI may close an idle connection, which is retried once fresh */
+        if (ret != CONN_CLOSED || !reused)
+            break;
+
+        DBG("XAPI closed the connection, reconnecting\n");
     }
 
-    ret = read_socket(fd, response, buffer_size);
+    pthread_mutex_unlock(&conn_lock);
+
     if (ret < 0) {
-        ERROR("read_socket() failed: %d, errno=%d (%s)\n", ret, errno,
-        strerror(errno));
-        goto out;
+        ERROR("XAPI request failed\n");
+        return -1;
     }
 
-    ret = http_status(response) == 200 ? 0 : -1;
-out:
-    close(fd);
-    return ret;
+    return http_status(response) == 200 ? 0 : -1;
 }
 
-/* throttling scheme from varstored */
-#define MAX_CREDIT        100
-#define CREDIT_PER_SECOND 2
-#define NS_PER_CREDIT (1000000000 / CREDIT_PER_SECOND)
-static time_t last_time; /* Time of the last send. */
-static unsigned int send_credit = MAX_CREDIT; /* Number of allowed fast sends. */
+static int write_message(int fd, const void *message)
+{
+    return send_all(fd, message, strlen(message));
+}
 
-static void throttle(void)
+static int send_request(char *message, char *response, size_t buffer_size)
 {
-    time_t cur_time, diff_time;
+    /* message and response may be the same buffer */
+    return exchange(write_message, message, response, buffer_size);
+}
 
-    cur_time = time(NULL);
-    diff_time = cur_time - last_time;
-    last_time = cur_time;
-    send_credit += diff_time * CREDIT_PER_SECOND;
-    if (send_credit > MAX_CREDIT)
-        send_credit = MAX_CREDIT;
+/* Bytes of the variable list encoded at a time, a multiple of 3 */
+#define NVRAM_CHUNK_SIZE (48 * 1024)
 
-    if (send_credit > 0) {
-        send_credit--;
-    } else {
-        /* If no credit, wait the correct amount of time to get a credit. */
-        struct timespec ts = {0, NS_PER_CREDIT};
+/* The encoding of one chunk, only used with conn_lock held */
+static char nvram_chunk[BASE64_ENCODED_SIZE(NVRAM_CHUNK_SIZE) + 1];
+
+/* A serialized variable list, see xapi_snapshot() */
+struct nvram {
+    uint8_t *bytes;
+    size_t size;
+};
 
-        nanosleep(&ts, NULL);
-        last_time = time(NULL);
+/*
+ * Write a VM.set_NVRAM_EFI_variables request for the serialized variable
+ * list.  The header and the XML around the list are sent from where they
+ * are, and the list is encoded in chunks into nvram_chunk as it is sent, so
+ * the request is never assembled in memory.
+ */
+static int write_set_efi_vars(int fd, const void *arg)
+{
+    const struct nvram *nvram = arg;
+    char header[sizeof(HTTP_HEADER) + MAX_CONTENT_LENGTH_DIGITS];
+    struct iovec iov[4];
+    size_t body_len, off, n, count;
+    int hdr_len, ret;
+
+    body_len = sizeof(HTTP_BODY_SET_NVRAM_VARS_START) - 1 +
+               BASE64_ENCODED_SIZE(nvram->size) +
+               sizeof(HTTP_BODY_SET_NVRAM_VARS_END) - 1;
+
+    hdr_len = create_header(body_len, header, sizeof(header));
+
+    if (hdr_len < 0 || (size_t)hdr_len >= sizeof(header))
+        return -1;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = hdr_len;
+    iov[1].iov_base = HTTP_BODY_SET_NVRAM_VARS_START;
+    iov[1].iov_len = sizeof(HTTP_BODY_SET_NVRAM_VARS_START) - 1;
+    count = 2;
+
+    for (off = 0; ; off += n) {
+        n = min(nvram->size - off, NVRAM_CHUNK_SIZE);
+
+        iov[count].iov_base = nvram_chunk;
+        iov[count++].iov_len = base64_encode(nvram_chunk, nvram->bytes + off,
+                                             n);
+
+        if (off + n == nvram->size) {
+            iov[count].iov_base = HTTP_BODY_SET_NVRAM_VARS_END;
+            iov[count++].iov_len = sizeof(HTTP_BODY_SET_NVRAM_VARS_END) - 1;
+        }
+
+        ret = send_iov_all(fd, iov, count);
+
+        if (ret < 0 || off + n == nvram->size)
+            return ret;
+
+        count = 0;
     }
 }
 
 /**
- * Set vars in XAPI database.
+ * Serialize the non-volatile variables for xapi_set().
  *
- * Returns 0 on success, otherwise -1.
+ * Must be called with the store locked, which xapi_set() does not need.
+ *
+ * Returns the snapshot, or NULL on failure.
  */
-int xapi_set(void)
+void *xapi_snapshot(void)
 {
-    char* buffer;
-    int ret;
+    struct nvram *nvram;
 
-    throttle();
+    nvram = calloc(1, sizeof(*nvram));
 
-    buffer = calloc(1, MSG_SIZE);
-    if (!buffer)  {
-        return -ENOMEM;
+    if (!nvram)
+        return NULL;
+
+    /* Nothing to send, which xapi_set() takes as done */
+    if (!storage_count_nonvolatile())
+        return nvram;
+
+    nvram->bytes = variable_list_bytes(&nvram->size, true);
+
+    if (!nvram->bytes) {
+        DBG("Failed to serialize variables for VM.set_NVRAM_EFI_variables\n");
+        free(nvram);
+        return NULL;
     }
 
+    /* It could not be read back */
+    if (nvram->size > MAX_LIST_SIZE) {
+        ERROR("Variables take %zu bytes, more than the %zu that can be read "
+              "back, not persisting them\n", nvram->size, MAX_LIST_SIZE);
+        free(nvram->bytes);
+        free(nvram);
+        return NULL;
+    }
 
-    ret = build_set_efi_vars_message(buffer, MSG_SIZE);
+    return nvram;
+}
 
-    if (ret < 0) {
-        DBG("Failed to build VM.set_NVRAM_EFI_variables message, ret=%d\n", ret);
-        goto out;
+/**
+ * Set vars in XAPI database from a snapshot taken by xapi_snapshot(), which
+ * is freed.
+ *
+ * Returns 0 on success, otherwise -1.
+ */
+int xapi_set(void *snapshot)
+{
+    char response[MAX_RESPONSE_SIZE];
+    struct nvram *nvram = snapshot;
+    int ret;
+
+    if (!nvram)
+        return -1;
+
+    if (!nvram->bytes) {
+        free(nvram);
+        return 0;
     }
 
-    ret = send_request(buffer, buffer, MSG_SIZE);
+    ret = exchange(write_set_efi_vars, nvram, response, sizeof(response));
 
-  out:
-    free(buffer);
+    free(nvram->bytes);
+    free(nvram);
     return ret;
 }
 
@@ -662,7 +745,7 @@ int xapi_set(void)
     "Host: _var_lib_xcp_xapi\r\n"                                              \
     "Accept-Encoding: identity\r\n"                                            \
     "User-Agent: uefistored/0.1\r\n"                                           \
-    "Connection: close\r\n"                                                    \
+    "Connection: keep-alive\r\n"                                               \
     "Content-Type: text/xml\r\n"                                               \
     "Content-Length: 307\r\n"                                                  \
     "\r\n"                                                                     \
@@ -699,6 +782,22 @@ int xapi_connect(void)
     return ret;
 }
 
+/*
+ * The session of every request but VM.set_NVRAM_EFI_variables, which needs
+ * none.  It is logged in on first use and kept until XAPI reports it invalid,
+ * rather than logged in and out for every call.  Empty when there is none.
+ *
+ * Only used with session_lock held.
+ */
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cached_session[SESSION_ID_SIZE];
+
+/**
+ * Send an XML-RPC request to XAPI, with the body built from format.
+ *
+ * @return 0 if XAPI answered with HTTP status 200, otherwise a negative
+ * value.  See xapi_response() for the outcome of the call.
+ */
 int xapi_request(char *response, size_t response_sz, const char *format, ...)
 {
     va_list ap;
@@ -742,139 +841,57 @@ int xapi_request(char *response, size_t response_sz, const char *format, ...)
 }
 
 /**
- * Return true if body contains "SUCCESS" element, otherwise return false.
+ * Read the outcome of a call from XAPI's response.
+ *
+ * Must be called with session_lock held if the call was made with the cached
+ * session.
+ *
+ * @parm response the NUL terminated HTTP response
+ * @parm key NULL to copy the value returned, otherwise the member of the
+ *           struct returned to copy
+ * @parm out the buffer for the value, or NULL
+ * @parm n the size of out
  *
- * body: an XML string
+ * @return 0 on success, -ENOENT if the struct returned has no member key,
+ * -EAGAIN if XAPI reported the session invalid, in which case the cached
+ * session is dropped, otherwise -1.
  */
-static bool success(char *xml)
+static int xapi_response(char *response, const char *key, char *out, size_t n)
 {
-    size_t len;
+    char *body = response_body(response);
+    char code[64];
     int ret;
 
-    xmlDoc *doc;
-    xmlXPathObject *obj;
-    xmlXPathContext *context;
-    xmlChar *string;
-
-    if (!xml)
-        return false;
-
-    len = strlen(xml);
-
-    doc = xmlReadMemory(xml, len + 1, "noname.xml", 0, 0);
-
-    if (!doc) {
-        ERROR("xmlReadMemory() error\n");
-        return false;
-    }
-
-    context = xmlXPathNewContext(doc);
-    if (!context) {
-        ERROR("xmlXPathNewContext() error\n");
-        return false;
-    }
-
-    obj = xmlXPathEvalExpression(
-            (xmlChar *)"/methodResponse/params/param/value/struct/member[1]/value",
-            context);
-
-    if (!obj) {
-        ERROR("xmlXPathEvalExpression() error\n");
-        xmlXPathFreeContext(context);
-        return false;
-    }
-
-    string = xmlNodeGetContent(obj->nodesetval->nodeTab[0]->xmlChildrenNode);
-
-    if (!string) {
-        ERROR("xmlNodeGetContent() error\n");
-        xmlXPathFreeContext(context);
-        xmlXPathFreeObject(obj);
-        return false;
-    }
-
-    ret = memcmp(string, "Success", 8);
-
-    xmlXPathFreeContext(context);
-    xmlXPathFreeObject(obj);
-    xmlFree(string);
-
-    return ret == 0;
-}
-
-static int get_value(char *body, char *dest, size_t n)
-{
-    xmlXPathContext *context;
-    xmlDoc *doc;
-    xmlXPathObject *obj;
-    xmlChar *string;
-
-    if (!body || !dest) {
-        return -1;
-    }
-
-    doc = xmlReadMemory(body, strlen(body), "dummy.xml", 0, 0);
-
-    if (!doc) {
-        ERROR("%s: xmlReadMemory() error\n", __func__);
-        return -1;
-    }
-
-    context = xmlXPathNewContext(doc);
-
-    if (!context) {
-        ERROR("%s: xmlXPathNewContext() error\n", __func__);
-        xmlFree(doc);
+    if (!body) {
+        ERROR("No body in XAPI response\n");
         return -1;
     }
 
-    obj = xmlXPathEvalExpression(
-            (xmlChar *)"/methodResponse/params/param/value/struct/member[2]/value",
-            context);
+    ret = xmlrpc_parse_response(body, strlen(body), key, out, n);
 
-    if (!obj) {
-        ERROR("%s: xmlXPathEvalExpression() error\n", __func__);
-        xmlXPathFreeContext(context);
-        xmlFreeDoc(doc);
-        return -1;
-    }
+    if (ret == XMLRPC_SUCCESS)
+        return 0;
 
-    string = xmlNodeGetContent((xmlNodePtr)obj->nodesetval->nodeTab[0]);
+    if (ret == XMLRPC_MISSING)
+        return -ENOENT;
 
-    if (!string) {
-        ERROR("%s: xmlNodeGetContent() error\n", __func__);
-        xmlXPathFreeObject(obj);
-        xmlXPathFreeContext(context);
-        xmlFreeDoc(doc);
+    if (ret != XMLRPC_FAILURE) {
+        ERROR("Unexpected XAPI response\n");
         return -1;
     }
 
-    strncpy(dest, (char *)string, n);
-
-    xmlFree(string);
-    xmlXPathFreeObject(obj);
-    xmlXPathFreeContext(context);
-    xmlFreeDoc(doc);
-
-    return 0;
-}
+    /* Failures are rare and short, read the error code out of this one */
+    xmlrpc_parse_response(body, strlen(body), NULL, code, sizeof(code));
 
-static int get_response_content(char *response, char *outstr, size_t n)
-
-{
-    char *body;
-
-    if (!response || !outstr || n == 0) {
-        return -1;
+    if (strcmp(code, "SESSION_INVALID") == 0) {
+        INFO("XAPI session expired\n");
+        cached_session[0] = '\0';
+        return -EAGAIN;
     }
 
-    body = response_body(response);
-
-    if (!success(body)) {
-        return -2;
-    }
+    ERROR("XAPI call failed: %s\n", code);
 
-    return get_value(body, outstr, n);
+    return -1;
 }
 
 /**
@@ -882,7 +899,7 @@ static int get_response_content(char *response, char *outstr, size_t n)
  *
  * @parm session_id the currently open session id.
  *
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -EAGAIN if the session expired, otherwise -1.
  */
 static int xapi_vm_get_by_uuid(char *session_id)
 {
@@ -908,13 +925,12 @@ static int xapi_vm_get_by_uuid(char *session_id)
         return -1;
     }
 
-    if (!success(response_body(response))) {
-        ERROR("failed to look up VM %s, response code %s\n", vm_uuid,
-              response_body(response));
-        return -1;
-    }
+    status = xapi_response(response, NULL, NULL, 0);
 
-    return 0;
+    if (status == -1)
+        ERROR("failed to look up VM %s\n", vm_uuid);
+
+    return status;
 }
 
 /**
@@ -950,7 +966,7 @@ int session_login(char *session_id, size_t n)
         return -1;
     }
 
-    ret = get_response_content(response, session_id, n);
+    ret = xapi_response(response, NULL, session_id, n);
 
     if (ret < 0) {
         ERROR("failed to login to xapi, ret=%d\n", ret);
@@ -1006,7 +1022,7 @@ int session_logout(char *session_id)
         return -1;
     }
 
-    if (!success(response_body(response))) {
+    if (xapi_response(response, NULL, NULL, 0) < 0) {
         ERROR("failed to logout of xapi session\n");
         return -1;
     }
@@ -1015,88 +1031,52 @@ int session_logout(char *session_id)
 }
 
 /**
- * This function returns the EFI vars in the VM.get_NVRAM XAPI XML response as Base64.
- *
- * @parm buffer the destination buffer
- * @parm n the max size of buffer
- * @parm body the null-terminated XML body
+ * Log in and check that the VM exists, unless there is a session cached
+ * already.  Must be called with session_lock held.
  *
- * @return 0 on succes, -1 on failure.
+ * @return 0 if cached_session holds a session, otherwise -1.
  */
-int base64_from_response_body(char *buffer, size_t n, char *body)
+static int session_get(void)
 {
-    size_t len;
-    xmlXPathObject *obj;
-    xmlDoc *doc;
-    xmlXPathContext *context;
-    xmlChar *string;
-
-    if (!body || !buffer)
-        return -1;
-
-    len = strlen(body);
-
-    doc = xmlReadMemory(body, len + 1, "dummy.xml", NULL, 0);
-
-    if (!doc) {
-        ERROR("null doc! err=%d, errstring=%s\n", errno, strerror(errno));
-        return -1;
-    }
-
-    context = xmlXPathNewContext(doc);
-
-    if (!context) {
-        free(doc);
+    if (cached_session[0])
+        return 0;
 
-        ERROR("xmlXPathNewContext() failed!\n");
+    if (session_login_retry(cached_session, SESSION_ID_SIZE) < 0) {
+        ERROR("failed to login session\n");
+        cached_session[0] = '\0';
         return -1;
     }
 
-    obj = xmlXPathEvalExpression(
-            (xmlChar *)"/methodResponse/params/param/value/struct/member[1]/value",
-            context);
-
-    if (!obj) {
-        ERROR("xmlXPathEvalExpression() failed!\n");
-        free(doc);
-        xmlXPathFreeContext(context);
-
+    if (xapi_vm_get_by_uuid(cached_session) < 0) {
+        ERROR("failed to get VM by uuid\n");
+        session_logout(cached_session);
+        cached_session[0] = '\0';
         return -1;
     }
 
-    string = xmlNodeGetContent((xmlNodePtr)obj->nodesetval->nodeTab[0]);
-    if (memcmp(string, "Success", 8) != 0) {
-        DBG("xapi response, no success!\n");
-        free(doc);
-        xmlXPathFreeContext(context);
-        xmlXPathFreeObject(obj);
+    return 0;
+}
 
+/**
+ * This function returns the EFI vars in the VM.get_NVRAM XAPI XML response as Base64.
+ *
+ * @parm buffer the destination buffer
+ * @parm n the max size of buffer
+ * @parm body the null-terminated XML body
+ *
+ * @return 0 on succes, -1 on failure.
+ */
+int base64_from_response_body(char *buffer, size_t n, char *body)
+{
+    if (!body || !buffer)
         return -1;
-    }
-
-    xmlFree(string);
-    xmlXPathFreeObject(obj);
-
-    obj = xmlXPathEvalExpression(
-            (xmlChar *)"/methodResponse/params/param/value/struct/member/value/struct/member[name=\"EFI-variables\"]/value",
-            context);
 
-    if (!obj || !obj->nodesetval) {
-        free(doc);
-        free(context);
-        DBG("EFI-vars not found in response\n");
+    if (xmlrpc_parse_response(body, strlen(body), "EFI-variables", buffer,
+                              n) != XMLRPC_SUCCESS) {
+        DBG("EFI-variables not found in response\n");
         return -1;
     }
 
-    string = xmlNodeGetContent(obj->nodesetval->nodeTab[0]);
-
-    strncpy(buffer, (char *)string, n);
-
-    xmlFree(string);
-    xmlXPathFreeObject(obj);
-    xmlXPathFreeContext(context);
-    xmlFreeDoc(doc);
-
     return 0;
 }
 
@@ -1118,13 +1098,17 @@ static int xapi_get_nvram(char *session_id, char *buffer, size_t n)
 {
     int status;
     char* response;
+    size_t size;
 
-    response = (char*)calloc(1, MSG_SIZE);
+    /* The largest list, and the HTTP and XML-RPC around it */
+    size = BASE64_ENCODED_SIZE(MAX_LIST_SIZE) + MAX_RESPONSE_SIZE;
+
+    response = (char*)calloc(1, size);
     if (!response) {
         return -ENOMEM;
     }
 
-    status = xapi_request(response, MSG_SIZE,
+    status = xapi_request(response, size,
                           "<?xmlversion=\'1.0\'?>"
                           "<methodCall>"
                           "<methodName>VM.get_NVRAM</methodName>"
@@ -1141,12 +1125,11 @@ static int xapi_get_nvram(char *session_id, char *buffer, size_t n)
         goto out;
     }
 
-    status =  base64_from_response(buffer, n, response);
+    /* The variables are decoded straight into buffer */
+    status = xapi_response(response, "EFI-variables", buffer, n);
 
-    if (status != 0) {
+    if (status == -1)
         ERROR("failed to parse XAPI response: status=%d\n", status);
-        status = -1;
-    }
 
   out:
     free(response);
@@ -1156,55 +1139,66 @@ static int xapi_get_nvram(char *session_id, char *buffer, size_t n)
 /**
  * This function stores the EFI vars locally after pulling them from XAPI.
  *
- * @parm vars the array of variables to store EFI vars into
- * @parm n the max size of the array vars
+ * @parm vars set to the array of variables, which the caller frees
  *
- * @return number of variables stored.
+ * @return number of variables stored, 0 if the VM has none yet, or -1 if they
+ * could not be fetched.
  */
-int xapi_variables_request(variable_t *vars, size_t n)
+int xapi_variables_request(variable_t **vars)
 {
-    int ret;
-    char session_id[SESSION_ID_SIZE];
-    uint8_t *plaintext;
+    int ret, retries;
+    size_t size;
     char *b64;
 
-    if (session_login_retry(session_id, SESSION_ID_SIZE) < 0) {
-        ERROR("failed to login session\n");
-        return 0;
-    }
-
-    if (xapi_vm_get_by_uuid(session_id) < 0) {
-        ERROR("failed to get VM by uuid\n");
-        return 0;
-    }
-
-    plaintext = (uint8_t*)calloc(2, MSG_SIZE);
-    if (!plaintext) {
+    size = BASE64_ENCODED_SIZE(MAX_LIST_SIZE) + 1;
+    b64 = calloc(1, size);
+    if (!b64) {
         ERROR("failed to allocate memory\n");
         return -ENOMEM;
     }
 
-    b64 = (char*)(plaintext + MSG_SIZE);
+    pthread_mutex_lock(&session_lock);
 
-    ret = xapi_get_nvram(session_id, b64, MSG_SIZE);
+    /* Log in again, once, if the cached session expired */
+    for (retries = 1; retries >= 0; retries--) {
+        ret = session_get();
 
-    if (ret < 0) {
+        if (ret == 0)
+            ret = xapi_get_nvram(cached_session, b64, size);
+
+        if (ret != -EAGAIN)
+            break;
+    }
+
+    pthread_mutex_unlock(&session_lock);
+
+    /* A new VM has no variables yet */
+    if (ret == -ENOENT) {
+        INFO("No EFI variables in VM.get_NVRAM response\n");
         ret = 0;
         goto out;
     }
 
-    session_logout(session_id);
+    /* Starting empty would overwrite the VM's variables, so do not start */
+    if (ret < 0) {
+        ERROR("Failed to fetch the EFI variables from XAPI\n");
+        ret = -1;
+        goto out;
+    }
 
-    ret = base64_to_bytes(plaintext, MSG_SIZE, b64, strlen(b64));
+    /* The bytes are shorter than their encoding, so decode in place */
+    ret = base64_decode((uint8_t*)b64, b64, strlen(b64));
 
-    if (ret < 0) {
+    if (ret <= 0) {
+        ERROR("No variables in VM.get_NVRAM response\n");
+        ret = -1;
         goto out;
     }
 
-    ret = from_bytes_to_vars(vars, n, plaintext, ret);
+    ret = alloc_vars_from_bytes(vars, (uint8_t*)b64, ret);
 
   out:
-    free(plaintext);
+    free(b64);
     return ret;
 }
 
@@ -1220,11 +1214,9 @@ int xapi_init(bool resume)
     int i, ret, len;
     EFI_STATUS status;
     variable_t *variables, *var;
+    uint64_t quota;
 
-    variables = calloc(MAX_VAR_COUNT,  sizeof(variable_t));
-
-    if (!variables)
-        return -1;
+    variables = NULL;
 
     if (!vm_uuid) {
         ERROR("No uuid initialized passed as arg!\n");
@@ -1234,18 +1226,25 @@ int xapi_init(bool resume)
     }
 
     if (resume) {
-        ret = xapi_variables_read_file(variables, MAX_VAR_COUNT,
-                                       resume_path);
+        ret = xapi_variables_read_file(&variables, resume_path);
     } else {
-        ret = xapi_variables_request(variables, MAX_VAR_COUNT);
+        ret = xapi_variables_request(&variables);
     }
 
     if (ret < 0)
         goto out;
 
     len = ret;
+    ret = 0;
+
+    /*
+     * What was saved is loaded whole, even over a quota lowered since, which
+     * only limits what the guest adds.
+     */
+    quota = storage_quota();
+    storage_set_quota(UINT64_MAX);
 
-	for (i = 0; i < len; i++) {
+    for (i = 0; i < len; i++) {
         var = &variables[i];
 
         if (var->attrs & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
@@ -1265,10 +1264,19 @@ int xapi_init(bool resume)
          * secure boot state.  It's best if we die loudly then let it slide
          * quietly and compromise a protected VM.
          */
-        assert(status == EFI_SUCCESS);
+        if (status != EFI_SUCCESS) {
+            ERROR("Failed to load variable %d of %d, status=%s (0x%lx)\n",
+                  i, len, efi_status_str(status), status);
+            ret = -1;
+            break;
+        }
     }
 
-    ret = 0;
+    storage_set_quota(quota);
+
+    /* Those not loaded */
+    while (++i < len)
+        variable_destroy_noalloc(&variables[i]);
 
 out:
     free(variables);
@@ -1312,30 +1320,59 @@ int xapi_save(void)
 
 void xapi_cleanup(void)
 {
-    if (socket_path)
-        free(socket_path);
-    if (save_path)
-        free(save_path);
-    if (resume_path)
-        free(resume_path);
-    if (vm_uuid)
-        free(vm_uuid);
+    pthread_mutex_lock(&session_lock);
+
+    if (cached_session[0]) {
+        session_logout(cached_session);
+        cached_session[0] = '\0';
+    }
+
+    pthread_mutex_unlock(&session_lock);
+
+    pthread_mutex_lock(&conn_lock);
+    conn_close();
+    pthread_mutex_unlock(&conn_lock);
+
+    free(socket_path);
+    free(save_path);
+    free(resume_path);
+    free(vm_uuid);
+
+    socket_path = NULL;
+    save_path = NULL;
+    resume_path = NULL;
+    vm_uuid = NULL;
 }
 
 int xapi_notify(void)
 {
-    char session_id[SESSION_ID_SIZE];
     char response[MAX_RESPONSE_SIZE];
-    int ret;
+    int ret, retries;
 
-    if (session_login_retry(session_id, SESSION_ID_SIZE) < 0) {
-        ERROR("failed to notify xapi of SB failure, session login failed\n");
-        return -1;
+    pthread_mutex_lock(&session_lock);
+
+    /* Log in again, once, if the cached session expired */
+    for (retries = 1; retries >= 0; retries--) {
+        if (session_get() < 0) {
+            ERROR("failed to notify xapi of SB failure, "
+                  "session login failed\n");
+            pthread_mutex_unlock(&session_lock);
+            return -1;
+        }
+
+        ret = xapi_request(response, MAX_RESPONSE_SIZE, MESSAGE_CREATE,
+                           cached_session, "VM_SECURE_BOOT_FAILED", 5, "VM",
+                           vm_uuid,
+                           "The VM failed to pass Secure Boot verification");
+
+        if (ret == 0)
+            ret = xapi_response(response, NULL, NULL, 0);
+
+        if (ret != -EAGAIN)
+            break;
     }
 
-    ret = xapi_request(response, MAX_RESPONSE_SIZE, MESSAGE_CREATE, session_id,
-                     "VM_SECURE_BOOT_FAILED", 5, "VM", vm_uuid,
-                     "The VM failed to pass Secure Boot verification");
+    pthread_mutex_unlock(&session_lock);
 
     if (ret) {
         ERROR("failed to send_request() to notify XAPI of SB failure\n");
@@ -1352,5 +1389,6 @@ struct backend xapidb = {
     .cleanup = xapi_cleanup,
     .parse_arg = xapi_parse_arg,
     .save = xapi_save,
+    .snapshot = xapi_snapshot,
     .set = xapi_set,
 };
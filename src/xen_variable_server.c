@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -12,8 +13,10 @@
 #include <openssl/evp.h>
 
 #include "backend.h"
+#include "barrier.h"
 #include "common.h"
 #include "log.h"
+#include "persist.h"
 #include "serializer.h"
 #include "storage.h"
 #include "uefi/types.h"
@@ -23,19 +26,211 @@
 #include "uefi/authlib.h"
 #include "uefi/utils.h"
 
-bool efi_at_runtime = false;
+/*
+ * Whether the request being served was made at runtime, i.e. after
+ * ExitBootServices().  Each serving thread has its own, set from every
+ * request it unserializes.
+ */
+__thread bool efi_at_runtime = false;
 
+/*
+ * A request as decoded from its snapshot (see struct snapshot).  name and
+ * data point into the snapshot, nothing is copied out of it.
+ */
 struct request {
     uint32_t version;
     command_t command;
-    int namesz;
-    uint8_t name[MAX_VARIABLE_NAME_SIZE];
-    ssize_t buffer_size;
-    uint8_t buffer[MAX_VARIABLE_DATA_SIZE];
+    size_t namesz;
+    const UTF16 *name; /* NUL-terminated */
     EFI_GUID guid;
+    uint64_t buffer_size; /* Size of the guest's output buffer */
+    const uint8_t *data;
+    size_t datasz;
     uint32_t attrs;
+    bool at_runtime;
+    uint32_t hash;
+    uint64_t total;  /* Of the whole data, in a chunked request */
+    uint64_t offset; /* Of the chunk in the whole data */
+};
+
+/*
+ * The guest can change the shared buffer at any time, so each request is
+ * decoded from a private copy instead.  Fields are copied into it one by one
+ * as the decoder reaches them, so exactly the bytes the command needs are
+ * copied, each only once, and every length is checked against both the shared
+ * buffer and the snapshot before anything is copied.
+ *
+ * A batch may fill the whole shared buffer, and each name in it takes up to
+ * three more bytes in the snapshot, for its alignment and its terminator (see
+ * snap_name()).
+ */
+#define SNAPSHOT_SIZE                                                          \
+    (SHMEM_SIZE + (MAX_BATCH_ENTRIES + 1) * (sizeof(UTF16) + 1))
+
+struct snapshot {
+    const uint8_t *src;
+    size_t size; /* Of the guest's buffer, which also takes the response */
+    size_t src_off;
+    uint8_t *buf;
+    size_t len;
 };
 
+static __thread uint8_t snapshot_buf[SNAPSHOT_SIZE]
+        __attribute__((aligned(8)));
+
+/*
+ * Copy the next n bytes of the request into the snapshot.
+ *
+ * Returns a pointer to them in the snapshot, or NULL if the request would
+ * overrun the shared buffer or the snapshot.
+ */
+static const uint8_t *snap_take(struct snapshot *snap, size_t n)
+{
+    uint8_t *p;
+
+    if (n > snap->size - snap->src_off || n > SNAPSHOT_SIZE - snap->len)
+        return NULL;
+
+    p = snap->buf + snap->len;
+
+    barrier();
+    memcpy(p, snap->src + snap->src_off, n);
+    barrier();
+
+    snap->src_off += n;
+    snap->len += n;
+
+    return p;
+}
+
+static int snap_u32(struct snapshot *snap, uint32_t *val)
+{
+    const uint8_t *p = snap_take(snap, sizeof(*val));
+
+    if (!p)
+        return -1;
+
+    memcpy(val, p, sizeof(*val));
+    return 0;
+}
+
+static int snap_u64(struct snapshot *snap, uint64_t *val)
+{
+    const uint8_t *p = snap_take(snap, sizeof(*val));
+
+    if (!p)
+        return -1;
+
+    memcpy(val, p, sizeof(*val));
+    return 0;
+}
+
+static int snap_bool(struct snapshot *snap, bool *val)
+{
+    const uint8_t *p = snap_take(snap, sizeof(*val));
+
+    if (!p)
+        return -1;
+
+    *val = !!*p;
+    return 0;
+}
+
+static int snap_guid(struct snapshot *snap, EFI_GUID *guid)
+{
+    const uint8_t *p = snap_take(snap, sizeof(*guid));
+
+    if (!p)
+        return -1;
+
+    memcpy(guid, p, sizeof(*guid));
+    return 0;
+}
+
+/*
+ * A length-prefixed data field of at most max bytes.  Returns 0 on success,
+ * -1 if the request is malformed or -2 if the field is larger than max.
+ */
+static int snap_data(struct snapshot *snap, const uint8_t **data, size_t *size,
+                     size_t max)
+{
+    uint64_t n;
+
+    if (snap_u64(snap, &n) < 0)
+        return -1;
+
+    if (n > max)
+        return -2;
+
+    *data = snap_take(snap, n);
+
+    if (!*data)
+        return -1;
+
+    *size = n;
+    return 0;
+}
+
+/*
+ * A length-prefixed name.  It is UTF16 aligned and NUL-terminated in the
+ * snapshot, so that it can be handed to code that expects a C string, even
+ * where the request has it at an odd offset, after odd sized data in a batch.
+ */
+static int snap_name(struct snapshot *snap, struct request *request)
+{
+    const uint8_t *name;
+    static const UTF16 nul = 0;
+    uint64_t n;
+
+    if (snap_u64(snap, &n) < 0)
+        return -1;
+
+    if (n > MAX_VARIABLE_NAME_SIZE)
+        return -2;
+
+    if (n % sizeof(UTF16))
+        return -1;
+
+    /* The snapshot is aligned, so an even offset in it is too */
+    if (snap->len % sizeof(UTF16)) {
+        if (snap->len >= SNAPSHOT_SIZE)
+            return -1;
+
+        snap->buf[snap->len++] = 0;
+    }
+
+    name = snap_take(snap, n);
+
+    if (!name)
+        return -1;
+
+    if (sizeof(nul) > SNAPSHOT_SIZE - snap->len)
+        return -1;
+
+    memcpy(snap->buf + snap->len, &nul, sizeof(nul));
+    snap->len += sizeof(nul);
+    request->name = (const UTF16 *)name;
+    request->namesz = n;
+
+    return 0;
+}
+
+/* The status to return to the guest for a failure of the snap_*() helpers */
+static EFI_STATUS snap_status(int ret)
+{
+    return ret == -2 ? EFI_OUT_OF_RESOURCES : EFI_DEVICE_ERROR;
+}
+
+static void snapshot_init(struct snapshot *snap, const void *comm_buf,
+                          size_t size)
+{
+    snap->src = comm_buf;
+    snap->size = size;
+    snap->src_off = 0;
+    snap->buf = snapshot_buf;
+    snap->len = 0;
+}
+
 static void debug_request(struct request *req)
 {
     if (loglevel < LOGLEVEL_DEBUG || !req)
@@ -43,11 +238,11 @@ static void debug_request(struct request *req)
 #if 0
     DPRINTF("request: version=%u, command=0x%02x, name=", req->version,
             req->command);
-    dprint_name((UTF16 *)req->name, req->namesz);
+    dprint_name(req->name, req->namesz);
     DPRINTF(", ");
 
     if (req->command == COMMAND_SET_VARIABLE)
-        dprint_data(req->buffer, req->buffer_size);
+        dprint_data(req->data, req->datasz);
 
     DPRINTF(", guid=0x%02llx", *((unsigned long long *)&req->guid));
 
@@ -85,89 +280,145 @@ static void serialize_buffer_too_small(void *comm_buf, size_t required_size)
     serialize_uintn(&ptr, (uint64_t)required_size);
 }
 
-static EFI_STATUS unserialize_get_request(struct request *request, void *comm_buf)
+/*
+ * GetVariable: name, guid, size of the guest's buffer and whether it is at
+ * runtime.
+ */
+static int snap_get_entry(struct snapshot *snap, struct request *request)
 {
-    const uint8_t *ptr;
+    int ret;
 
-    if (!comm_buf || !request)
-        return EFI_DEVICE_ERROR;
+    ret = snap_name(snap, request);
 
-    ptr = comm_buf;
+    if (ret < 0)
+        return ret;
 
-    request->version = unserialize_uint32(&ptr);
+    if (snap_guid(snap, &request->guid) < 0 ||
+        snap_u64(snap, &request->buffer_size) < 0)
+        return -1;
 
-    if (request->version != UEFISTORED_VERSION) {
-        return EFI_UNSUPPORTED;
-    }
+    request->hash = variable_hash(request->name, request->namesz,
+                                  &request->guid);
+
+    return 0;
+}
+
+static EFI_STATUS unserialize_get_request(struct request *request,
+                                          struct snapshot *snap)
+{
+    int ret;
 
-    request->command = (command_t)unserialize_uint32(&ptr);
-    request->namesz =
-            unserialize_data(&ptr, request->name, MAX_VARIABLE_NAME_SIZE);
+    ret = snap_get_entry(snap, request);
 
-    if (request->namesz < 0)
-        return EFI_OUT_OF_RESOURCES;
+    if (ret < 0)
+        return snap_status(ret);
+
+    if (snap_bool(snap, &request->at_runtime) < 0)
+        return EFI_DEVICE_ERROR;
 
-    unserialize_guid(&ptr, &request->guid);
-    request->buffer_size = unserialize_uint64(&ptr);
-    efi_at_runtime = unserialize_boolean(&ptr);
+    efi_at_runtime = request->at_runtime;
 
     return EFI_SUCCESS;
 }
 
-/**
- * Serialize a GetVariable error.
- *
- * @parm var the variable struct of the requested variable
- * @parm request the request structure
- * @parm comm_buf the shared memory page with the guest
- *
- * @return 0 if no error found, otherwise -1.
+/*
+ * A successful GetVariable response: the status, attributes and data size,
+ * followed by the data.
+ */
+struct get_response_header {
+    EFI_STATUS status;
+    uint32_t attrs;
+    uint64_t datasz;
+} __attribute__((packed));
+
+#define GET_RESPONSE_SIZE(datasz)                                              \
+    (sizeof(struct get_response_header) + (datasz))
+
+_Static_assert(GET_RESPONSE_SIZE(MAX_VARIABLE_DATA_SIZE) <= SHMEM_SIZE,
+               "GetVariable response does not fit the shared memory");
+
+/*
+ * Write the complete response for var, whose data must fit the guest's buffer,
+ * with a single copy of the data.
  */
-static int serialize_get_error(variable_t *var, struct request *request,
-                               void *comm_buf)
+static void serialize_get_response(void *comm_buf, const variable_t *var)
 {
-    int ret;
+    struct get_response_header header = {
+        .status = EFI_SUCCESS,
+        .attrs = var->attrs,
+        .datasz = var->datasz,
+    };
     uint8_t *ptr = comm_buf;
 
-    assert(request != NULL);
-    assert(comm_buf != NULL);
+    barrier();
+    memcpy(ptr, &header, sizeof(header));
+    memcpy(ptr + sizeof(header), var->data, var->datasz);
+    barrier();
+}
 
-    ret = 0;
+/*
+ * Look up the variable of a decoded GetVariable request.  Returns EFI_SUCCESS
+ * if its data fits the guest's buffer and its response fits in limit bytes,
+ * with *var set for every status but EFI_NOT_FOUND and EFI_INVALID_PARAMETER.
+ */
+static EFI_STATUS lookup_variable(const struct request *request, size_t limit,
+                                  variable_t **var)
+{
+    *var = NULL;
 
-    /*
-     * The variable was not found or the system is at runtime and the
-     * variable is not accessible at runtime.
-     *
-     * Return to the guest EFI_NOT_FOUND.
-     */
-    if (!var) {
-        serialize_result(&ptr, EFI_NOT_FOUND);
-        ret = -1;
-    } else if (efi_at_runtime && !(var->attrs & EFI_VARIABLE_RUNTIME_ACCESS)) {
-        serialize_result(&ptr, EFI_NOT_FOUND);
-        ret = -1;
-    } else if (request->buffer_size < var->datasz) {
-        /*
-         * The guest's buffer is not large enough, return EFI_BUFFER_TOO_SMALL.
-         */
-        serialize_buffer_too_small(ptr, var->datasz);
-        ret = -1;
-    }
+    if (request->namesz == 0)
+        return EFI_INVALID_PARAMETER;
+
+    *var = storage_find_variable_cached(request->name, request->namesz,
+                                        &request->guid, request->hash);
+
+    /* Variables not accessible at runtime do not exist for the guest then */
+    if (!*var ||
+        (efi_at_runtime && !((*var)->attrs & EFI_VARIABLE_RUNTIME_ACCESS)))
+        return EFI_NOT_FOUND;
 
-    return ret;
+    if (request->buffer_size < (*var)->datasz ||
+        GET_RESPONSE_SIZE((*var)->datasz) > limit)
+        return EFI_BUFFER_TOO_SMALL;
+
+    return EFI_SUCCESS;
+}
+
+/*
+ * Write the response to a GetVariable request with status from
+ * lookup_variable(), or only return its size if size_only is true.
+ */
+static size_t serialize_get_result(void *comm_buf, EFI_STATUS status,
+                                   const variable_t *var, bool size_only)
+{
+    uint8_t *ptr = comm_buf;
+
+    switch (status) {
+    case EFI_SUCCESS:
+        if (!size_only)
+            serialize_get_response(comm_buf, var);
+        return GET_RESPONSE_SIZE(var->datasz);
+    case EFI_BUFFER_TOO_SMALL:
+        if (!size_only)
+            serialize_buffer_too_small(comm_buf, var->datasz);
+        return sizeof(EFI_STATUS) + sizeof(uint64_t);
+    default:
+        if (!size_only)
+            serialize_result(&ptr, status);
+        return sizeof(EFI_STATUS);
+    }
 }
 
-static void handle_get_variable(void *comm_buf)
+static void handle_get_variable(void *comm_buf, struct request *request,
+                                struct snapshot *snap)
 {
     uint8_t *ptr;
-    struct request req = { 0 };
-    struct request *request = &req;
     EFI_STATUS status;
     variable_t *var;
 
     ptr = comm_buf;
 
-    status = unserialize_get_request(request, comm_buf);
+    status = unserialize_get_request(request, snap);
     if (status != EFI_SUCCESS) {
         serialize_result(&ptr, status);
         return;
@@ -180,64 +431,46 @@ static void handle_get_variable(void *comm_buf)
         return;
     }
 
-    if (request->namesz <= 0) {
-        serialize_result(&ptr, EFI_INVALID_PARAMETER);
-        return;
-    }
-
-    var = storage_find_variable((UTF16 *)request->name, request->namesz,
-                                &request->guid);
+    status = lookup_variable(request, snap->size, &var);
+    serialize_get_result(comm_buf, status, var, false);
 
-    if (serialize_get_error(var, request, comm_buf) < 0)
-        return;
-
-    serialize_result(&ptr, EFI_SUCCESS);
-    serialize_uint32(&ptr, var->attrs);
-    serialize_data(&ptr, var->data, var->datasz);
-
-    if (loglevel >= LOGLEVEL_DEBUG &&
+    if (status == EFI_SUCCESS && loglevel >= LOGLEVEL_DEBUG &&
             memcmp(L"SecureBoot", var->name, var->namesz) == 0) {
         DBG("Returning to OVMF: SecureBoot=%u\n", *((uint8_t*)var->data));
     }
 }
 
-static void handle_query_variable_info(void *comm_buf)
+static void handle_query_variable_info(void *comm_buf, struct request *request,
+                                       struct snapshot *snap)
 {
-    uint32_t attrs, version, command;
+    uint32_t attrs;
     uint8_t *ptr;
     uint64_t max_variable_storage;
     uint64_t remaining_variable_storage;
     uint64_t max_variable_size;
-    const uint8_t *inptr = comm_buf;
 
     ptr = comm_buf;
-    version = unserialize_uint32(&inptr);
 
-    if (version != UEFISTORED_VERSION) {
-        ERROR("Bad uefistored version: %u\n", version);
+    if (request->command != COMMAND_QUERY_VARIABLE_INFO) {
+        ERROR("Bad command: %u\n", request->command);
         serialize_result(&ptr, EFI_DEVICE_ERROR);
         return;
     }
 
-    command = unserialize_uint32(&inptr);
-
-    if (command != COMMAND_QUERY_VARIABLE_INFO) {
-        ERROR("Bad command: %u\n", command);
+    if (snap_u32(snap, &attrs) < 0) {
         serialize_result(&ptr, EFI_DEVICE_ERROR);
         return;
     }
 
-    attrs = unserialize_uint32(&inptr);
-
     if (attrs == 0 || ((attrs & EFI_VARIABLE_RUNTIME_ACCESS) &&
                        !(attrs & EFI_VARIABLE_BOOTSERVICE_ACCESS))) {
         serialize_result(&ptr, EFI_INVALID_PARAMETER);
         return;
     }
 
-    max_variable_storage = MAX_STORAGE_SIZE;
+    max_variable_storage = storage_quota();
     max_variable_size = MAX_VARIABLE_SIZE;
-    remaining_variable_storage = MAX_STORAGE_SIZE - storage_used();
+    remaining_variable_storage = storage_remaining();
 
     ptr = comm_buf;
     serialize_result(&ptr, EFI_SUCCESS);
@@ -246,32 +479,49 @@ static void handle_query_variable_info(void *comm_buf)
     serialize_uint64(&ptr, max_variable_size);
 }
 
-static EFI_STATUS unserialize_set_request(struct request *request, void *comm_buf)
+/*
+ * SetVariable: name, guid, data, attributes and whether the guest is at
+ * runtime.
+ */
+static int snap_set_entry(struct snapshot *snap, struct request *request)
 {
-    const uint8_t *ptr;
+    int ret;
 
-    if (!comm_buf || !request)
-        return EFI_DEVICE_ERROR;
+    ret = snap_name(snap, request);
 
-    ptr = comm_buf;
-    request->version = unserialize_uint32(&ptr);
-    assert(request->version == UEFISTORED_VERSION);
-    request->command = (command_t)unserialize_uint32(&ptr);
-    request->namesz =
-            unserialize_data(&ptr, request->name, MAX_VARIABLE_NAME_SIZE);
+    if (ret == 0 && snap_guid(snap, &request->guid) < 0)
+        ret = -1;
+
+    if (ret == 0)
+        ret = snap_data(snap, &request->data, &request->datasz,
+                        MAX_VARIABLE_DATA_SIZE);
+
+    if (ret < 0)
+        return ret;
+
+    if (snap_u32(snap, &request->attrs) < 0)
+        return -1;
+
+    request->hash = variable_hash(request->name, request->namesz,
+                                  &request->guid);
+
+    return 0;
+}
+
+static EFI_STATUS unserialize_set_request(struct request *request,
+                                          struct snapshot *snap)
+{
+    int ret;
 
-    if (request->namesz < 0)
-        return EFI_OUT_OF_RESOURCES;
+    ret = snap_set_entry(snap, request);
 
-    unserialize_guid(&ptr, &request->guid);
-    request->buffer_size =
-            unserialize_data(&ptr, request->buffer, MAX_VARIABLE_DATA_SIZE);
+    if (ret < 0)
+        return snap_status(ret);
 
-    if (request->buffer_size < 0)
-        return EFI_OUT_OF_RESOURCES;
+    if (snap_bool(snap, &request->at_runtime) < 0)
+        return EFI_DEVICE_ERROR;
 
-    request->attrs = unserialize_uint32(&ptr);
-    efi_at_runtime = unserialize_boolean(&ptr);
+    efi_at_runtime = request->at_runtime;
 
     return EFI_SUCCESS;
 }
@@ -300,14 +550,78 @@ static bool is_ro(UTF16 *name, uint64_t namesz, EFI_GUID *guid)
     return false;
 }
 
-static void handle_set_variable(void *comm_buf)
+/*
+ * Apply a decoded SetVariable request to the store, leaving the variable with
+ * at most max_datasz bytes of data.  *secure_boot is set if it was for a
+ * secure boot variable.
+ */
+static EFI_STATUS update_variable(const struct request *request,
+                                  size_t max_datasz, bool *secure_boot)
+{
+    EFI_STATUS status;
+
+    *secure_boot = false;
+
+    if (request->namesz == 0 || request->name[0] == 0 ||
+        ((request->attrs & EFI_VARIABLE_RUNTIME_ACCESS) &&
+         !(request->attrs & EFI_VARIABLE_BOOTSERVICE_ACCESS)))
+        return EFI_INVALID_PARAMETER;
+
+    if (is_ro((UTF16 *)request->name, request->namesz,
+              (EFI_GUID *)&request->guid))
+        return EFI_WRITE_PROTECTED;
+
+    status = evaluate_attrs(request->attrs);
+
+    if (status != EFI_SUCCESS)
+        return status;
+
+    *secure_boot = is_secure_boot_variable((UTF16 *)request->name,
+                                           request->namesz,
+                                           (EFI_GUID *)&request->guid);
+
+    storage_limit_data(max_datasz);
+
+    if (request->attrs & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS ||
+        *secure_boot) {
+        /*
+         * An authenticated write may update several variables (e.g. the
+         * variable and its timestamp store), keep all or none of them.
+         */
+        status = storage_begin();
+
+        if (status == EFI_SUCCESS) {
+            status = auth_lib_process_variable(
+                    (UTF16 *)request->name, request->namesz,
+                    (EFI_GUID *)&request->guid, (void *)request->data,
+                    request->datasz, request->attrs);
+
+            if (status == EFI_SUCCESS)
+                storage_commit();
+            else
+                storage_abort();
+        }
+    } else {
+        status = storage_set_hashed(request->name, request->namesz,
+                                    &request->guid, request->hash,
+                                    request->data, request->datasz,
+                                    request->attrs);
+    }
+
+    storage_limit_data(MAX_CHUNKED_DATA_SIZE);
+
+    return status;
+}
+
+static void handle_set_variable(void *comm_buf, struct request *request,
+                                struct snapshot *snap)
 {
     uint8_t *ptr = comm_buf;
-    struct request req = { 0 };
-    struct request *request = &req;
     EFI_STATUS status;
+    uint64_t nv_gen;
+    bool secure_boot;
 
-    status = unserialize_set_request(request, comm_buf);
+    status = unserialize_set_request(request, snap);
     if (status != EFI_SUCCESS) {
         serialize_result(&ptr, status);
         return;
@@ -321,67 +635,34 @@ static void handle_set_variable(void *comm_buf)
         return;
     }
 
-    if (request->name[0] == 0 ||
-        ((request->attrs & EFI_VARIABLE_RUNTIME_ACCESS) &&
-         !(request->attrs & EFI_VARIABLE_BOOTSERVICE_ACCESS))) {
-        serialize_result(&ptr, EFI_INVALID_PARAMETER);
-        return;
-    }
-
-    if (is_ro((UTF16 *)request->name, request->namesz, &request->guid)) {
-        serialize_result(&ptr, EFI_WRITE_PROTECTED);
-        return;
-    }
-
-    status = evaluate_attrs(request->attrs);
-
-    if (status != EFI_SUCCESS) {
-        serialize_result(&ptr, status);
-        return;
-    }
+    nv_gen = storage_nv_generation();
+    status = update_variable(request, MAX_VARIABLE_DATA_SIZE, &secure_boot);
 
-    if (request->attrs & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS ||
-        is_secure_boot_variable((UTF16 *)request->name, request->namesz,
-                                &request->guid)) {
-        status = auth_lib_process_variable(
-                (UTF16 *)request->name, request->namesz, &request->guid,
-                request->buffer, request->buffer_size, request->attrs);
-
-    } else {
-        status = storage_set((UTF16 *)request->name, request->namesz,
-                             &request->guid, request->buffer,
-                             request->buffer_size, request->attrs);
-    }
-
-    if (status == EFI_SUCCESS && request->attrs & EFI_VARIABLE_NON_VOLATILE) {
-        backend_set();
+    /*
+     * Only persist if a non-volatile variable changed, which includes
+     * deleting one with attrs == 0.
+     */
+    if (status == EFI_SUCCESS && storage_nv_generation() != nv_gen) {
+        persist_changed(secure_boot);
     }
 
     serialize_result(&ptr, status);
 }
 
-static int unserialize_get_next_request(struct request *request, void *comm_buf)
+/*
+ * GetNextVariableName: size of the guest's buffer, the previous name and guid
+ * and whether the guest is at runtime.
+ */
+static int unserialize_get_next_request(struct request *request,
+                                        struct snapshot *snap)
 {
-    const uint8_t *ptr;
-
-    if (!comm_buf || !request)
-        return -1;
-
-    ptr = comm_buf;
-    request->version = unserialize_uint32(&ptr);
-
-    assert(request->version == 1);
-
-    request->command = unserialize_uint32(&ptr);
-    request->buffer_size = unserialize_uintn(&ptr);
-    request->namesz =
-            unserialize_data(&ptr, request->name, MAX_VARIABLE_NAME_SIZE);
-
-    if (request->namesz < 0)
+    if (snap_u64(snap, &request->buffer_size) < 0 ||
+        snap_name(snap, request) < 0 ||
+        snap_guid(snap, &request->guid) < 0 ||
+        snap_bool(snap, &request->at_runtime) < 0)
         return -1;
 
-    unserialize_guid(&ptr, &request->guid);
-    efi_at_runtime = unserialize_boolean(&ptr);
+    efi_at_runtime = request->at_runtime;
 
     return 0;
 }
@@ -394,27 +675,20 @@ static int unserialize_get_next_request(struct request *request, void *comm_buf)
  *
  * @comm_buf:  The shared memory page with the OVMF XenVariable module.
  */
-static void handle_get_next_variable(void *comm_buf)
+static void handle_get_next_variable(void *comm_buf, struct request *request,
+                                     struct snapshot *snap)
 {
     uint8_t *ptr = comm_buf;
-    struct request req = { 0 };
-    struct request *request = &req;
     variable_t *next;
 
-    ptr = comm_buf;
-
-    if (unserialize_get_next_request(request, comm_buf) < 0) {
+    if (unserialize_get_next_request(request, snap) < 0) {
         ERROR("failed to unserialize request\n");
         serialize_result(&ptr, EFI_DEVICE_ERROR);
         return;
     }
 
-    assert(request->version == 1);
-    assert(request->command == COMMAND_GET_NEXT_VARIABLE);
-
     debug_request(request);
 
-
     next = storage_next_variable((UTF16 *)request->name, request->namesz,
                                  &request->guid);
 
@@ -434,51 +708,644 @@ static void handle_get_next_variable(void *comm_buf)
     }
 }
 
-void xen_variable_server_handle_request(void *comm_buf)
+/*
+ * The variables of a GetVariable or SetVariable batch.  Requests in a batch
+ * share the header and the runtime flag, which come before and after the
+ * variables respectively:
+ *
+ *   version, command, count, count * variable, at_runtime
+ *
+ * A variable is encoded as in the single variable request.
+ */
+struct batch {
+    uint32_t count;
+    struct request entries[MAX_BATCH_ENTRIES];
+};
+
+static EFI_STATUS unserialize_batch(struct batch *batch,
+                                    const struct request *request,
+                                    struct snapshot *snap,
+                                    int (*snap_entry)(struct snapshot *,
+                                                      struct request *))
 {
-    const uint8_t *inptr = comm_buf;
-    uint8_t *outptr = comm_buf;
-    uint32_t command;
-    uint32_t version;
+    bool at_runtime;
+    uint32_t i;
+    int ret;
 
-    if (!comm_buf) {
-        ERROR("comm buffer is null!\n");
+    if (snap_u32(snap, &batch->count) < 0)
+        return EFI_DEVICE_ERROR;
+
+    if (batch->count == 0 || batch->count > MAX_BATCH_ENTRIES)
+        return EFI_INVALID_PARAMETER;
+
+    for (i = 0; i < batch->count; i++) {
+        batch->entries[i] = *request;
+        ret = snap_entry(snap, &batch->entries[i]);
+
+        if (ret < 0)
+            return snap_status(ret);
+    }
+
+    if (snap_bool(snap, &at_runtime) < 0)
+        return EFI_DEVICE_ERROR;
+
+    for (i = 0; i < batch->count; i++)
+        batch->entries[i].at_runtime = at_runtime;
+
+    efi_at_runtime = at_runtime;
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * Return several variables in one request.
+ *
+ * The response is the status of the batch, the number of variables answered
+ * and the GetVariable response of each.  The variables that do not fit the
+ * shared memory are left out, for the guest to ask for again.
+ *
+ * @comm_buf:  The shared memory page with the OVMF XenVariable module.
+ */
+static void handle_get_variables_batch(void *comm_buf, struct request *request,
+                                       struct snapshot *snap)
+{
+    uint8_t *ptr = comm_buf;
+    uint8_t *count_ptr;
+    struct batch batch;
+    EFI_STATUS status;
+    variable_t *var;
+    size_t size, used, limit;
+    uint32_t i;
+
+    /* The whole batch is decoded first, the response overwrites it */
+    status = unserialize_batch(&batch, request, snap, snap_get_entry);
+
+    if (status != EFI_SUCCESS) {
+        serialize_result(&ptr, status);
+        return;
+    }
+
+    serialize_result(&ptr, EFI_SUCCESS);
+    count_ptr = ptr;
+    ptr += sizeof(uint32_t);
+    used = ptr - (uint8_t *)comm_buf;
+
+    /* A variable that would not fit even on its own is reported too large */
+    limit = snap->size - used;
+
+    for (i = 0; i < batch.count; i++) {
+        debug_request(&batch.entries[i]);
+
+        status = lookup_variable(&batch.entries[i], limit, &var);
+        size = serialize_get_result(ptr, status, var, true);
+
+        if (size > snap->size - used)
+            break;
+
+        serialize_get_result(ptr, status, var, false);
+        ptr += size;
+        used += size;
+    }
+
+    serialize_uint32(&count_ptr, i);
+}
+
+/**
+ * Set several variables in one request.
+ *
+ * The variables are set in order, each as by its own SetVariable request, but
+ * the changes are persisted together.  The response is the status of the
+ * batch, the number of variables and the status of each.
+ *
+ * @comm_buf:  The shared memory page with the OVMF XenVariable module.
+ */
+static void handle_set_variables_batch(void *comm_buf, struct request *request,
+                                       struct snapshot *snap)
+{
+    EFI_STATUS results[MAX_BATCH_ENTRIES];
+    uint8_t *ptr = comm_buf;
+    bool secure_boot = false;
+    struct batch batch;
+    EFI_STATUS status;
+    uint64_t nv_gen;
+    uint32_t i;
+    bool sb;
+
+    status = unserialize_batch(&batch, request, snap, snap_set_entry);
+
+    if (status != EFI_SUCCESS) {
+        serialize_result(&ptr, status);
+        return;
+    }
+
+    nv_gen = storage_nv_generation();
+
+    for (i = 0; i < batch.count; i++) {
+        debug_request(&batch.entries[i]);
+
+        results[i] = update_variable(&batch.entries[i],
+                                     MAX_VARIABLE_DATA_SIZE, &sb);
+
+        if (results[i] == EFI_SUCCESS)
+            secure_boot |= sb;
+    }
+
+    if (storage_nv_generation() != nv_gen)
+        persist_changed(secure_boot);
+
+    serialize_result(&ptr, EFI_SUCCESS);
+    serialize_uint32(&ptr, batch.count);
+
+    for (i = 0; i < batch.count; i++)
+        serialize_result(&ptr, results[i]);
+}
+
+/**
+ * Return the names of the variables after a given one, as many as fit.
+ *
+ * The request is the name and guid of the last variable the guest has (an
+ * empty name to start) and the runtime flag.  The response is the status, the
+ * number of variables, whether there are more and the name and guid of each.
+ *
+ * @comm_buf:  The shared memory page with the OVMF XenVariable module.
+ */
+static void handle_get_all_names(void *comm_buf, struct request *request,
+                                 struct snapshot *snap)
+{
+    uint8_t *ptr = comm_buf;
+    uint8_t *header;
+    variable_t *var;
+    uint32_t count = 0;
+    size_t size, used;
+    int ret;
+
+    ret = snap_name(snap, request);
+
+    if (ret < 0 || snap_guid(snap, &request->guid) < 0 ||
+        snap_bool(snap, &request->at_runtime) < 0) {
+        serialize_result(&ptr, snap_status(ret));
+        return;
+    }
+
+    efi_at_runtime = request->at_runtime;
+
+    var = storage_next_variable((UTF16 *)request->name, request->namesz,
+                                &request->guid);
+
+    serialize_result(&ptr, EFI_SUCCESS);
+    header = ptr;
+    ptr += sizeof(uint32_t) + sizeof(bool);
+    used = ptr - (uint8_t *)comm_buf;
+
+    for (; var; var = storage_next_variable(var->name, var->namesz,
+                                            &var->guid)) {
+        size = sizeof(uint64_t) + var->namesz + sizeof(var->guid);
+
+        if (size > snap->size - used)
+            break;
+
+        serialize_name(&ptr, var->name, var->namesz);
+        serialize_guid(&ptr, &var->guid);
+        used += size;
+        count++;
+    }
+
+    serialize_uint32(&header, count);
+    serialize_boolean(&header, var != NULL);
+}
+
+/*
+ * Chunked SetVariable requests being received.  Each one stages the whole
+ * data until its last chunk comes in, and is then set like a SetVariable
+ * request with that data.  All of them together hold at most
+ * CHUNK_STAGING_BUDGET bytes, the least recently used ones are dropped to
+ * make room for new ones, and the guest has to start those over.
+ *
+ * Only changed with the store locked for writing.
+ */
+struct staging {
+    struct staging *next;
+    UTF16 name[MAX_VARIABLE_NAME_CHARS];
+    size_t namesz;
+    EFI_GUID guid;
+    uint32_t attrs;
+    uint8_t *data;
+    size_t total;
+    size_t received;
+    uint64_t last_used;
+};
+
+static struct staging *stagings;
+static size_t staging_used;
+static uint64_t staging_clock;
+
+static struct staging *staging_find(const struct request *request)
+{
+    struct staging *staging;
+
+    for (staging = stagings; staging; staging = staging->next) {
+        if (staging->namesz == request->namesz &&
+            memcmp(&staging->guid, &request->guid, sizeof(EFI_GUID)) == 0 &&
+            memcmp(staging->name, request->name, request->namesz) == 0)
+            return staging;
+    }
+
+    return NULL;
+}
+
+static void staging_drop(struct staging *staging)
+{
+    struct staging **p;
+
+    for (p = &stagings; *p != staging; p = &(*p)->next)
+        ;
+
+    *p = staging->next;
+    staging_used -= staging->total;
+
+    explicit_bzero(staging->data, staging->total);
+    free(staging->data);
+    free(staging);
+}
+
+static struct staging *staging_new(const struct request *request)
+{
+    struct staging *staging, *lru;
+
+    while (stagings && request->total > CHUNK_STAGING_BUDGET - staging_used) {
+        for (lru = staging = stagings; staging; staging = staging->next) {
+            if (staging->last_used < lru->last_used)
+                lru = staging;
+        }
+
+        DBG("Dropping a staged chunked SetVariable to make room\n");
+        staging_drop(lru);
+    }
+
+    staging = calloc(1, sizeof(*staging));
+
+    if (!staging)
+        return NULL;
+
+    staging->data = malloc(request->total);
+
+    if (!staging->data) {
+        free(staging);
+        return NULL;
+    }
+
+    memcpy(staging->name, request->name, request->namesz);
+    staging->namesz = request->namesz;
+    staging->guid = request->guid;
+    staging->attrs = request->attrs;
+    staging->total = request->total;
+
+    staging->next = stagings;
+    stagings = staging;
+    staging_used += staging->total;
+
+    return staging;
+}
+
+/**
+ * Receive one chunk of a SetVariable request for data of up to
+ * MAX_CHUNKED_DATA_SIZE bytes.
+ *
+ * The request is the name and guid, the size of the whole data, the offset
+ * of the chunk in it, the chunk, the attributes and the runtime flag.  Chunks
+ * must come in order, starting with offset 0, which also drops any earlier
+ * transfer of the same variable.  A chunk out of order, or one whose earlier
+ * chunks were dropped, gets EFI_ABORTED and the guest starts over.
+ *
+ * The response to the last chunk is the status of setting the variable, the
+ * others get EFI_SUCCESS.
+ *
+ * @comm_buf:  The shared memory page with the OVMF XenVariable module.
+ */
+static void handle_set_variable_chunk(void *comm_buf, struct request *request,
+                                      struct snapshot *snap)
+{
+    uint8_t *ptr = comm_buf;
+    struct staging *staging;
+    struct request whole;
+    EFI_STATUS status;
+    uint64_t nv_gen;
+    bool secure_boot;
+    int ret;
+
+    ret = snap_name(snap, request);
+
+    if (ret == 0 && (snap_guid(snap, &request->guid) < 0 ||
+                     snap_u64(snap, &request->total) < 0 ||
+                     snap_u64(snap, &request->offset) < 0))
+        ret = -1;
+
+    if (ret == 0)
+        ret = snap_data(snap, &request->data, &request->datasz,
+                        MAX_VARIABLE_DATA_SIZE);
+
+    if (ret == 0 && (snap_u32(snap, &request->attrs) < 0 ||
+                     snap_bool(snap, &request->at_runtime) < 0))
+        ret = -1;
+
+    if (ret < 0) {
+        serialize_result(&ptr, snap_status(ret));
+        return;
+    }
+
+    request->hash = variable_hash(request->name, request->namesz,
+                                  &request->guid);
+    efi_at_runtime = request->at_runtime;
+
+    if (request->total > MAX_CHUNKED_DATA_SIZE) {
+        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+        return;
+    }
+
+    if (request->namesz == 0 || request->datasz == 0 ||
+        request->offset > request->total ||
+        request->datasz > request->total - request->offset) {
+        serialize_result(&ptr, EFI_INVALID_PARAMETER);
+        return;
+    }
+
+    staging = staging_find(request);
+
+    if (request->offset == 0) {
+        if (staging)
+            staging_drop(staging);
+
+        staging = staging_new(request);
+
+        if (!staging) {
+            serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+            return;
+        }
+    } else if (!staging || staging->received != request->offset ||
+               staging->total != request->total ||
+               staging->attrs != request->attrs) {
+        if (staging)
+            staging_drop(staging);
+
+        serialize_result(&ptr, EFI_ABORTED);
+        return;
+    }
+
+    memcpy(staging->data + staging->received, request->data,
+           request->datasz);
+    staging->received += request->datasz;
+    staging->last_used = ++staging_clock;
+
+    if (staging->received < staging->total) {
+        serialize_result(&ptr, EFI_SUCCESS);
+        return;
+    }
+
+    whole = *request;
+    whole.data = staging->data;
+    whole.datasz = staging->total;
+
+    nv_gen = storage_nv_generation();
+    /* Only a chunked transfer may go beyond what GetVariable can return */
+    status = update_variable(&whole, MAX_CHUNKED_DATA_SIZE, &secure_boot);
+
+    if (status == EFI_SUCCESS && storage_nv_generation() != nv_gen)
+        persist_changed(secure_boot);
+
+    staging_drop(staging);
+    serialize_result(&ptr, status);
+}
+
+/* Status, attributes, size and generation of the data and the chunk's size */
+#define CHUNK_RESPONSE_HEADER_SIZE                                             \
+    (sizeof(EFI_STATUS) + sizeof(uint32_t) + 3 * sizeof(uint64_t))
+
+/**
+ * Return one chunk of a variable's data, for variables of up to
+ * MAX_CHUNKED_DATA_SIZE bytes.
+ *
+ * The request is the name and guid, the offset of the chunk, the size of the
+ * guest's buffer for it and the runtime flag.  The response is the status, the
+ * attributes, the size of the whole data, the generation of the variable's
+ * last change (see storage_generation()) and the chunk, as much as fits.  The
+ * guest starts over if the generation changes between chunks.
+ *
+ * @comm_buf:  The shared memory page with the OVMF XenVariable module.
+ */
+static void handle_get_variable_chunk(void *comm_buf, struct request *request,
+                                      struct snapshot *snap)
+{
+    uint8_t *ptr = comm_buf;
+    variable_t *var;
+    uint64_t len;
+    int ret;
+
+    ret = snap_name(snap, request);
+
+    if (ret == 0 && (snap_guid(snap, &request->guid) < 0 ||
+                     snap_u64(snap, &request->offset) < 0 ||
+                     snap_u64(snap, &request->buffer_size) < 0 ||
+                     snap_bool(snap, &request->at_runtime) < 0))
+        ret = -1;
+
+    if (ret < 0) {
+        serialize_result(&ptr, snap_status(ret));
+        return;
+    }
+
+    efi_at_runtime = request->at_runtime;
+
+    if (request->namesz == 0) {
+        serialize_result(&ptr, EFI_INVALID_PARAMETER);
+        return;
+    }
+
+    var = storage_find_variable_cached(request->name, request->namesz,
+                                       &request->guid,
+                                       variable_hash(request->name,
+                                                     request->namesz,
+                                                     &request->guid));
+
+    if (!var ||
+        (efi_at_runtime && !(var->attrs & EFI_VARIABLE_RUNTIME_ACCESS))) {
+        serialize_result(&ptr, EFI_NOT_FOUND);
+        return;
+    }
+
+    if (request->offset > var->datasz) {
+        serialize_result(&ptr, EFI_INVALID_PARAMETER);
+        return;
+    }
+
+    len = var->datasz - request->offset;
+
+    if (len > request->buffer_size)
+        len = request->buffer_size;
+
+    if (len > snap->size - CHUNK_RESPONSE_HEADER_SIZE)
+        len = snap->size - CHUNK_RESPONSE_HEADER_SIZE;
+
+    if (len == 0 && request->offset < var->datasz) {
+        serialize_buffer_too_small(comm_buf, var->datasz);
         return;
     }
 
-    /* advance the pointer passed the version field */
-    version = unserialize_uint32(&inptr);
+    serialize_result(&ptr, EFI_SUCCESS);
+    serialize_uint32(&ptr, var->attrs);
+    serialize_uint64(&ptr, var->datasz);
+    serialize_uint64(&ptr, var->last_modified_gen);
+    serialize_data(&ptr, var->data + request->offset, len);
+}
+
+/*
+ * Serve the request in the size bytes at buf, which is either the whole
+ * shared buffer or a slot of the ring.
+ */
+static void handle_one(void *buf, size_t size)
+{
+    uint8_t *outptr = buf;
+    struct request request;
+    struct snapshot snap;
+    uint32_t command;
+
+    snapshot_init(&snap, buf, size);
+
+    if (snap_u32(&snap, &request.version) < 0 ||
+        snap_u32(&snap, &command) < 0) {
+        serialize_result(&outptr, EFI_DEVICE_ERROR);
+        return;
+    }
 
-    if (version != 1) {
+    if (request.version != UEFISTORED_VERSION) {
         serialize_result(&outptr, EFI_DEVICE_ERROR);
-        ERROR("Bad version: %u\n", version);
+        ERROR("Bad version: %u\n", request.version);
         return;
     }
 
-    command = unserialize_uint32(&inptr);
+    request.command = command;
+
+    /* Only a call to XAPI, which has its own locks, the store is not used */
+    if (command == COMMAND_NOTIFY_SB_FAILURE) {
+        serialize_result(&outptr, backend_notify() < 0 ? EFI_DEVICE_ERROR :
+                                                         EFI_SUCCESS);
+        return;
+    }
+
+    /* Only requests that may change the store exclude each other */
+    if (command == COMMAND_SET_VARIABLE ||
+        command == COMMAND_SET_VARIABLES_BATCH ||
+        command == COMMAND_SET_VARIABLE_CHUNK)
+        storage_write_lock();
+    else
+        storage_read_lock();
 
     switch (command) {
     case COMMAND_GET_VARIABLE:
-        handle_get_variable(comm_buf);
+        handle_get_variable(buf, &request, &snap);
         break;
     case COMMAND_SET_VARIABLE:
-        handle_set_variable(comm_buf);
+        handle_set_variable(buf, &request, &snap);
         break;
     case COMMAND_GET_NEXT_VARIABLE:
-        handle_get_next_variable(comm_buf);
+        handle_get_next_variable(buf, &request, &snap);
         break;
     case COMMAND_QUERY_VARIABLE_INFO:
-        handle_query_variable_info(comm_buf);
+        handle_query_variable_info(buf, &request, &snap);
         break;
-    case COMMAND_NOTIFY_SB_FAILURE:
-        if (backend_notify() < 0) {
-            serialize_result(&outptr, EFI_DEVICE_ERROR);
-        } else {
-            serialize_result(&outptr, EFI_SUCCESS);
-        }
+    case COMMAND_GET_VARIABLES_BATCH:
+        handle_get_variables_batch(buf, &request, &snap);
+        break;
+    case COMMAND_SET_VARIABLES_BATCH:
+        handle_set_variables_batch(buf, &request, &snap);
+        break;
+    case COMMAND_GET_ALL_NAMES:
+        handle_get_all_names(buf, &request, &snap);
+        break;
+    case COMMAND_SET_VARIABLE_CHUNK:
+        handle_set_variable_chunk(buf, &request, &snap);
+        break;
+    case COMMAND_GET_VARIABLE_CHUNK:
+        handle_get_variable_chunk(buf, &request, &snap);
         break;
     default:
         ERROR("cmd: unknown, 0x%x\n", command);
         break;
     }
+
+    storage_unlock();
+}
+
+/* Ring consumers, i.e. workers kicked by different vCPUs, take turns */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Serve every request queued in the ring at comm_buf, including those queued
+ * while it is being served, see struct ring_header.
+ */
+static void handle_ring(void *comm_buf)
+{
+    struct ring_header *ring = comm_buf;
+    uint8_t *outptr = comm_buf;
+    uint8_t *slots = (uint8_t *)comm_buf + RING_HEADER_SIZE;
+    uint32_t count, size, req, rsp;
+
+    count = READ_ONCE(ring->slot_count);
+    size = READ_ONCE(ring->slot_size);
+
+    if (count == 0 || (count & (count - 1)) || size < RING_MIN_SLOT_SIZE ||
+        size % 8 || size > (SHMEM_SIZE - RING_HEADER_SIZE) / count) {
+        ERROR("Bad ring: %u slots of %u bytes\n", count, size);
+        serialize_result(&outptr, EFI_DEVICE_ERROR);
+        return;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+
+    rsp = READ_ONCE(ring->rsp_prod);
+
+    while (true) {
+        req = READ_ONCE(ring->req_prod);
+        smp_mb();
+
+        if (req - rsp > count) {
+            ERROR("Bad ring: %u requests queued\n", req - rsp);
+            break;
+        }
+
+        if (req == rsp) {
+            /* Ask for a kick for the next request, unless it came in */
+            WRITE_ONCE(ring->req_event, rsp + 1);
+            smp_mb();
+
+            if (READ_ONCE(ring->req_prod) == rsp)
+                break;
+
+            continue;
+        }
+
+        for (; rsp != req; rsp++) {
+            handle_one(slots + (size_t)(rsp & (count - 1)) * size, size);
+            smp_mb();
+            WRITE_ONCE(ring->rsp_prod, rsp + 1);
+        }
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+}
+
+void xen_variable_server_handle_request(void *comm_buf)
+{
+    uint32_t version;
+
+    if (!comm_buf) {
+        ERROR("comm buffer is null!\n");
+        return;
+    }
+
+    memcpy(&version, comm_buf, sizeof(version));
+
+    if (version == UEFISTORED_RING_VERSION)
+        handle_ring(comm_buf);
+    else
+        handle_one(comm_buf, SHMEM_SIZE);
 }
@@ -0,0 +1,591 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "xmlrpc.h"
+
+/*
+ * A reader for the XML-RPC responses of XAPI.
+ *
+ * Every call is answered with a struct of a Status member, "Success" or
+ * "Failure", and either the Value returned or an ErrorDescription, an array of
+ * strings whose first one is the error code:
+ *
+ *   <methodResponse><params><param><value><struct>
+ *     <member><name>Status</name><value>Success</value></member>
+ *     <member><name>Value</name><value>...</value></member>
+ *   </struct></value></param></params></methodResponse>
+ *
+ * Instead of building a document and querying it, the response is read in a
+ * single pass, checking its structure on the way, and only the text asked for
+ * is decoded straight into the caller's buffer.  Nothing is allocated and the
+ * nesting of values is bounded by MAX_DEPTH.
+ */
+
+#define MAX_DEPTH 16
+
+/* The longest tag name, longer ones are not XML-RPC */
+#define MAX_TAG 32
+
+/* Struct member names are compared up to this length */
+#define MAX_NAME 128
+
+/* The longest entity between '&' and ';', like "#x10FFFF" */
+#define MAX_ENTITY 8
+
+struct reader {
+    const char *p;
+    const char *end;
+};
+
+struct tag {
+    char name[MAX_TAG];
+    bool closing;
+    bool empty;
+};
+
+/*
+ * Where the text of a value goes.  With key NULL, that is the text of a
+ * scalar, or of the first element of an array, otherwise the text of the
+ * member named key of a struct.  A target whose member is set only applies
+ * to the member of that name of the enclosing struct.
+ */
+struct target {
+    const char *member;
+    const char *key;
+    char *out;
+    size_t size;
+    bool found;
+    bool truncated;
+};
+
+static int read_value(struct reader *r, const struct tag *tag,
+                      unsigned int depth, struct target *t);
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool is_name_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '.' || c == '_' || c == '-' ||
+           c == ':';
+}
+
+static bool starts_with(const struct reader *r, const char *s)
+{
+    size_t n = strlen(s);
+
+    return (size_t)(r->end - r->p) >= n && memcmp(r->p, s, n) == 0;
+}
+
+static void skip_space(struct reader *r)
+{
+    while (r->p < r->end && is_space(*r->p))
+        r->p++;
+}
+
+static int skip_past(struct reader *r, const char *s)
+{
+    size_t n = strlen(s);
+
+    while ((size_t)(r->end - r->p) >= n) {
+        if (memcmp(r->p, s, n) == 0) {
+            r->p += n;
+            return 0;
+        }
+
+        r->p++;
+    }
+
+    return -1;
+}
+
+/* Skip spaces, the XML declaration and comments around the root element */
+static int skip_misc(struct reader *r)
+{
+    while (true) {
+        skip_space(r);
+
+        if (starts_with(r, "<?")) {
+            if (skip_past(r, "?>") < 0)
+                return -1;
+        } else if (starts_with(r, "<!--")) {
+            if (skip_past(r, "-->") < 0)
+                return -1;
+        } else {
+            return 0;
+        }
+    }
+}
+
+/* Read the next tag, after any spaces.  Tags have no attributes here. */
+static int next_tag(struct reader *r, struct tag *tag)
+{
+    size_t len = 0;
+
+    skip_space(r);
+
+    if (r->p >= r->end || *r->p != '<')
+        return -1;
+
+    r->p++;
+    tag->closing = r->p < r->end && *r->p == '/';
+
+    if (tag->closing)
+        r->p++;
+
+    while (r->p < r->end && is_name_char(*r->p)) {
+        if (len + 1 >= sizeof(tag->name))
+            return -1;
+
+        tag->name[len++] = *r->p++;
+    }
+
+    tag->name[len] = '\0';
+
+    if (len == 0)
+        return -1;
+
+    skip_space(r);
+    tag->empty = !tag->closing && r->p < r->end && *r->p == '/';
+
+    if (tag->empty)
+        r->p++;
+
+    if (r->p >= r->end || *r->p != '>')
+        return -1;
+
+    r->p++;
+
+    return 0;
+}
+
+/* Read the next tag, which must be the opening or closing tag name */
+static int expect(struct reader *r, const char *name, bool closing)
+{
+    struct tag tag;
+
+    if (next_tag(r, &tag) < 0 || tag.closing != closing || tag.empty ||
+        strcmp(tag.name, name) != 0)
+        return -1;
+
+    return 0;
+}
+
+static size_t utf8_encode(uint32_t cp, char *buf)
+{
+    if (cp < 0x80) {
+        buf[0] = cp;
+        return 1;
+    }
+
+    if (cp < 0x800) {
+        buf[0] = 0xc0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+
+    if (cp < 0x10000) {
+        buf[0] = 0xe0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+
+    buf[0] = 0xf0 | (cp >> 18);
+    buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+    buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+    buf[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/*
+ * Decode the entity of n bytes at name, between '&' and ';', into buf.
+ *
+ * @return the number of bytes decoded, 0 if the entity is unknown.
+ */
+static size_t decode_entity(const char *name, size_t n, char *buf)
+{
+    static const struct {
+        const char *name;
+        char c;
+    } entities[] = {
+        { "amp", '&' }, { "lt", '<' },    { "gt", '>' },
+        { "quot", '"' }, { "apos", '\'' },
+    };
+    unsigned int base = 10, digit;
+    uint32_t cp = 0;
+    size_t i;
+
+    if (n >= 2 && name[0] == '#') {
+        i = 1;
+
+        if (name[1] == 'x') {
+            base = 16;
+            i++;
+        }
+
+        if (i == n)
+            return 0;
+
+        for (; i < n; i++) {
+            if (isdigit((unsigned char)name[i]))
+                digit = name[i] - '0';
+            else if (base == 16 && isxdigit((unsigned char)name[i]))
+                digit = (tolower((unsigned char)name[i]) - 'a') + 10;
+            else
+                return 0;
+
+            cp = cp * base + digit;
+
+            if (cp > 0x10ffff)
+                return 0;
+        }
+
+        if (cp == 0 || (cp >= 0xd800 && cp <= 0xdfff))
+            return 0;
+
+        return utf8_encode(cp, buf);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(entities); i++) {
+        if (strlen(entities[i].name) == n &&
+            memcmp(entities[i].name, name, n) == 0) {
+            buf[0] = entities[i].c;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Copy the n bytes at s to offset len of out, as far as they fit */
+static void append(char *out, size_t size, size_t len, const char *s,
+                   size_t n)
+{
+    if (!out || len + 1 >= size)
+        return;
+
+    if (n > size - 1 - len)
+        n = size - 1 - len;
+
+    memcpy(out + len, s, n);
+}
+
+/*
+ * Read the character data up to the next tag, decoding entities, and copy as
+ * much of it as fits to out, NUL terminated, unless out is NULL.
+ *
+ * @return the length of the text, which was truncated if it is size or more,
+ * or -1 if it is malformed.
+ */
+static ssize_t read_text(struct reader *r, char *out, size_t size)
+{
+    const char *lt, *amp, *semi;
+    char buf[4];
+    size_t len = 0, n;
+
+    lt = memchr(r->p, '<', r->end - r->p);
+
+    /* Text runs up to a tag, a document cannot end with it */
+    if (!lt)
+        return -1;
+
+    while (r->p < lt) {
+        amp = memchr(r->p, '&', lt - r->p);
+        n = (amp ? amp : lt) - r->p;
+
+        append(out, size, len, r->p, n);
+        len += n;
+        r->p += n;
+
+        if (!amp)
+            break;
+
+        semi = memchr(amp + 1, ';', min(lt - amp - 1, MAX_ENTITY + 1));
+
+        if (!semi)
+            return -1;
+
+        n = decode_entity(amp + 1, semi - amp - 1, buf);
+
+        if (n == 0)
+            return -1;
+
+        append(out, size, len, buf, n);
+        len += n;
+        r->p = semi + 1;
+    }
+
+    if (out && size > 0)
+        out[min(len, size - 1)] = '\0';
+
+    return len;
+}
+
+static bool is_scalar(const char *name)
+{
+    static const char *const types[] = {
+        "string", "int", "i4", "i8", "boolean", "double", "dateTime.iso8601",
+        "base64",
+    };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        if (strcmp(types[i], name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void set_found(struct target *t, size_t len)
+{
+    t->found = true;
+    t->truncated = t->out && len >= t->size;
+}
+
+/*
+ * Read the members of a struct whose opening tag was read, up to its closing
+ * tag, copying the value of each member named by one of the n targets.
+ */
+static int read_struct(struct reader *r, unsigned int depth,
+                       struct target *targets, size_t n)
+{
+    struct target *t;
+    struct tag tag;
+    char name[MAX_NAME];
+    ssize_t len;
+    size_t i;
+
+    while (true) {
+        if (next_tag(r, &tag) < 0)
+            return -1;
+
+        if (tag.closing && strcmp(tag.name, "struct") == 0)
+            return 0;
+
+        if (tag.closing || tag.empty || strcmp(tag.name, "member") != 0)
+            return -1;
+
+        if (expect(r, "name", false) < 0)
+            return -1;
+
+        len = read_text(r, name, sizeof(name));
+
+        if (len < 0 || expect(r, "name", true) < 0)
+            return -1;
+
+        t = NULL;
+
+        for (i = 0; i < n && (size_t)len < sizeof(name); i++) {
+            if (!targets[i].found && strcmp(targets[i].member, name) == 0) {
+                t = &targets[i];
+                break;
+            }
+        }
+
+        if (next_tag(r, &tag) < 0 || read_value(r, &tag, depth, t) < 0 ||
+            expect(r, "member", true) < 0)
+            return -1;
+    }
+}
+
+/*
+ * Read the elements of an array whose opening tag was read, up to its
+ * closing tag, copying the first one if t is set.
+ */
+static int read_array(struct reader *r, unsigned int depth, struct target *t)
+{
+    struct tag tag;
+
+    if (next_tag(r, &tag) < 0 || tag.closing || strcmp(tag.name, "data") != 0)
+        return -1;
+
+    while (!tag.empty) {
+        if (next_tag(r, &tag) < 0)
+            return -1;
+
+        if (tag.closing && strcmp(tag.name, "data") == 0)
+            break;
+
+        if (read_value(r, &tag, depth, t && !t->found ? t : NULL) < 0)
+            return -1;
+    }
+
+    return expect(r, "array", true);
+}
+
+/*
+ * Read a value whose opening tag was read as tag, up to its closing tag, and
+ * copy what t asks for, if t is set.
+ */
+static int read_value(struct reader *r, const struct tag *tag,
+                      unsigned int depth, struct target *t)
+{
+    struct target member;
+    bool scalar = t && !t->key;
+    const char *text, *text_end;
+    struct tag inner;
+    ssize_t len;
+
+    if (tag->closing || strcmp(tag->name, "value") != 0 || depth > MAX_DEPTH)
+        return -1;
+
+    if (tag->empty) {
+        if (scalar && t->out && t->size > 0)
+            t->out[0] = '\0';
+
+        if (scalar)
+            set_found(t, 0);
+
+        return 0;
+    }
+
+    /* Text right in the value is a string */
+    text = r->p;
+    len = read_text(r, scalar ? t->out : NULL, scalar ? t->size : 0);
+    text_end = r->p;
+
+    if (len < 0 || next_tag(r, &inner) < 0)
+        return -1;
+
+    if (inner.closing) {
+        if (strcmp(inner.name, "value") != 0)
+            return -1;
+
+        if (scalar)
+            set_found(t, len);
+
+        return 0;
+    }
+
+    /* Otherwise there is only space around the typed value */
+    for (; text < text_end; text++) {
+        if (!is_space(*text))
+            return -1;
+    }
+
+    if (strcmp(inner.name, "struct") == 0) {
+        member = (struct target){ .member = t ? t->key : NULL,
+                                  .out = t ? t->out : NULL,
+                                  .size = t ? t->size : 0 };
+
+        if (!inner.empty &&
+            read_struct(r, depth + 1, &member, t && t->key ? 1 : 0) < 0)
+            return -1;
+
+        if (t && t->key && member.found) {
+            t->found = true;
+            t->truncated = member.truncated;
+        }
+    } else if (strcmp(inner.name, "array") == 0) {
+        if (!inner.empty && read_array(r, depth + 1, scalar ? t : NULL) < 0)
+            return -1;
+    } else if (is_scalar(inner.name)) {
+        len = 0;
+
+        if (!inner.empty) {
+            len = read_text(r, scalar ? t->out : NULL, scalar ? t->size : 0);
+
+            if (len < 0 || expect(r, inner.name, true) < 0)
+                return -1;
+        } else if (scalar && t->out && t->size > 0) {
+            t->out[0] = '\0';
+        }
+
+        if (scalar)
+            set_found(t, len);
+    } else if (strcmp(inner.name, "nil") != 0 || !inner.empty) {
+        return -1;
+    }
+
+    return expect(r, "value", true);
+}
+
+static int parse_response(struct reader *r, struct target *members,
+                          size_t n)
+{
+    static const char *const path[] = {
+        "methodResponse", "params", "param", "value", "struct",
+    };
+    size_t i;
+
+    if (skip_misc(r) < 0)
+        return -1;
+
+    for (i = 0; i < ARRAY_SIZE(path); i++) {
+        if (expect(r, path[i], false) < 0)
+            return -1;
+    }
+
+    if (read_struct(r, 1, members, n) < 0)
+        return -1;
+
+    for (i = ARRAY_SIZE(path) - 1; i > 0; i--) {
+        if (expect(r, path[i - 1], true) < 0)
+            return -1;
+    }
+
+    if (skip_misc(r) < 0 || r->p != r->end)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Parse an XAPI response.
+ *
+ * @parm xml the body of the response
+ * @parm len the length of xml
+ * @parm key NULL to copy the response's value, which must be a scalar, or the
+ *           name of the member to copy of the response's value, a struct
+ * @parm out the buffer for the value copied, or NULL
+ * @parm size the size of out
+ *
+ * @return XMLRPC_SUCCESS if the call succeeded, and the value asked for was
+ * found and copied to out, NUL terminated, XMLRPC_MISSING if it succeeded but
+ * the struct returned has no member key, XMLRPC_FAILURE if the call failed, in
+ * which case the error code is copied to out, as much as fits, otherwise -1 if
+ * the response is malformed or the value is missing or does not fit, and out
+ * is left empty.
+ */
+int xmlrpc_parse_response(const char *xml, size_t len, const char *key,
+                          char *out, size_t size)
+{
+    char status[16];
+    struct target members[] = {
+        { .member = "Status", .out = status, .size = sizeof(status) },
+        { .member = "Value", .key = key, .out = out, .size = size },
+        { .member = "ErrorDescription", .out = out, .size = size },
+    };
+    struct reader r = { xml, xml + len };
+    int ret = -1;
+
+    if (out && size > 0)
+        out[0] = '\0';
+
+    if (!xml || parse_response(&r, members, ARRAY_SIZE(members)) < 0 ||
+        !members[0].found || members[0].truncated)
+        goto out;
+
+    if (strcmp(status, "Success") == 0) {
+        if (!out || (members[1].found && !members[1].truncated))
+            ret = XMLRPC_SUCCESS;
+        else if (key && !members[1].found)
+            ret = XMLRPC_MISSING;
+    } else if (strcmp(status, "Failure") == 0) {
+        ret = XMLRPC_FAILURE;
+    }
+
+out:
+    if (ret < 0 && out && size > 0)
+        out[0] = '\0';
+
+    return ret;
+}
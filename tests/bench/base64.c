@@ -0,0 +1,209 @@
+/*
+ * Benchmark for the base64 codec.
+ *
+ * Encodes and decodes serialized variable lists of kb KiB, the payload of
+ * VM.set_NVRAM_EFI_variables and VM.get_NVRAM, with the OpenSSL BIO chain
+ * the codec replaced, and with the codec with and without AVX2.  The lists
+ * hold load options and certificate database sized variables.
+ *
+ * Usage: base64 [kb...]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <openssl/evp.h>
+
+#include "base64.h"
+#include "common.h"
+#include "serializer.h"
+#include "variable.h"
+#include "xapi.h"
+
+/* Referenced by the store, there is no backend here */
+struct backend *backend = NULL;
+
+#define ROUNDS 200
+#define NAME_CHARS 9
+
+static uint8_t *bytes;
+static size_t bytes_size;
+static char *encoded;
+static uint8_t *decoded;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The BIO chain used before, the output is allocated as it was */
+static char *bio_encode(const uint8_t *in, size_t n)
+{
+    BIO *bio, *b64;
+    BUF_MEM *mem;
+    char *out;
+
+    b64 = BIO_new(BIO_f_base64());
+    bio = BIO_push(b64, BIO_new(BIO_s_mem()));
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    BIO_write(bio, in, n);
+    (void)BIO_flush(bio);
+    BIO_get_mem_ptr(bio, &mem);
+
+    out = malloc(mem->length + 1);
+    memcpy(out, mem->data, mem->length);
+    out[mem->length] = '\0';
+
+    BIO_free_all(bio);
+
+    return out;
+}
+
+static int bio_decode(uint8_t *out, const char *in, size_t len)
+{
+    BIO *bio, *b64;
+    int ret;
+
+    b64 = BIO_new(BIO_f_base64());
+    bio = BIO_push(b64, BIO_new_mem_buf(in, len));
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    ret = BIO_read(bio, out, len);
+    BIO_free_all(bio);
+
+    return ret;
+}
+
+/* Boot#### variables and db sized certificate lists, up to size bytes */
+static void build(size_t size)
+{
+    variable_t *vars;
+    uint8_t data[2048];
+    char16_t name[NAME_CHARS + 1] = { 0 };
+    char ascii[24];
+    EFI_GUID guid = { .Data1 = 0x8be4df61 };
+    size_t i, j, n, max, datasz, total;
+    uint8_t *p;
+
+    max = size / 64;
+    vars = calloc(max, sizeof(*vars));
+
+    for (n = 0, total = 0; n < max; n++) {
+        datasz = n % 8 == 7 ? 1600 + n % 400 : 64 + n % 160;
+        total += datasz + 64;
+
+        if (total > size)
+            break;
+
+        snprintf(ascii, sizeof(ascii), "Boot%04zX", n);
+
+        for (j = 0; ascii[j] && j < NAME_CHARS; j++)
+            name[j] = ascii[j];
+
+        for (j = 0; j < datasz; j++)
+            data[j] = rand();
+
+        variable_create_noalloc(&vars[n], name, 8 * sizeof(char16_t), data,
+                                datasz, &guid,
+                                EFI_VARIABLE_NON_VOLATILE |
+                                EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                EFI_VARIABLE_RUNTIME_ACCESS, NULL, NULL);
+    }
+
+    bytes_size = list_size(vars, n);
+    bytes = malloc(bytes_size);
+    p = bytes;
+    serialize_variable_list(&p, bytes_size, vars, n);
+
+    encoded = malloc(BASE64_ENCODED_SIZE(bytes_size) + 1);
+    decoded = malloc(bytes_size + 2);
+
+    for (i = 0; i < n; i++)
+        variable_destroy_noalloc(&vars[i]);
+
+    free(vars);
+}
+
+static void run(size_t kb)
+{
+    double start, bio_enc, bio_dec, enc[2], dec[2];
+    size_t len, r;
+    char *out;
+    int simd;
+
+    build(kb * 1024);
+
+    start = now_ns();
+
+    for (r = 0; r < ROUNDS; r++)
+        free(bio_encode(bytes, bytes_size));
+
+    bio_enc = (now_ns() - start) / ROUNDS;
+
+    out = bio_encode(bytes, bytes_size);
+    len = strlen(out);
+    start = now_ns();
+
+    for (r = 0; r < ROUNDS; r++)
+        bio_decode(decoded, out, len);
+
+    bio_dec = (now_ns() - start) / ROUNDS;
+
+    for (simd = 0; simd < 2; simd++) {
+        base64_set_simd(simd);
+        start = now_ns();
+
+        for (r = 0; r < ROUNDS; r++)
+            base64_encode(encoded, bytes, bytes_size);
+
+        enc[simd] = (now_ns() - start) / ROUNDS;
+        start = now_ns();
+
+        for (r = 0; r < ROUNDS; r++)
+            base64_decode(decoded, encoded, len);
+
+        dec[simd] = (now_ns() - start) / ROUNDS;
+
+        if (strcmp(encoded, out) || memcmp(decoded, bytes, bytes_size)) {
+            printf("%8zu  mismatch\n", kb);
+            exit(1);
+        }
+    }
+
+    printf("%8zu  %-8s %10.1f %10.1f\n", kb, "bio", bio_enc / 1000,
+           bio_dec / 1000);
+    printf("%8zu  %-8s %10.1f %10.1f\n", kb, "scalar", enc[0] / 1000,
+           dec[0] / 1000);
+    printf("%8zu  %-8s %10.1f %10.1f\n", kb, "avx2", enc[1] / 1000,
+           dec[1] / 1000);
+
+    free(out);
+    free(bytes);
+    free(encoded);
+    free(decoded);
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[] = { 20, 50, 100, 200 };
+    size_t i;
+
+    printf("%8s  %-8s %10s %10s\n", "kb", "codec", "encode us", "decode us");
+
+    if (argc > 1) {
+        for (i = 1; i < (size_t)argc; i++)
+            run(strtoul(argv[i], NULL, 0));
+    } else {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++)
+            run(sizes[i]);
+    }
+
+    return 0;
+}
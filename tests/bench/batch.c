@@ -0,0 +1,194 @@
+/*
+ * Benchmark for the batched XenVariable commands.
+ *
+ * Reads a boot configuration of count variables the way a firmware does
+ * without batches (a GetNextVariableName() walk, then a GetVariable() of
+ * each) and with them (one GET_ALL_NAMES, then GET_VARIABLES_BATCH).  Each
+ * request is a VM exit for a real guest, so the number of requests is printed
+ * along with the time spent serving them, which excludes the exits.
+ *
+ * Usage: batch [count...]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "XenVariable.h"
+#include "serializer.h"
+#include "storage.h"
+#include "xen_variable_server.h"
+
+/* Referenced by the store, there is no backend here */
+struct backend *backend = NULL;
+
+#define ROUNDS 20
+#define NAME_CHARS 9
+
+static uint8_t comm_buf[SHMEM_SIZE];
+
+struct var {
+    char16_t name[NAME_CHARS + 1];
+    EFI_GUID guid;
+    uint8_t data[64];
+};
+
+static struct var *vars;
+static XEN_VARIABLE_BATCH_ENTRY *entries;
+static size_t names_seen;
+static unsigned long single_requests;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Boot####-like variables with a load option sized payload */
+static void build(size_t n)
+{
+    char ascii[24];
+    size_t i, j;
+
+    vars = calloc(n, sizeof(*vars));
+    entries = calloc(n, sizeof(*entries));
+
+    for (i = 0; i < n; i++) {
+        snprintf(ascii, sizeof(ascii), "Boot%04zX", i);
+
+        for (j = 0; ascii[j] && j < NAME_CHARS; j++)
+            vars[i].name[j] = ascii[j];
+
+        vars[i].guid.Data1 = 0x8be4df61;
+        memset(vars[i].data, i, sizeof(vars[i].data));
+
+        entries[i].VariableName = vars[i].name;
+        entries[i].VendorGuid = &vars[i].guid;
+        entries[i].Attributes = EFI_VARIABLE_NON_VOLATILE |
+                                EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                EFI_VARIABLE_RUNTIME_ACCESS;
+        entries[i].DataSize = sizeof(vars[i].data);
+        entries[i].Data = vars[i].data;
+    }
+
+    storage_set_quota(UINT64_MAX);
+    XenSetVariablesBatch(entries, n);
+}
+
+/* One request per name and one per variable */
+static void read_single(size_t n)
+{
+    char16_t name[MAX_VARIABLE_NAME_CHARS + 1] = { 0 };
+    uint64_t namesz, datasz;
+    uint8_t data[64];
+    EFI_GUID guid = { 0 };
+    const uint8_t *ptr;
+    uint32_t attrs;
+    size_t i;
+
+    for (;;) {
+        namesz = sizeof(name);
+        XenGetNextVariableName(&namesz, name, &guid);
+        xen_variable_server_handle_request(comm_buf);
+        single_requests++;
+
+        ptr = comm_buf;
+
+        if (unserialize_result(&ptr) != EFI_SUCCESS)
+            break;
+
+        namesz = unserialize_data(&ptr, name, MAX_VARIABLE_NAME_SIZE);
+        name[namesz / sizeof(char16_t)] = 0;
+        unserialize_guid(&ptr, &guid);
+        names_seen++;
+    }
+
+    for (i = 0; i < n; i++) {
+        datasz = sizeof(data);
+        XenGetVariable(vars[i].name, &vars[i].guid, &attrs, &datasz, data);
+        xen_variable_server_handle_request(comm_buf);
+        single_requests++;
+    }
+}
+
+static void count_name(char16_t *name, EFI_GUID *guid, void *context)
+{
+    names_seen++;
+}
+
+static void read_batched(size_t n)
+{
+    size_t i;
+
+    XenGetAllNames(count_name, NULL);
+
+    for (i = 0; i < n; i++)
+        entries[i].DataSize = sizeof(vars[i].data);
+
+    XenGetVariablesBatch(entries, n);
+}
+
+static void run(size_t n)
+{
+    unsigned long exits;
+    double start, single_ns, batched_ns;
+    unsigned long single_exits, batched_exits;
+    size_t r;
+
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+    build(n);
+
+    /* The single variable calls are served by the caller */
+    mock_xen_variable_server_set_handler(NULL);
+    single_requests = 0;
+    start = now_ns();
+
+    for (r = 0; r < ROUNDS; r++)
+        read_single(n);
+
+    single_ns = (now_ns() - start) / ROUNDS;
+    single_exits = single_requests / ROUNDS;
+
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+    exits = mock_xen_variable_server_exits();
+    start = now_ns();
+
+    for (r = 0; r < ROUNDS; r++)
+        read_batched(n);
+
+    batched_ns = (now_ns() - start) / ROUNDS;
+    batched_exits = (mock_xen_variable_server_exits() - exits) / ROUNDS;
+
+    printf("%8zu  %-8s %8lu %10.1f\n", n, "single", single_exits,
+           single_ns / 1000);
+    printf("%8zu  %-8s %8lu %10.1f\n", n, "batched", batched_exits,
+           batched_ns / 1000);
+
+    storage_destroy();
+    free(vars);
+    free(entries);
+}
+
+int main(int argc, char **argv)
+{
+    size_t counts[] = { 16, 64, 256, 1024 };
+    size_t i;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+
+    printf("%8s  %-8s %8s %10s\n", "vars", "calls", "exits", "us");
+
+    if (argc > 1) {
+        for (i = 1; i < (size_t)argc; i++)
+            run(strtoul(argv[i], NULL, 0));
+    } else {
+        for (i = 0; i < ARRAY_SIZE(counts); i++)
+            run(counts[i]);
+    }
+
+    return names_seen ? 0 : 1;
+}
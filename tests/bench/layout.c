@@ -0,0 +1,304 @@
+/*
+ * Microbenchmark for the variable_t layout.
+ *
+ * Compares key lookups and attribute-filtered enumeration over the previous
+ * layout (name first, order links after the whole variable) and the current
+ * one (order links, cached hash and the hot half of variable_t in the first
+ * cache line).  Both run the same index and list code, only the layout
+ * differs.  The real store is timed as well for reference.
+ *
+ * Usage: layout [count...]
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "storage.h"
+#include "variable.h"
+
+/* Referenced by the store, there is no backend here */
+struct backend *backend = NULL;
+
+#define ROUNDS 20
+
+/* variable_t before it was split into hot and cold fields */
+struct legacy_variable {
+    UTF16 name[MAX_VARIABLE_NAME_CHARS];
+    uint64_t namesz;
+    uint8_t *data;
+    uint64_t datasz;
+    EFI_GUID guid;
+    uint32_t attrs;
+    EFI_TIME timestamp;
+    uint8_t cert[SHA256_DIGEST_SIZE];
+};
+
+struct legacy_entry {
+    struct legacy_variable var;
+    struct legacy_entry *prev;
+    struct legacy_entry *next;
+};
+
+/* Mirrors struct entry in storage.c */
+struct split_entry {
+    struct split_entry *next;
+    struct split_entry *prev;
+    uint32_t hash;
+    variable_t var;
+    void *links[4];
+    void *chunk;
+    void *next_free;
+} __attribute__((aligned(64)));
+
+struct key {
+    UTF16 name[16];
+    size_t namesz;
+    EFI_GUID guid;
+    uint32_t hash;
+};
+
+struct slot {
+    uint32_t hash;
+    void *entry;
+};
+
+static struct key *keys;
+static size_t *order;
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t index_size_for(size_t n)
+{
+    size_t size = 64;
+
+    while (size < n * 2)
+        size *= 2;
+
+    return size;
+}
+
+/* Boot####-like names spread over a handful of GUIDs, in random order */
+static void make_keys(size_t n)
+{
+    size_t i, j, tmp;
+    char ascii[16];
+    int len;
+
+    keys = calloc(n, sizeof(*keys));
+    order = calloc(n, sizeof(*order));
+
+    for (i = 0; i < n; i++) {
+        len = snprintf(ascii, sizeof(ascii), "Boot%04zX", i);
+
+        for (j = 0; j < (size_t)len; j++)
+            keys[i].name[j] = ascii[j];
+
+        keys[i].namesz = len * sizeof(UTF16);
+        keys[i].guid.Data1 = 0x8be4df61 + (i % 4);
+        keys[i].hash = variable_hash(keys[i].name, keys[i].namesz,
+                                     &keys[i].guid);
+        order[i] = i;
+    }
+
+    srand(1);
+
+    for (i = n - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/*
+ * The same index and list code for both layouts, which only differ in the
+ * order key fields are compared in.
+ */
+#define DEFINE_LAYOUT(prefix, entry_t, key_eq)                                 \
+    static entry_t *prefix##_entries;                                          \
+    static struct slot *prefix##_index;                                        \
+    static size_t prefix##_mask;                                               \
+                                                                               \
+    static void prefix##_build(size_t n)                                       \
+    {                                                                          \
+        size_t i, j, size = index_size_for(n);                                 \
+        entry_t *e;                                                            \
+                                                                               \
+        if (posix_memalign((void **)&prefix##_entries, 64,                     \
+                           n * sizeof(entry_t)) != 0)                          \
+            exit(1);                                                           \
+                                                                               \
+        memset(prefix##_entries, 0, n * sizeof(entry_t));                      \
+        prefix##_index = calloc(size, sizeof(struct slot));                    \
+        prefix##_mask = size - 1;                                              \
+                                                                               \
+        for (i = 0; i < n; i++) {                                              \
+            e = &prefix##_entries[i];                                          \
+            memcpy(e->var.name, keys[i].name, keys[i].namesz);                 \
+            e->var.namesz = keys[i].namesz;                                    \
+            e->var.guid = keys[i].guid;                                        \
+            e->var.attrs = i % 3 ? 0x7 : 0x3;                                  \
+            e->prev = i ? &prefix##_entries[i - 1] : NULL;                     \
+            e->next = i + 1 < n ? &prefix##_entries[i + 1] : NULL;             \
+                                                                               \
+            for (j = keys[i].hash & prefix##_mask; prefix##_index[j].entry;    \
+                 j = (j + 1) & prefix##_mask)                                  \
+                ;                                                              \
+                                                                               \
+            prefix##_index[j].hash = keys[i].hash;                             \
+            prefix##_index[j].entry = e;                                       \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static entry_t *prefix##_lookup(const struct key *k)                       \
+    {                                                                          \
+        struct slot *slot;                                                     \
+        size_t i;                                                              \
+                                                                               \
+        for (i = k->hash & prefix##_mask;; i = (i + 1) & prefix##_mask) {      \
+            slot = &prefix##_index[i];                                         \
+                                                                               \
+            if (!slot->entry)                                                  \
+                return NULL;                                                   \
+                                                                               \
+            if (slot->hash == k->hash &&                                       \
+                key_eq(&((entry_t *)slot->entry)->var, k))                     \
+                return slot->entry;                                            \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static size_t prefix##_enumerate(void)                                     \
+    {                                                                          \
+        entry_t *e;                                                            \
+        size_t cnt = 0;                                                        \
+                                                                               \
+        for (e = prefix##_entries; e; e = e->next) {                           \
+            if (e->var.attrs & 0x4)                                            \
+                cnt++;                                                         \
+        }                                                                      \
+                                                                               \
+        return cnt;                                                            \
+    }                                                                          \
+                                                                               \
+    static void prefix##_free(void)                                            \
+    {                                                                          \
+        free(prefix##_entries);                                                \
+        free(prefix##_index);                                                  \
+    }
+
+#define LEGACY_KEY_EQ(v, k)                                                    \
+    ((v)->namesz == (k)->namesz &&                                             \
+     memcmp((v)->name, (k)->name, (k)->namesz) == 0 &&                         \
+     memcmp(&(v)->guid, &(k)->guid, sizeof((k)->guid)) == 0)
+
+#define SPLIT_KEY_EQ(v, k)                                                     \
+    ((v)->namesz == (k)->namesz &&                                             \
+     memcmp(&(v)->guid, &(k)->guid, sizeof((k)->guid)) == 0 &&                 \
+     memcmp((v)->name, (k)->name, (k)->namesz) == 0)
+
+DEFINE_LAYOUT(legacy, struct legacy_entry, LEGACY_KEY_EQ)
+DEFINE_LAYOUT(split, struct split_entry, SPLIT_KEY_EQ)
+
+#define TIME_LOOKUPS(lookup, n)                                                \
+    ({                                                                         \
+        double __start = now_ns();                                             \
+        size_t __r, __i;                                                       \
+                                                                               \
+        for (__r = 0; __r < ROUNDS; __r++)                                     \
+            for (__i = 0; __i < (n); __i++)                                    \
+                sink += !!lookup(&keys[order[__i]]);                           \
+                                                                               \
+        (now_ns() - __start) / (ROUNDS * (n));                                 \
+    })
+
+#define TIME_ENUMERATION(enumerate, n)                                         \
+    ({                                                                         \
+        double __start = now_ns();                                             \
+        size_t __r;                                                            \
+                                                                               \
+        for (__r = 0; __r < ROUNDS; __r++)                                     \
+            sink += enumerate();                                               \
+                                                                               \
+        (now_ns() - __start) / (ROUNDS * (n));                                 \
+    })
+
+static variable_t *store_lookup(const struct key *k)
+{
+    return storage_find_variable_hashed(k->name, k->namesz, &k->guid, k->hash);
+}
+
+static size_t store_enumerate(void)
+{
+    UTF16 empty[1] = { 0 };
+    variable_t *var;
+    size_t cnt = 0;
+
+    for (var = storage_next_variable(empty, 0, NULL); var;
+         var = storage_next_variable(var->name, var->namesz, &var->guid))
+        cnt++;
+
+    return cnt;
+}
+
+static void store_build(size_t n)
+{
+    uint32_t val = 0;
+    size_t i;
+
+    storage_set_quota(UINT64_MAX);
+
+    for (i = 0; i < n; i++)
+        storage_set(keys[i].name, keys[i].namesz, &keys[i].guid, &val,
+                    sizeof(val), 0x7);
+}
+
+static void run(size_t n)
+{
+    make_keys(n);
+    legacy_build(n);
+    split_build(n);
+    store_build(n);
+
+    printf("%8zu  %-8s %8.1f %8.1f\n", n, "legacy",
+           TIME_LOOKUPS(legacy_lookup, n),
+           TIME_ENUMERATION(legacy_enumerate, n));
+    printf("%8zu  %-8s %8.1f %8.1f\n", n, "split",
+           TIME_LOOKUPS(split_lookup, n), TIME_ENUMERATION(split_enumerate, n));
+    printf("%8zu  %-8s %8.1f %8.1f\n", n, "store",
+           TIME_LOOKUPS(store_lookup, n), TIME_ENUMERATION(store_enumerate, n));
+
+    legacy_free();
+    split_free();
+    storage_destroy();
+    free(keys);
+    free(order);
+}
+
+int main(int argc, char **argv)
+{
+    size_t counts[] = { 128, 1024, 16384, 65536 };
+    size_t i;
+
+    printf("%8s  %-8s %8s %8s\n", "vars", "layout", "get ns", "next ns");
+
+    if (argc > 1) {
+        for (i = 1; i < (size_t)argc; i++)
+            run(strtoul(argv[i], NULL, 0));
+    } else {
+        for (i = 0; i < ARRAY_SIZE(counts); i++)
+            run(counts[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xmlrpc.h"
+
+/*
+ * XAPI responses, as read for a session, for VM.get_NVRAM and for a call's
+ * outcome only.  The input is not NUL terminated, so reads past it are caught.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static const char *const keys[] = { NULL, "EFI-variables" };
+    char out[64];
+    size_t i;
+    int ret;
+
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        memset(out, 'x', sizeof(out));
+        ret = xmlrpc_parse_response((const char *)data, size, keys[i], out,
+                                    sizeof(out));
+
+        assert(ret == XMLRPC_SUCCESS || ret == XMLRPC_FAILURE || ret == -1);
+        assert(memchr(out, '\0', sizeof(out)) != NULL);
+    }
+
+    xmlrpc_parse_response((const char *)data, size, NULL, NULL, 0);
+
+    return 0;
+}
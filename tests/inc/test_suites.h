@@ -6,10 +6,15 @@
 extern MunitTest pk_tests[];
 extern MunitTest kek_tests[];
 extern MunitTest db_tests[];
+extern MunitTest base64_tests[];
 extern MunitTest auth_tests[];
 extern MunitTest auth_func_tests[];
 extern MunitTest append_tests[];
+extern MunitTest persist_tests[];
+extern MunitTest pool_tests[];
+extern MunitTest storage_tests[];
 extern MunitTest xapi_tests[];
 extern MunitTest xen_variable_server_tests[];
+extern MunitTest xmlrpc_tests[];
 
 #endif // __H_PK_TEST_
@@ -4,20 +4,41 @@
 #include <string.h>
 #include <uchar.h>
 
+#include "config.h"
 #include "serializer.h"
+#include "xen_variable_server.h"
 #include "XenVariable.h"
 
-#define exec_command(...) do { } while (0)
 #define AcquireSpinLock(...) do { } while (0)
 #define ReleaseSpinLock(...) do { } while (0)
 
 static void *comm_buf;
+static void (*exec_handler)(void *comm_buf);
+static unsigned long exits;
 
 void mock_xen_variable_server_set_buffer(void *p)
 {
     comm_buf = p;
 }
 
+void mock_xen_variable_server_set_handler(void (*handler)(void *comm_buf))
+{
+    exec_handler = handler;
+}
+
+unsigned long mock_xen_variable_server_exits(void)
+{
+    return exits;
+}
+
+static void exec_command(void *buf)
+{
+    exits++;
+
+    if (exec_handler)
+        exec_handler(buf);
+}
+
 static size_t StrLen(char16_t *str)
 {
     size_t ret = 0;
@@ -214,3 +235,455 @@ XenQueryVariableInfo(uint32_t Attributes, uint64_t *MaximumVariableStorageSize,
                                         MaximumVariableSize);
     return status;
 }
+
+/* Request header and trailing runtime flag of a batch */
+#define BATCH_OVERHEAD (3 * sizeof(uint32_t) + sizeof(bool))
+
+/*
+ * Serialize the header of a batch request.  Returns where its count goes,
+ * which is only known once the variables that fit are serialized.
+ */
+static uint8_t *serialize_batch_header(uint8_t **ptr, command_t command)
+{
+    uint8_t *count_ptr;
+
+    serialize_uint32(ptr, 1); /* version */
+    serialize_command(ptr, command);
+    count_ptr = *ptr;
+    *ptr += sizeof(uint32_t);
+
+    return count_ptr;
+}
+
+EFI_STATUS
+XenGetVariablesBatch(XEN_VARIABLE_BATCH_ENTRY *Entries, uint32_t Count)
+{
+    XEN_VARIABLE_BATCH_ENTRY *Entry;
+    uint8_t *ptr, *count_ptr;
+    const uint8_t *inptr;
+    EFI_STATUS status = EFI_SUCCESS;
+    uint32_t done = 0, n, served, i;
+    size_t size, entry_size;
+
+    if (!Entries)
+        return EFI_INVALID_PARAMETER;
+
+    AcquireSpinLock(&var_lock);
+
+    while (done < Count) {
+        ptr = comm_buf;
+        count_ptr = serialize_batch_header(&ptr, COMMAND_GET_VARIABLES_BATCH);
+        size = BATCH_OVERHEAD;
+
+        for (n = 0; done + n < Count && n < MAX_BATCH_ENTRIES; n++) {
+            Entry = &Entries[done + n];
+            entry_size = sizeof(uint64_t) + strsize16(Entry->VariableName) +
+                         sizeof(EFI_GUID) + sizeof(uint64_t);
+
+            if (size + entry_size > SHMEM_PAGES * PAGE_SIZE)
+                break;
+
+            serialize_name(&ptr, Entry->VariableName,
+                           strsize16(Entry->VariableName));
+            serialize_guid(&ptr, Entry->VendorGuid);
+            serialize_uintn(&ptr, Entry->DataSize);
+            size += entry_size;
+        }
+
+        serialize_uint32(&count_ptr, n);
+        serialize_boolean(&ptr, EfiAtRuntime());
+
+        exec_command(comm_buf);
+
+        inptr = comm_buf;
+        status = unserialize_result(&inptr);
+
+        if (status != EFI_SUCCESS)
+            break;
+
+        served = unserialize_uint32(&inptr);
+
+        if (served == 0 || served > n) {
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+
+        for (i = 0; i < served; i++) {
+            Entry = &Entries[done + i];
+            Entry->Status = unserialize_result(&inptr);
+
+            if (Entry->Status == EFI_SUCCESS) {
+                Entry->Attributes = unserialize_uint32(&inptr);
+                Entry->DataSize =
+                        unserialize_data(&inptr, Entry->Data, Entry->DataSize);
+            } else if (Entry->Status == EFI_BUFFER_TOO_SMALL) {
+                Entry->DataSize = unserialize_uintn(&inptr);
+            }
+        }
+
+        done += served;
+    }
+
+    ReleaseSpinLock(&var_lock);
+
+    return status;
+}
+
+EFI_STATUS
+XenSetVariablesBatch(XEN_VARIABLE_BATCH_ENTRY *Entries, uint32_t Count)
+{
+    XEN_VARIABLE_BATCH_ENTRY *Entry;
+    uint8_t *ptr, *count_ptr;
+    const uint8_t *inptr;
+    EFI_STATUS status = EFI_SUCCESS;
+    uint32_t done = 0, n, i;
+    size_t size, entry_size;
+
+    if (!Entries)
+        return EFI_INVALID_PARAMETER;
+
+    AcquireSpinLock(&var_lock);
+
+    while (done < Count) {
+        ptr = comm_buf;
+        count_ptr = serialize_batch_header(&ptr, COMMAND_SET_VARIABLES_BATCH);
+        size = BATCH_OVERHEAD;
+
+        for (n = 0; done + n < Count && n < MAX_BATCH_ENTRIES; n++) {
+            Entry = &Entries[done + n];
+            entry_size = sizeof(uint64_t) + strsize16(Entry->VariableName) +
+                         sizeof(EFI_GUID) + sizeof(uint64_t) +
+                         Entry->DataSize + sizeof(uint32_t);
+
+            if (size + entry_size > SHMEM_PAGES * PAGE_SIZE)
+                break;
+
+            serialize_name(&ptr, Entry->VariableName,
+                           strsize16(Entry->VariableName));
+            serialize_guid(&ptr, Entry->VendorGuid);
+            serialize_data(&ptr, Entry->Data, Entry->DataSize);
+            serialize_uint32(&ptr, Entry->Attributes);
+            size += entry_size;
+        }
+
+        /* A variable too large for the shared memory on its own */
+        if (n == 0) {
+            Entries[done++].Status = EFI_OUT_OF_RESOURCES;
+            continue;
+        }
+
+        serialize_uint32(&count_ptr, n);
+        serialize_boolean(&ptr, EfiAtRuntime());
+
+        exec_command(comm_buf);
+
+        inptr = comm_buf;
+        status = unserialize_result(&inptr);
+
+        if (status != EFI_SUCCESS)
+            break;
+
+        if (unserialize_uint32(&inptr) != n) {
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+            Entries[done + i].Status = unserialize_result(&inptr);
+
+        done += n;
+    }
+
+    ReleaseSpinLock(&var_lock);
+
+    return status;
+}
+
+EFI_STATUS
+XenGetAllNames(XEN_VARIABLE_NAME_FN Fn, void *Context)
+{
+    char16_t name[MAX_VARIABLE_NAME_CHARS + 1] = { 0 };
+    EFI_GUID guid = { 0 };
+    const uint8_t *inptr;
+    EFI_STATUS status;
+    uint32_t count, i;
+    uint8_t *ptr;
+    ssize_t namesz;
+    bool more;
+
+    if (!Fn)
+        return EFI_INVALID_PARAMETER;
+
+    AcquireSpinLock(&var_lock);
+
+    do {
+        ptr = comm_buf;
+        serialize_uint32(&ptr, 1); /* version */
+        serialize_command(&ptr, COMMAND_GET_ALL_NAMES);
+        serialize_name(&ptr, name, strsize16(name));
+        serialize_guid(&ptr, &guid);
+        serialize_boolean(&ptr, EfiAtRuntime());
+
+        exec_command(comm_buf);
+
+        inptr = comm_buf;
+        status = unserialize_result(&inptr);
+
+        if (status != EFI_SUCCESS)
+            break;
+
+        count = unserialize_uint32(&inptr);
+        more = unserialize_boolean(&inptr);
+
+        for (i = 0; i < count; i++) {
+            namesz = unserialize_data(&inptr, name, MAX_VARIABLE_NAME_SIZE);
+
+            if (namesz < 0) {
+                status = EFI_DEVICE_ERROR;
+                goto out;
+            }
+
+            name[namesz / sizeof(char16_t)] = 0;
+            unserialize_guid(&inptr, &guid);
+            Fn(name, &guid, Context);
+        }
+    } while (more && count > 0);
+
+out:
+    ReleaseSpinLock(&var_lock);
+
+    return status;
+}
+
+static struct ring_header *ring;
+
+EFI_STATUS
+XenVariableRingInit(void *Buffer, uint32_t SlotCount, uint32_t SlotSize)
+{
+    if (!Buffer)
+        return EFI_INVALID_PARAMETER;
+
+    ring = Buffer;
+    memset(ring, 0, RING_HEADER_SIZE);
+    ring->version = UEFISTORED_RING_VERSION;
+    ring->slot_count = SlotCount;
+    ring->slot_size = SlotSize;
+    ring->req_event = 1;
+
+    /* Kick the empty ring, it is rejected if not supported */
+    exec_command(ring);
+
+    if (ring->version != UEFISTORED_RING_VERSION) {
+        ring = NULL;
+        return EFI_UNSUPPORTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static uint8_t *ring_slot(uint32_t idx)
+{
+    return (uint8_t *)ring + RING_HEADER_SIZE +
+           (size_t)(idx & (ring->slot_count - 1)) * ring->slot_size;
+}
+
+EFI_STATUS
+XenGetVariablesRing(XEN_VARIABLE_BATCH_ENTRY *Entries, uint32_t Count)
+{
+    XEN_VARIABLE_BATCH_ENTRY *Entry;
+    uint32_t done = 0, old, req, i;
+    const uint8_t *inptr;
+    uint8_t *ptr;
+
+    if (!ring || !Entries)
+        return EFI_INVALID_PARAMETER;
+
+    while (done < Count) {
+        old = req = ring->req_prod;
+
+        for (; done + (req - old) < Count &&
+               req - ring->rsp_prod < ring->slot_count;
+             req++) {
+            Entry = &Entries[done + (req - old)];
+            ptr = ring_slot(req);
+            serialize_uint32(&ptr, 1); /* version */
+            serialize_command(&ptr, COMMAND_GET_VARIABLE);
+            serialize_name(&ptr, Entry->VariableName,
+                           strsize16(Entry->VariableName));
+            serialize_guid(&ptr, Entry->VendorGuid);
+            serialize_uintn(&ptr, Entry->DataSize);
+            serialize_boolean(&ptr, EfiAtRuntime());
+        }
+
+        __sync_synchronize();
+        ring->req_prod = req;
+        __sync_synchronize();
+
+        if (req - ring->req_event < req - old)
+            exec_command(ring);
+
+        /* Served synchronously by the handler */
+        if (ring->rsp_prod != req)
+            return EFI_DEVICE_ERROR;
+
+        for (i = old; i != req; i++) {
+            Entry = &Entries[done + (i - old)];
+            inptr = ring_slot(i);
+            Entry->Status = unserialize_result(&inptr);
+
+            if (Entry->Status == EFI_SUCCESS) {
+                Entry->Attributes = unserialize_uint32(&inptr);
+                Entry->DataSize =
+                        unserialize_data(&inptr, Entry->Data, Entry->DataSize);
+            } else if (Entry->Status == EFI_BUFFER_TOO_SMALL) {
+                Entry->DataSize = unserialize_uintn(&inptr);
+            }
+        }
+
+        done += req - old;
+    }
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS
+XenSetVariableChunk(char16_t *VariableName, EFI_GUID *VendorGuid,
+                    uint32_t Attributes, uint64_t Total, uint64_t Offset,
+                    uint64_t ChunkSize, void *Chunk)
+{
+    const uint8_t *inptr;
+    uint8_t *ptr;
+
+    ptr = comm_buf;
+    serialize_uint32(&ptr, 1); /* version */
+    serialize_command(&ptr, COMMAND_SET_VARIABLE_CHUNK);
+    serialize_name(&ptr, VariableName, strsize16(VariableName));
+    serialize_guid(&ptr, VendorGuid);
+    serialize_uint64(&ptr, Total);
+    serialize_uint64(&ptr, Offset);
+    serialize_data(&ptr, Chunk, ChunkSize);
+    serialize_uint32(&ptr, Attributes);
+    serialize_boolean(&ptr, EfiAtRuntime());
+
+    exec_command(comm_buf);
+
+    inptr = comm_buf;
+    return unserialize_result(&inptr);
+}
+
+EFI_STATUS
+XenSetVariableChunked(char16_t *VariableName, EFI_GUID *VendorGuid,
+                      uint32_t Attributes, uint64_t DataSize, void *Data)
+{
+    EFI_STATUS status = EFI_INVALID_PARAMETER;
+    uint64_t offset, chunk;
+
+    AcquireSpinLock(&var_lock);
+
+    for (offset = 0; offset < DataSize; offset += chunk) {
+        chunk = DataSize - offset;
+
+        if (chunk > MAX_VARIABLE_DATA_SIZE)
+            chunk = MAX_VARIABLE_DATA_SIZE;
+
+        status = XenSetVariableChunk(VariableName, VendorGuid, Attributes,
+                                     DataSize, offset, chunk,
+                                     (uint8_t *)Data + offset);
+
+        if (status != EFI_SUCCESS)
+            break;
+    }
+
+    ReleaseSpinLock(&var_lock);
+
+    return status;
+}
+
+/* Times a chunked GetVariable starts over if the variable keeps changing */
+#define CHUNK_RETRIES 3
+
+EFI_STATUS
+XenGetVariableChunked(char16_t *VariableName, EFI_GUID *VendorGuid,
+                      uint32_t *Attributes, uint64_t *DataSize, void *Data)
+{
+    uint64_t offset, total, gen, first_gen = 0;
+    const uint8_t *inptr;
+    EFI_STATUS status;
+    unsigned int tries;
+    uint32_t attrs;
+    ssize_t len;
+    uint8_t *ptr;
+
+    if (!VariableName || !VendorGuid || !DataSize)
+        return EFI_INVALID_PARAMETER;
+
+    AcquireSpinLock(&var_lock);
+
+    for (tries = 0; tries < CHUNK_RETRIES; tries++) {
+        offset = 0;
+        total = 0;
+
+        do {
+            ptr = comm_buf;
+            serialize_uint32(&ptr, 1); /* version */
+            serialize_command(&ptr, COMMAND_GET_VARIABLE_CHUNK);
+            serialize_name(&ptr, VariableName, strsize16(VariableName));
+            serialize_guid(&ptr, VendorGuid);
+            serialize_uint64(&ptr, offset);
+            serialize_uintn(&ptr, *DataSize - offset);
+            serialize_boolean(&ptr, EfiAtRuntime());
+
+            exec_command(comm_buf);
+
+            inptr = comm_buf;
+            status = unserialize_result(&inptr);
+
+            if (status == EFI_BUFFER_TOO_SMALL)
+                *DataSize = unserialize_uintn(&inptr);
+
+            if (status != EFI_SUCCESS)
+                goto out;
+
+            attrs = unserialize_uint32(&inptr);
+            total = unserialize_uint64(&inptr);
+            gen = unserialize_uint64(&inptr);
+
+            if (offset == 0) {
+                first_gen = gen;
+            } else if (gen != first_gen) {
+                break;
+            }
+
+            if (total > *DataSize) {
+                *DataSize = total;
+                status = EFI_BUFFER_TOO_SMALL;
+                goto out;
+            }
+
+            len = unserialize_data(&inptr, (uint8_t *)Data + offset,
+                                   *DataSize - offset);
+
+            if (len <= 0 && offset < total) {
+                status = EFI_DEVICE_ERROR;
+                goto out;
+            }
+
+            offset += len;
+        } while (offset < total);
+
+        if (offset >= total) {
+            if (Attributes)
+                *Attributes = attrs;
+
+            *DataSize = total;
+            goto out;
+        }
+    }
+
+    status = EFI_ABORTED;
+
+out:
+    ReleaseSpinLock(&var_lock);
+
+    return status;
+}
@@ -35,6 +35,68 @@ EFI_STATUS
 XenGetNextVariableName(uint64_t *VariableNameSize, char16_t *VariableName,
                        EFI_GUID *VendorGuid);
 
+/* One variable of XenGetVariablesBatch() or XenSetVariablesBatch() */
+typedef struct {
+    char16_t *VariableName;
+    EFI_GUID *VendorGuid;
+    uint32_t Attributes;
+    uint64_t DataSize;
+    void *Data;
+    EFI_STATUS Status;
+} XEN_VARIABLE_BATCH_ENTRY;
+
+typedef void (*XEN_VARIABLE_NAME_FN)(char16_t *VariableName,
+                                     EFI_GUID *VendorGuid, void *Context);
+
+EFI_STATUS
+XenGetVariablesBatch(XEN_VARIABLE_BATCH_ENTRY *Entries, uint32_t Count);
+
+EFI_STATUS
+XenSetVariablesBatch(XEN_VARIABLE_BATCH_ENTRY *Entries, uint32_t Count);
+
+EFI_STATUS
+XenGetAllNames(XEN_VARIABLE_NAME_FN Fn, void *Context);
+
+/* Send one chunk of a variable's data, of Total bytes in all */
+EFI_STATUS
+XenSetVariableChunk(char16_t *VariableName, EFI_GUID *VendorGuid,
+                    uint32_t Attributes, uint64_t Total, uint64_t Offset,
+                    uint64_t ChunkSize, void *Chunk);
+
+/* Set and get variables of up to MAX_CHUNKED_DATA_SIZE bytes in chunks */
+EFI_STATUS
+XenSetVariableChunked(char16_t *VariableName, EFI_GUID *VendorGuid,
+                      uint32_t Attributes, uint64_t DataSize, void *Data);
+
+EFI_STATUS
+XenGetVariableChunked(char16_t *VariableName, EFI_GUID *VendorGuid,
+                      uint32_t *Attributes, uint64_t *DataSize, void *Data);
+
+/*
+ * Switch GetVariable requests to a ring of SlotCount slots in Buffer, of
+ * SHMEM_PAGES pages, see struct ring_header.
+ */
+EFI_STATUS
+XenVariableRingInit(void *Buffer, uint32_t SlotCount, uint32_t SlotSize);
+
+/*
+ * Queue a GetVariable request per entry in the ring, as many vCPUs would, and
+ * wait for the responses.
+ */
+EFI_STATUS
+XenGetVariablesRing(XEN_VARIABLE_BATCH_ENTRY *Entries, uint32_t Count);
+
 void mock_xen_variable_server_set_buffer(void *p);
 
+/*
+ * Serve the requests issued by the functions above with handler (usually
+ * xen_variable_server_handle_request()), as the port IO write does in the
+ * guest.  Without a handler, requests are only serialized and the caller
+ * handles them.
+ */
+void mock_xen_variable_server_set_handler(void (*handler)(void *comm_buf));
+
+/* The number of requests issued, i.e. the VM exits a guest would take */
+unsigned long mock_xen_variable_server_exits(void);
+
 #endif // __H_XENVARIABLE_
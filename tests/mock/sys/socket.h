@@ -4,10 +4,14 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define AF_LOCAL 1
 #define AF_UNIX AF_LOCAL
 #define SOCK_STREAM 1
+#define SOCK_CLOEXEC 02000000
+#define MSG_NOSIGNAL 0x4000
 
 #define MEMFD_SIZE 4096
 
@@ -16,8 +20,33 @@ struct sockaddr {
     char sun_path[108];
 };
 
+struct msghdr {
+    void *msg_name;
+    uint32_t msg_namelen;
+    struct iovec *msg_iov;
+    size_t msg_iovlen;
+    void *msg_control;
+    size_t msg_controllen;
+    int msg_flags;
+};
+
+/*
+ * What socket(), send() and recv() on a mock socket do, so that tests can
+ * play the peer.  sendmsg() sends each buffer in turn.  Without ops, send()
+ * swallows everything and recv() finds the connection closed.
+ */
+struct mock_socket_ops {
+    void (*open)(int fd);
+    ssize_t (*send)(int fd, const void *buf, size_t len);
+    ssize_t (*recv)(int fd, void *buf, size_t len);
+};
+
 int socket(int type, int socktype, int protocol);
 int get_sockfd(void);
+void mock_socket_set_ops(const struct mock_socket_ops *ops);
+ssize_t send(int fd, const void *buf, size_t len, int flags);
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t recv(int fd, void *buf, size_t len, int flags);
 
 static inline int connect(int fd, const struct sockaddr *addr, uint64_t addrlen)
 {
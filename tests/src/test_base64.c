@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "munit/munit.h"
+
+#include "base64.h"
+#include "common.h"
+
+#define MAX_BYTES 4096
+
+static uint8_t bytes[MAX_BYTES];
+static uint8_t decoded[MAX_BYTES];
+static char encoded[BASE64_ENCODED_SIZE(MAX_BYTES) + 1];
+static char scalar[BASE64_ENCODED_SIZE(MAX_BYTES) + 1];
+
+static void tear_down(void *fixture)
+{
+    base64_set_simd(true);
+}
+
+static MunitResult test_vectors(const MunitParameter params[], void *data)
+{
+    /* RFC 4648, section 10 */
+    const struct {
+        const char *plain;
+        const char *encoded;
+    } vectors[] = {
+        { "", "" },
+        { "f", "Zg==" },
+        { "fo", "Zm8=" },
+        { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" },
+        { "fooba", "Zm9vYmE=" },
+        { "foobar", "Zm9vYmFy" },
+    };
+    size_t i, len;
+
+    for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+        len = strlen(vectors[i].plain);
+
+        munit_assert_size(base64_encode(encoded,
+                                        (const uint8_t *)vectors[i].plain,
+                                        len),
+                          ==, strlen(vectors[i].encoded));
+        munit_assert_string_equal(encoded, vectors[i].encoded);
+
+        munit_assert_int(base64_decode(decoded, encoded, strlen(encoded)), ==,
+                         len);
+        munit_assert_memory_equal(len, decoded, vectors[i].plain);
+    }
+
+    /* Padding is optional */
+    munit_assert_int(base64_decode(decoded, "Zm9vYg", 6), ==, 4);
+    munit_assert_memory_equal(4, decoded, "foob");
+
+    return MUNIT_OK;
+}
+
+/*
+ * Every length up to a few blocks, and some larger ones, encodes the same
+ * with and without AVX2 and decodes back, in place too.
+ */
+static MunitResult test_round_trip(const MunitParameter params[], void *data)
+{
+    size_t i, n, len;
+
+    for (i = 0; i < MAX_BYTES; i++)
+        bytes[i] = rand();
+
+    for (n = 0; n <= MAX_BYTES; n = n < 300 ? n + 1 : n * 2 - 1) {
+        base64_set_simd(false);
+        len = base64_encode(scalar, bytes, n);
+        munit_assert_size(len, ==, BASE64_ENCODED_SIZE(n));
+
+        base64_set_simd(true);
+        munit_assert_size(base64_encode(encoded, bytes, n), ==, len);
+        munit_assert_string_equal(encoded, scalar);
+
+        memset(decoded, 0, sizeof(decoded));
+        munit_assert_int(base64_decode(decoded, encoded, len), ==, n);
+        munit_assert_memory_equal(n, decoded, bytes);
+
+        base64_set_simd(false);
+        munit_assert_int(base64_decode(decoded, encoded, len), ==, n);
+        munit_assert_memory_equal(n, decoded, bytes);
+
+        base64_set_simd(true);
+        munit_assert_int(base64_decode((uint8_t *)encoded, encoded, len), ==,
+                         n);
+        munit_assert_memory_equal(n, encoded, bytes);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_invalid(const MunitParameter params[], void *data)
+{
+    const char bad[] = { '-', '_', '=', ' ', '\n', '.', '@', '[', '`', '{',
+                         '\0', (char)0x80, (char)0xff };
+    size_t i, pos, len;
+
+    for (i = 0; i < 96; i++)
+        bytes[i] = i * 7;
+
+    len = base64_encode(encoded, bytes, 96);
+
+    /* Inside the first AVX2 block, the second, and the scalar tail */
+    for (i = 0; i < ARRAY_SIZE(bad); i++) {
+        for (pos = 0; pos < len; pos += 13) {
+            strcpy(scalar, encoded);
+            scalar[pos] = bad[i];
+
+            base64_set_simd(true);
+            munit_assert_int(base64_decode(decoded, scalar, len), ==, -1);
+
+            base64_set_simd(false);
+            munit_assert_int(base64_decode(decoded, scalar, len), ==, -1);
+        }
+    }
+
+    /* A single character is not a byte, and padding goes at the end */
+    munit_assert_int(base64_decode(decoded, "Zm9vY", 5), ==, -1);
+    munit_assert_int(base64_decode(decoded, "Zg==Zm8=", 8), ==, -1);
+    munit_assert_int(base64_decode(decoded, "Z===", 4), ==, -1);
+
+    return MUNIT_OK;
+}
+
+#define DEFINE_TEST(test_func)                                          \
+    { (char*) #test_func, test_func,                                    \
+        NULL, tear_down, MUNIT_SUITE_OPTION_NONE, NULL }
+
+MunitTest base64_tests[] = {
+    DEFINE_TEST(test_vectors),
+    DEFINE_TEST(test_round_trip),
+    DEFINE_TEST(test_invalid),
+    { 0 }
+};
@@ -0,0 +1,324 @@
+#include <string.h>
+#include <time.h>
+
+#include "munit/munit.h"
+
+#include "backend.h"
+#include "persist.h"
+#include "storage.h"
+#include "common.h"
+#include "test_common.h"
+
+static UTF16 BOOT[] = { 'B', 'o', 'o', 't', '0', '0', '0', '0', 0 };
+static uint8_t BOOT_DATA[] = { 0x1, 0x0, 0x0, 0x0 };
+static EFI_GUID default_guid = DEFAULT_GUID;
+
+/* Enough changes for an OS install's burst of Boot#### writes */
+#define BURST 64
+
+static volatile unsigned int sets;
+
+/* If set, each update takes 300ms, and in_set is set while it is going on */
+static bool slow;
+static volatile unsigned int in_set;
+
+/* How many updates fail before they succeed again */
+static volatile unsigned int failing;
+
+static int count_set(void *snapshot)
+{
+    struct timespec ts = { 0, 300000000 };
+
+    if (__atomic_load_n(&failing, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&failing, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+
+    if (slow) {
+        __atomic_store_n(&in_set, 1, __ATOMIC_SEQ_CST);
+        nanosleep(&ts, NULL);
+        __atomic_store_n(&in_set, 0, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_add_fetch(&sets, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static struct backend counting_backend = {
+    .set = count_set,
+};
+
+static unsigned int get_sets(void)
+{
+    return __atomic_load_n(&sets, __ATOMIC_SEQ_CST);
+}
+
+/* Wait up to a second for the writer thread to persist */
+static void wait_for_sets(unsigned int n)
+{
+    struct timespec ts = { 0, 10000000 };
+    int i;
+
+    for (i = 0; i < 100 && get_sets() < n; i++)
+        nanosleep(&ts, NULL);
+}
+
+/* A writer stopped by an earlier test may take a moment to exit */
+static int start(unsigned int delay_ms, unsigned int max_delay_ms)
+{
+    struct timespec ts = { 0, 10000000 };
+    int i;
+
+    for (i = 0; i < 100 && persist_start(delay_ms, max_delay_ms, true) < 0;
+         i++)
+        nanosleep(&ts, NULL);
+
+    return i < 100 ? 0 : -1;
+}
+
+static void change(unsigned int i, bool secure_boot)
+{
+    BOOT_DATA[0] = i;
+
+    storage_write_lock();
+    munit_assert(storage_set(BOOT, sizeof_wchar(BOOT), &default_guid,
+                             BOOT_DATA, sizeof(BOOT_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    persist_changed(secure_boot);
+    storage_unlock();
+}
+
+static MunitResult test_coalesce(const MunitParameter params[], void *data)
+{
+    struct timespec ts = { 0, 100000000 };
+    unsigned int i;
+
+    /* Without the writer thread, every change is persisted right away */
+    change(0, false);
+    munit_assert_uint(get_sets(), ==, 1);
+
+    munit_assert_int(persist_start(50, 1000, true), ==, 0);
+    munit_assert_int(persist_start(50, 1000, true), ==, -1);
+
+    /* A burst is persisted once, after the request completed */
+    for (i = 0; i < BURST; i++)
+        change(i, false);
+
+    munit_assert_uint(get_sets(), ==, 1);
+    wait_for_sets(2);
+    nanosleep(&ts, NULL);
+    munit_assert_uint(get_sets(), ==, 2);
+
+    /* Secure boot variables are persisted before the request completes */
+    change(0, true);
+    munit_assert_uint(get_sets(), ==, 3);
+
+    persist_stop();
+
+    change(1, false);
+    munit_assert_uint(get_sets(), ==, 4);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_max_delay(const MunitParameter params[], void *data)
+{
+    struct timespec ts = { 0, 10000000 };
+    struct persist_stats before, after;
+    unsigned int i;
+
+    persist_get_stats(&before);
+
+    /* A flush only updates the backend if something changed */
+    persist_flush();
+    munit_assert_uint(get_sets(), ==, 1);
+    persist_flush();
+    munit_assert_uint(get_sets(), ==, 1);
+
+    munit_assert_int(start(100, 150), ==, 0);
+
+    /* The window never goes quiet, but the changes are persisted anyway */
+    for (i = 0; i < 50 && get_sets() < 2; i++) {
+        change(i, false);
+        nanosleep(&ts, NULL);
+    }
+
+    munit_assert_uint(get_sets(), ==, 2);
+
+    persist_stop();
+    change(i, false);
+    persist_flush();
+    munit_assert_uint(get_sets(), ==, 3);
+
+    /* Two flushes on the caller's thread and one coalesced */
+    persist_get_stats(&after);
+    munit_assert_ulong(after.changes - before.changes, ==, i + 1);
+    munit_assert_ulong(after.flushes - before.flushes, ==, 3);
+    munit_assert_ulong(after.immediate - before.immediate, ==, 2);
+    munit_assert_ulong(after.max_latency_ns, >=, 100000000);
+
+    return MUNIT_OK;
+}
+
+/* The store is not locked while the backend is updated */
+static MunitResult test_set_unlocked(const MunitParameter params[],
+                                     void *data)
+{
+    struct timespec ts = { 0, 1000000 };
+    int i;
+
+    /* Persisted up to the fresh store's generation */
+    persist_flush();
+    munit_assert_uint(get_sets(), ==, 1);
+
+    munit_assert_int(start(10, 10), ==, 0);
+    slow = true;
+
+    change(0, false);
+
+    for (i = 0; i < 1000 && !__atomic_load_n(&in_set, __ATOMIC_SEQ_CST); i++)
+        nanosleep(&ts, NULL);
+
+    /* The guest's write completes before the update does */
+    munit_assert_uint(in_set, ==, 1);
+    change(1, false);
+    munit_assert_uint(in_set, ==, 1);
+    munit_assert_uint(get_sets(), ==, 1);
+
+    /* And is persisted by the next one */
+    wait_for_sets(3);
+    munit_assert_uint(get_sets(), ==, 3);
+
+    persist_stop();
+    slow = false;
+
+    return MUNIT_OK;
+}
+
+/* A state the backend failed to take is persisted later */
+static MunitResult test_retry(const MunitParameter params[], void *data)
+{
+    struct timespec ts = { 0, 100000000 };
+    struct persist_stats before, after;
+
+    persist_flush();
+    munit_assert_uint(get_sets(), ==, 1);
+    persist_get_stats(&before);
+
+    /* By the next flush */
+    failing = 1;
+    change(0, false);
+    munit_assert_uint(get_sets(), ==, 1);
+    munit_assert_int(persist_flush(), ==, 0);
+    munit_assert_uint(get_sets(), ==, 2);
+
+    /* By the writer, after a backoff */
+    munit_assert_int(start(10, 10), ==, 0);
+    failing = 2;
+    change(1, false);
+    wait_for_sets(3);
+    munit_assert_uint(get_sets(), ==, 3);
+    nanosleep(&ts, NULL);
+    munit_assert_uint(get_sets(), ==, 3);
+
+    persist_get_stats(&after);
+    munit_assert_ulong(after.failures - before.failures, ==, 3);
+    munit_assert_ulong(after.flushes - before.flushes, ==, 2);
+
+    /* At shutdown, after a few attempts */
+    persist_stop();
+    failing = 2;
+    change(2, false);
+    munit_assert_int(persist_flush(), ==, 0);
+    munit_assert_uint(get_sets(), ==, 4);
+
+    /* And it is still dirty if they all failed */
+    failing = 100;
+    change(3, false);
+    munit_assert_int(persist_flush(), ==, -1);
+    failing = 0;
+    munit_assert_int(persist_flush(), ==, 0);
+    munit_assert_uint(get_sets(), ==, 5);
+
+    return MUNIT_OK;
+}
+
+static void count_change(const variable_t *var, bool deleted, void *opaque)
+{
+    (*(unsigned int *)opaque)++;
+}
+
+/* Deletions are forgotten once persisted, on the next change */
+static MunitResult test_prune(const MunitParameter params[], void *data)
+{
+    unsigned int changes = 0;
+    uint64_t gen;
+
+    change(0, false);
+    gen = storage_generation();
+    munit_assert_int(start(10, 10), ==, 0);
+
+    storage_write_lock();
+    munit_assert(storage_remove(BOOT, sizeof_wchar(BOOT), &default_guid) ==
+                 EFI_SUCCESS);
+    persist_changed(false);
+    storage_unlock();
+
+    wait_for_sets(2);
+    munit_assert_uint(get_sets(), ==, 2);
+
+    /* The writer leaves the store alone */
+    munit_assert_int(storage_changes_since(gen, count_change, &changes), ==,
+                     0);
+    munit_assert_uint(changes, ==, 1);
+
+    change(1, false);
+    munit_assert_int(storage_changes_since(gen, count_change, &changes), ==,
+                     -1);
+
+    persist_stop();
+
+    /* And right away when persisted on the caller's thread */
+    gen = storage_generation();
+
+    storage_write_lock();
+    munit_assert(storage_remove(BOOT, sizeof_wchar(BOOT), &default_guid) ==
+                 EFI_SUCCESS);
+    persist_changed(false);
+    storage_unlock();
+
+    munit_assert_uint(get_sets(), ==, 3);
+    munit_assert_int(storage_changes_since(gen, count_change, &changes), ==,
+                     -1);
+
+    return MUNIT_OK;
+}
+
+static void *setup(const MunitParameter params[], void *data)
+{
+    storage_destroy();
+    sets = 0;
+    slow = false;
+    failing = 0;
+    backend = &counting_backend;
+    return NULL;
+}
+
+static void tear_down(void *fixture)
+{
+    backend = NULL;
+    storage_destroy();
+}
+
+#define DEFINE_TEST(test_func)                                          \
+    { (char*) #test_func, test_func,                                    \
+        setup, tear_down, MUNIT_SUITE_OPTION_NONE, NULL }
+
+MunitTest persist_tests[] = {
+    DEFINE_TEST(test_coalesce),
+    DEFINE_TEST(test_max_delay),
+    DEFINE_TEST(test_set_unlocked),
+    DEFINE_TEST(test_retry),
+    DEFINE_TEST(test_prune),
+    { 0 }
+};
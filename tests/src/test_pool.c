@@ -0,0 +1,212 @@
+#include <string.h>
+
+#include "munit/munit.h"
+
+#include "pool.h"
+#include "storage.h"
+#include "variable.h"
+#include "common.h"
+#include "test_common.h"
+
+static UTF16 NAME[] = { 'P', 'O', 'O', 'L', 0 };
+static EFI_GUID default_guid = DEFAULT_GUID;
+
+static bool is_zero(const uint8_t *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (p[i])
+            return false;
+    }
+
+    return true;
+}
+
+static MunitResult test_size_classes(const MunitParameter params[], void *data)
+{
+    size_t sizes[] = { 1, POOL_MIN_BLOCK, POOL_MIN_BLOCK + 1, 1000, KB(4),
+                       MAX_VARIABLE_DATA_SIZE, MAX_CHUNKED_DATA_SIZE };
+    size_t i, cap;
+    void *block;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        block = pool_alloc(sizes[i], &cap);
+
+        munit_assert_ptr_not_null(block);
+        munit_assert_size(cap, >=, sizes[i]);
+        munit_assert_size(cap, <, sizes[i] * 2 + POOL_MIN_BLOCK);
+        munit_assert_size(cap & (cap - 1), ==, 0);
+        munit_assert_size(cap, ==, pool_capacity(sizes[i]));
+
+        pool_free(block, cap);
+    }
+
+    munit_assert_ptr_null(pool_alloc(0, &cap));
+    munit_assert_ptr_null(pool_alloc(MAX_CHUNKED_DATA_SIZE + 1, &cap));
+
+    return MUNIT_OK;
+}
+
+/**
+ * A freed block is wiped and handed out again for the same size class.
+ */
+static MunitResult test_free_wipes_and_reuses(const MunitParameter params[],
+                                              void *data)
+{
+    uint8_t *a, *b;
+    size_t cap;
+
+    a = pool_alloc(100, &cap);
+    munit_assert_ptr_not_null(a);
+    memset(a, 0xaa, cap);
+    pool_free(a, cap);
+
+    b = pool_alloc(cap, &cap);
+    munit_assert_ptr_equal(a, b);
+    munit_assert(is_zero(b, cap));
+    pool_free(b, cap);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Rewrites that fit reuse the block, appends grow it geometrically.
+ */
+static MunitResult test_set_data_reuses_block(const MunitParameter params[],
+                                              void *data)
+{
+    variable_t var = { 0 };
+    uint8_t buf[64];
+    uint8_t *block;
+    size_t i;
+
+    memset(buf, 0x5a, sizeof(buf));
+
+    munit_assert_int(variable_create_noalloc(&var, NAME, sizeof_wchar(NAME),
+                                             buf, 48, &default_guid,
+                                             DEFAULT_ATTR, NULL, NULL), ==, 0);
+    block = var.data;
+    munit_assert_size(var.payload->cap, ==, 64);
+
+    /* Same block, and no stale bytes past the new end */
+    munit_assert_int(variable_set_data(&var, buf, 40, false), ==, 0);
+    munit_assert_ptr_equal(var.data, block);
+    munit_assert(is_zero(&var.data[40], var.payload->cap - 40));
+
+    munit_assert_int(variable_set_data(&var, buf, 16, true), ==, 0);
+    munit_assert_ptr_equal(var.data, block);
+    munit_assert_size(var.datasz, ==, 56);
+
+    for (i = 0; i < 8; i++)
+        munit_assert_int(variable_set_data(&var, buf, sizeof(buf), true), ==, 0);
+
+    munit_assert_size(var.datasz, ==, 56 + 8 * sizeof(buf));
+    munit_assert_size(var.payload->cap, ==, 1024);
+
+    for (i = 0; i < var.datasz; i++)
+        munit_assert_uint8(var.data[i], ==, 0x5a);
+
+    /* Shrinking a lot moves the data to a smaller block */
+    munit_assert_int(variable_set_data(&var, buf, 8, false), ==, 0);
+    munit_assert_size(var.payload->cap, ==, POOL_MIN_BLOCK);
+
+    variable_destroy_noalloc(&var);
+
+    return MUNIT_OK;
+}
+
+/**
+ * A shared payload is never written to, the writer gets a copy instead.
+ */
+static MunitResult test_copy_on_write(const MunitParameter params[],
+                                      void *data)
+{
+    variable_t var = { 0 }, snap = { 0 };
+    uint8_t old[32], new[32];
+    uint8_t *block;
+
+    memset(old, 0x11, sizeof(old));
+    memset(new, 0x22, sizeof(new));
+
+    munit_assert_int(variable_create_noalloc(&var, NAME, sizeof_wchar(NAME),
+                                             old, sizeof(old), &default_guid,
+                                             DEFAULT_ATTR, NULL, NULL), ==, 0);
+    block = var.data;
+
+    munit_assert_int(variable_share(&snap, &var), ==, 0);
+    munit_assert_ptr_equal(snap.data, block);
+    munit_assert_uint32(var.payload->refs, ==, 2);
+
+    munit_assert_int(variable_set_data(&var, new, sizeof(new), false), ==, 0);
+    munit_assert(var.data != block);
+    munit_assert(memcmp(var.data, new, sizeof(new)) == 0);
+    munit_assert_ptr_equal(snap.data, block);
+    munit_assert(memcmp(snap.data, old, sizeof(old)) == 0);
+    munit_assert_uint32(snap.payload->refs, ==, 1);
+
+    /* The snapshot now owns its payload and can be written in place */
+    munit_assert_int(variable_set_data(&snap, new, sizeof(new), false), ==, 0);
+    munit_assert_ptr_equal(snap.data, block);
+
+    variable_destroy_noalloc(&snap);
+    variable_destroy_noalloc(&var);
+
+    return MUNIT_OK;
+}
+
+#define CHURN_VARS 64
+
+/* The size classes from POOL_MIN_BLOCK to POOL_MAX_SLAB_BLOCK */
+#define SLAB_CLASSES 9
+
+/*
+ * Memory goes back to the heap once the variables are deleted, however many
+ * size classes were filled in turn.  Only one empty slab per class is kept.
+ */
+static MunitResult test_release(const MunitParameter params[], void *data)
+{
+    static uint8_t value[MAX_CHUNKED_DATA_SIZE];
+    UTF16 name[] = { 'C', 'H', 'U', 'R', 'N', 0, 0 };
+    size_t before = pool_held(), peak = 0, size, i;
+
+    storage_set_quota(UINT64_MAX);
+    memset(value, 0x33, sizeof(value));
+
+    for (size = POOL_MIN_BLOCK; size <= MAX_CHUNKED_DATA_SIZE; size *= 2) {
+        for (i = 0; i < CHURN_VARS; i++) {
+            name[5] = 'A' + i;
+            munit_assert(storage_set(name, sizeof(name), &default_guid, value,
+                                     size, DEFAULT_ATTR) == EFI_SUCCESS);
+        }
+
+        peak = max(peak, pool_held());
+
+        for (i = 0; i < CHURN_VARS; i++) {
+            name[5] = 'A' + i;
+            munit_assert(storage_remove(name, sizeof(name), &default_guid) ==
+                         EFI_SUCCESS);
+        }
+
+        munit_assert_size(pool_held(), <=,
+                          before + SLAB_CLASSES * POOL_SLAB_SIZE);
+    }
+
+    munit_assert_size(peak, >=, CHURN_VARS * MAX_CHUNKED_DATA_SIZE);
+    storage_destroy();
+
+    return MUNIT_OK;
+}
+
+#define DEFINE_TEST(test_func)                                          \
+    { (char*) #test_func, test_func,                                    \
+        NULL, NULL, MUNIT_SUITE_OPTION_NONE, NULL }
+
+MunitTest pool_tests[] = {
+    DEFINE_TEST(test_size_classes),
+    DEFINE_TEST(test_free_wipes_and_reuses),
+    DEFINE_TEST(test_set_data_reuses_block),
+    DEFINE_TEST(test_copy_on_write),
+    DEFINE_TEST(test_release),
+    { 0 }
+};
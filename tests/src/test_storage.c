@@ -4,311 +4,833 @@
 
 #include "storage.h"
 #include "common.h"
-#include "data/bigbase64.h"
-#include "test_common.h"
-#include "test_xapi.h"
 #include "log.h"
-#include "xapi.h"
-#include "xen_variable_server.h"
-
 #include "test_common.h"
 #include "test_storage.h"
 
-extern bool efi_at_runtime;
+extern __thread bool efi_at_runtime;
 
 static UTF16 RTC[] = { 'R', 'T', 'C', 0 };
 static uint8_t RTC_DATA[] = { 0xa, 0xb, 0xc, 0xd };
 static UTF16 CHEER[] = { 'C', 'H', 'E', 'E', 'R', 0 };
 static uint8_t CHEER_DATA[] = { 0xa, 0xb, 0xc, 0xd, 0xf, 0xf };
 
-static variable_t var1 = { .attrs = DEFAULT_ATTR, .guid = DEFAULT_GUID };
+static EFI_GUID default_guid = DEFAULT_GUID;
 
-static variable_t var2 = { .attrs = DEFAULT_ATTR, .guid = DEFAULT_GUID };
+/* Enough variables to span many storage chunks */
+#define MANY_VARS 1000
 
-static void pre_test(void)
+/* Fill name with "VAR<i>" and return its size in bytes */
+static size_t make_name(UTF16 *name, size_t n, unsigned int i)
 {
-    storage_init();
+    char ascii[16];
+    size_t len, j;
+
+    len = snprintf(ascii, sizeof(ascii), "VAR%u", i);
+
+    for (j = 0; j < len && j < n - 1; j++)
+        name[j] = ascii[j];
+
+    name[j] = 0;
+
+    return j * sizeof(UTF16);
 }
 
-static void post_test(void)
+static MunitResult test_set_and_get(const MunitParameter params[], void *data)
 {
-    storage_destroy();
+    EFI_STATUS status;
+    uint8_t buf[64];
+    size_t bufsz = sizeof(buf);
+    uint32_t attrs;
+
+    status = storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                         RTC_DATA, sizeof(RTC_DATA), DEFAULT_ATTR);
+    munit_assert(status == EFI_SUCCESS);
+
+    status = storage_get(RTC, sizeof_wchar(RTC), &default_guid,
+                         &attrs, buf, &bufsz);
+    munit_assert(status == EFI_SUCCESS);
+    munit_assert_size(bufsz, ==, sizeof(RTC_DATA));
+    munit_assert(memcmp(buf, RTC_DATA, sizeof(RTC_DATA)) == 0);
+    munit_assert(attrs == DEFAULT_ATTR);
+
+    return MUNIT_OK;
 }
 
-static void test_set_and_get(void)
+static MunitResult test_guid_is_part_of_key(const MunitParameter params[],
+                                            void *data)
 {
-    EFI_STATUS ret;
-    variable_t tmp;
+    EFI_GUID other = DEFAULT_GUID;
+    variable_t *a, *b;
+
+    other.Data4[7] = 0x1;
+
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER),
+                             &default_guid, CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER),
+                             &other, RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+
+    a = storage_find_variable(CHEER, sizeof_wchar(CHEER),
+                              &default_guid);
+    b = storage_find_variable(CHEER, sizeof_wchar(CHEER),
+                              &other);
+
+    munit_assert_ptr_not_null(a);
+    munit_assert_ptr_not_null(b);
+    munit_assert(a != b);
+    munit_assert_size(a->datasz, ==, sizeof(CHEER_DATA));
+    munit_assert_size(b->datasz, ==, sizeof(RTC_DATA));
+    munit_assert_size(storage_count(), ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* A name is the same key with or without its null-terminator */
+static MunitResult test_name_terminator(const MunitParameter params[],
+                                        void *data)
+{
+    variable_t *a, *b;
+
+    munit_assert(variable_hash(CHEER, sizeof(CHEER), &default_guid) ==
+                 variable_hash(CHEER, sizeof_wchar(CHEER), &default_guid));
 
-    memset(&tmp, 0, sizeof(tmp));
+    munit_assert(storage_set(CHEER, sizeof(CHEER),
+                             &default_guid, CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
 
-    variable_create_noalloc(&tmp, var1.name, var1.data, var1.datasz, &var1.guid,
-                            var1.attrs, NULL);
+    a = storage_find_variable(CHEER, sizeof_wchar(CHEER), &default_guid);
+    munit_assert_ptr_not_null(a);
 
-    ret = storage_set(var1.name, &var1.guid, var1.data, var1.datasz,
-                      var1.attrs);
-    munit_assert(ret == 0);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER),
+                             &default_guid, RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
 
-    ret = storage_get(var1.name, &var1.guid, &var1.attrs, var1.data, &var1.datasz);
-    munit_assert(ret == 0);
+    b = storage_find_variable(CHEER, sizeof(CHEER), &default_guid);
+    munit_assert_ptr_equal(a, b);
+    munit_assert_size(b->datasz, ==, sizeof(RTC_DATA));
+    munit_assert_size(storage_count(), ==, 1);
 
-    munit_assert(var1.namesz == tmp.namesz);
-    munit_assert(var1.datasz == tmp.datasz);
-    munit_assert(memcmp(tmp.name, var1.name, var1.namesz) == 0);
-    munit_assert(memcmp(tmp.data, var1.data, var1.datasz) == 0);
-    munit_assert(var1.attrs == tmp.attrs);
+    munit_assert(storage_remove(CHEER, sizeof_wchar(CHEER),
+                                &default_guid) == EFI_SUCCESS);
+    munit_assert_size(storage_count(), ==, 0);
 
-    variable_destroy_noalloc(&tmp);
+    return MUNIT_OK;
 }
 
-static void test_set_and_get2(void)
+/**
+ * Fill the store, remove every other variable, and check that all remaining
+ * variables are still found (exercises index deletion).
+ */
+static MunitResult test_find_after_remove(const MunitParameter params[],
+                                          void *data)
 {
-    EFI_STATUS ret;
+    UTF16 name[16];
+    size_t namesz;
+    unsigned int i;
+    uint32_t val;
+
+    for (i = 0; i < MANY_VARS; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        val = i;
+        munit_assert(storage_set(name, namesz, &default_guid, &val,
+                                 sizeof(val), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
+
+    for (i = 0; i < MANY_VARS; i += 2) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert(storage_remove(name, namesz, &default_guid) ==
+                     EFI_SUCCESS);
+    }
 
-    variable_t tmp;
+    for (i = 0; i < MANY_VARS; i++) {
+        variable_t *var;
 
-    tmp.datasz = MAX_VARIABLE_DATA_SIZE;
-    memcpy(&tmp.guid, &var1.guid, sizeof(tmp.guid));
-    tmp.namesz = var1.namesz;
-    strncpy16(tmp.name, var1.name, MAX_VARIABLE_NAME_SIZE);
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        var = storage_find_variable(name, namesz, &default_guid);
 
-    ret = storage_set(var1.name, &var1.guid, var1.data, var1.datasz,
-                      var1.attrs);
-    munit_assert(ret == 0);
+        if (i % 2 == 0) {
+            munit_assert(var == NULL);
+        } else {
+            munit_assert_ptr_not_null(var);
+            munit_assert(memcmp(var->data, &i, sizeof(i)) == 0);
+        }
+    }
+
+    munit_assert_size(storage_count(), ==, MANY_VARS / 2);
+
+    return MUNIT_OK;
+}
 
-    ret = storage_get(tmp.name, &tmp.guid, &tmp.attrs, tmp.data, &tmp.datasz);
+/**
+ * The store grows chunk by chunk as variables are added and gives the memory
+ * back once they are removed.
+ */
+static MunitResult test_grow_and_shrink(const MunitParameter params[],
+                                        void *data)
+{
+    UTF16 name[16];
+    size_t namesz;
+    unsigned int i;
+    uint32_t val = 0;
 
-    munit_assert(ret == 0);
+    munit_assert_size(storage_capacity(), ==, 0);
 
-    munit_assert(var1.namesz == tmp.namesz);
-    munit_assert(var1.datasz == tmp.datasz);
-    munit_assert(strcmp16(tmp.name, var1.name) == 0);
-    munit_assert(memcmp(tmp.data, var1.data, var1.datasz) == 0);
-    munit_assert(var1.attrs == tmp.attrs);
+    for (i = 0; i < MANY_VARS; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert(storage_set(name, namesz, &default_guid, &val,
+                                 sizeof(val), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
 
-    strncpy16(tmp.name, var2.name, MAX_VARIABLE_NAME_SIZE);
-    tmp.namesz = var2.namesz;
+    munit_assert_size(storage_count(), ==, MANY_VARS);
+    munit_assert_size(storage_capacity(), >=, MANY_VARS);
+    munit_assert_size(storage_capacity(), <, MANY_VARS + VAR_CHUNK_SIZE);
 
-    ret = storage_set(var2.name, &var1.guid, var2.data, var2.datasz,
-                      var2.attrs);
-    munit_assert(ret == 0);
+    for (i = 0; i < MANY_VARS; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert(storage_remove(name, namesz, &default_guid) ==
+                     EFI_SUCCESS);
+    }
 
-    tmp.datasz = MAX_VARIABLE_DATA_SIZE;
-    ret = storage_get(tmp.name, &tmp.guid, &tmp.attrs, tmp.data, &tmp.datasz);
-    munit_assert(ret == 0);
+    munit_assert_size(storage_count(), ==, 0);
+    munit_assert_size(storage_capacity(), ==, VAR_CHUNK_SIZE);
 
-    munit_assert(variable_eq(&var2, &tmp));
+    return MUNIT_OK;
 }
 
-static void test_next(void)
+static MunitResult test_next_after_remove(const MunitParameter params[],
+                                          void *data)
 {
-    EFI_STATUS status;
+    UTF16 name[16];
+    size_t namesz;
+    unsigned int i;
+    uint32_t val = 0;
+    variable_t *next;
+    UTF16 empty[1] = { 0 };
+
+    for (i = 0; i < 5; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert(storage_set(name, namesz, &default_guid, &val,
+                                 sizeof(val), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
 
-    UTF16 next[MAX_VARIABLE_NAME_SIZE];
-    size_t next_sz = MAX_VARIABLE_NAME_SIZE;
-    EFI_GUID next_guid = DEFAULT_GUID;
+    /* Remove VAR1 and VAR2 */
+    namesz = make_name(name, ARRAY_SIZE(name), 1);
+    munit_assert(storage_set(name, namesz, &default_guid, &val, sizeof(val),
+                             0) == EFI_SUCCESS);
+    namesz = make_name(name, ARRAY_SIZE(name), 2);
+    munit_assert(storage_set(name, namesz, &default_guid, &val, 0,
+                             DEFAULT_ATTR) == EFI_SUCCESS);
 
-    memset(&next, 0, sizeof(next));
+    next = storage_next_variable(empty, 0, &default_guid);
 
-    storage_set(var1.name, &var1.guid, var1.data, var1.datasz, var1.attrs);
-    storage_set(var2.name, &var1.guid, var2.data, var2.datasz, var2.attrs);
+    for (i = 0; i < 5; i++) {
+        if (i == 1 || i == 2)
+            continue;
 
-    next_sz = MAX_VARIABLE_NAME_SIZE;
-    status = storage_next(&next_sz, next, &next_guid);
-    munit_assert(status == 0);
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert_ptr_not_null(next);
+        munit_assert_size(next->namesz, ==, namesz);
+        munit_assert(memcmp(next->name, name, namesz) == 0);
 
-    next_sz = MAX_VARIABLE_NAME_SIZE;
-    status = storage_next(&next_sz, next, &next_guid);
-    munit_assert(status == 0);
+        next = storage_next_variable(next->name, next->namesz, &next->guid);
+    }
 
-    next_sz = MAX_VARIABLE_NAME_SIZE;
-    status = storage_next(&next_sz, next, &next_guid);
-    munit_assert(status == EFI_NOT_FOUND);
-}
+    munit_assert(next == NULL);
 
-#define DEFINE_VAR(_name, _data)         \
-        {                                \
-            .name = _name,       \
-            .namesz = sizeof(_name),     \
-            .datasz = sizeof(_data),     \
-            .guid = DEFAULT_GUID,        \
-            .attrs = DEFAULT_ATTR        \
-        }
+    return MUNIT_OK;
+}
 
-static void test_next_after_remove(void)
+/**
+ * Deleting the current variable, or adding new ones, in the middle of an
+ * enumeration must neither end it early nor repeat any variable.
+ */
+static MunitResult test_next_with_concurrent_changes(const MunitParameter params[],
+                                                     void *data)
 {
-    EFI_STATUS status;
-    UTF16 next[MAX_VARIABLE_NAME_SIZE] = { 0 };
-    size_t next_sz = MAX_VARIABLE_NAME_SIZE;
-    EFI_GUID next_guid = DEFAULT_GUID;
-
-    const wchar_t *datum [] = {
-        L"DATA1",
-        L"DATA2",
-        L"DATA3",
-        L"DATA4",
-        L"DATA5"
-    };
+    UTF16 name[16];
+    UTF16 prev[MAX_VARIABLE_NAME_CHARS];
+    EFI_GUID prev_guid;
+    size_t namesz, prevsz;
+    unsigned int i;
+    uint32_t val = 0;
+    variable_t *next;
+    UTF16 empty[1] = { 0 };
+
+    for (i = 0; i < 4; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert(storage_set(name, namesz, &default_guid, &val,
+                                 sizeof(val), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
 
-    variable_t vars[] = {
-        DEFINE_VAR(L"VAR1", L"DATA1"),
-        DEFINE_VAR(L"VAR2", L"DATA2"),
-        DEFINE_VAR(L"VAR3", L"DATA3"),
-        DEFINE_VAR(L"VAR4", L"DATA4"),
-        DEFINE_VAR(L"VAR5", L"DATA5"),
-    };
+    next = storage_next_variable(empty, 0, &default_guid);
 
-    memcpy(vars[0].data, datum[0], strsize16(datum[0]));
-    memcpy(vars[1].data, datum[1], strsize16(datum[1]));
-    memcpy(vars[2].data, datum[2], strsize16(datum[2]));
-    memcpy(vars[3].data, datum[3], strsize16(datum[3]));
-    memcpy(vars[4].data, datum[4], strsize16(datum[4]));
+    for (i = 0; i < 6; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        munit_assert_ptr_not_null(next);
+        munit_assert_size(next->namesz, ==, namesz);
+        munit_assert(memcmp(next->name, name, namesz) == 0);
 
-    size_t i;
+        memcpy(prev, next->name, next->namesz);
+        prevsz = next->namesz;
+        memcpy(&prev_guid, &next->guid, sizeof(prev_guid));
 
-    for (i=0; i<sizeof(vars)/sizeof(vars[0]); i++) {
-        status = storage_set(vars[i].name, &vars[i].guid,
-                    vars[i].data, vars[i].datasz,
-                    vars[i].attrs);
-    }
+        /* The caller may pass the name with its terminator, or without */
+        if (i % 2) {
+            prev[prevsz / sizeof(UTF16)] = 0;
+            prevsz += sizeof(UTF16);
+        }
 
-    for (i=0; i<sizeof(vars)/sizeof(vars[0]); i++) {
-        next_sz = MAX_VARIABLE_NAME_SIZE;
-        status = storage_next(&next_sz, next, &next_guid);
-        munit_assert(status == EFI_SUCCESS);
-        munit_assert(strcmp16((UTF16*)next, (UTF16*)vars[i].name) == 0);
+        /* Delete each variable as soon as it has been returned */
+        munit_assert(storage_remove(prev, prevsz, &prev_guid) == EFI_SUCCESS);
+
+        /* Append VAR4 and VAR5 while the enumeration is in progress */
+        if (i == 1 || i == 2) {
+            namesz = make_name(name, ARRAY_SIZE(name), i + 3);
+            munit_assert(storage_set(name, namesz, &default_guid, &val,
+                                     sizeof(val), DEFAULT_ATTR) == EFI_SUCCESS);
+        }
+
+        next = storage_next_variable(prev, prevsz, &prev_guid);
     }
 
-    next_sz = MAX_VARIABLE_NAME_SIZE;
-    status = storage_next(&next_sz, next, &next_guid);
-    munit_assert(status == EFI_NOT_FOUND);
+    munit_assert(next == NULL);
+    munit_assert_size(storage_count(), ==, 0);
 
-    /* Remove vars 2 and 3 */
-    status = storage_set(vars[1].name, &vars[1].guid,
-                vars[1].data, vars[1].datasz,
-                0);
-    munit_assert(status == 0);
+    return MUNIT_OK;
+}
 
-    status = storage_set(vars[2].name, &vars[2].guid,
-                vars[2].data, vars[2].datasz,
-                0);
-    munit_assert(status == 0);
+/* Each variable is returned once, in the order it was set */
+static MunitResult test_next(const MunitParameter params[], void *data)
+{
+    UTF16 empty[1] = { 0 };
+    variable_t *next;
 
-    next_sz = MAX_VARIABLE_NAME_SIZE;
-    memset(next, 0, sizeof(next));
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid, RTC_DATA,
+                             sizeof(RTC_DATA), DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
 
-    for (i=0; i<sizeof(vars)/sizeof(vars[0]); i++) {
+    next = storage_next_variable(empty, 0, &default_guid);
+    munit_assert_ptr_not_null(next);
+    munit_assert_size(next->namesz, ==, sizeof_wchar(RTC));
+    munit_assert(memcmp(next->name, RTC, sizeof_wchar(RTC)) == 0);
 
-        /* skip the two we removed */
-        if (i == 1 || i == 2)
-            continue;
+    next = storage_next_variable(RTC, sizeof_wchar(RTC), &default_guid);
+    munit_assert_ptr_not_null(next);
+    munit_assert_size(next->namesz, ==, sizeof_wchar(CHEER));
+    munit_assert(memcmp(next->name, CHEER, sizeof_wchar(CHEER)) == 0);
 
-        next_sz = MAX_VARIABLE_NAME_SIZE;
-        status = storage_next(&next_sz, next, &next_guid);
-        munit_assert(status == EFI_SUCCESS);
-        munit_assert(strcmp16((UTF16*)next, (UTF16*)vars[i].name) == 0);
-    }
+    next = storage_next_variable(CHEER, sizeof_wchar(CHEER), &default_guid);
+    munit_assert_ptr_null(next);
 
-    next_sz = MAX_VARIABLE_NAME_SIZE;
-    status = storage_next(&next_sz, next, &next_guid);
-    munit_assert(status == EFI_NOT_FOUND);
+    return MUNIT_OK;
 }
 
-static void test_set_different_attrs(void)
+static MunitResult test_set_different_attrs(const MunitParameter params[],
+                                            void *data)
 {
-    EFI_STATUS status;
-    EFI_GUID guid = DEFAULT_GUID;
-    variable_t vars[] = {
-        DEFINE_VAR(L"TestVariable1", L"DATA1"),
-    };
-    variable_t *var = &vars[0];
-    UTF16 name[MAX_VARIABLE_NAME_SIZE] = { 0 };
-    uint8_t data[MAX_VARIABLE_DATA_SIZE];
-    size_t datasz = MAX_VARIABLE_DATA_SIZE;
+    size_t i;
     uint32_t attrs[] = {
         EFI_VARIABLE_BOOTSERVICE_ACCESS,
         EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
         EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
-        EFI_VARIABLE_NON_VOLATILE | \
-            EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS
+        EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                EFI_VARIABLE_RUNTIME_ACCESS,
     };
-    uint32_t attr = 0;
-    size_t i;
 
     efi_at_runtime = false;
 
-    memcpy(name, var->name, var->namesz);
+    for (i = 0; i < ARRAY_SIZE(attrs); i++) {
+        EFI_STATUS status;
 
-    for (i=0; i<sizeof(attrs)/sizeof(attrs[0]); i++) {
-        status = storage_set(var->name, &var->guid, var->data, var->datasz, attrs[i]);
+        status = storage_set(RTC, sizeof_wchar(RTC),
+                             &default_guid, RTC_DATA, sizeof(RTC_DATA),
+                             attrs[i]);
 
         if (i == 0)
             munit_assert(status == EFI_SUCCESS);
         else
             munit_assert(status == EFI_INVALID_PARAMETER);
 
-        status = storage_get(name, &guid, &attr, data, &datasz);
-        munit_assert(status == EFI_SUCCESS);
+        munit_assert(storage_exists(RTC, sizeof_wchar(RTC),
+                                    &default_guid));
     }
+
+    return MUNIT_OK;
 }
 
-static void test_set_different_attrs_delete_first(void)
+/**
+ * storage_used() follows the actual size of the stored data.
+ */
+/* A deleted variable is gone, and deleting it again fails */
+static MunitResult
+test_set_different_attrs_delete_first(const MunitParameter params[],
+                                      void *data)
 {
-    EFI_STATUS status, returned_status;
-    variable_t vars[] = {
-        DEFINE_VAR(L"TestVariable1", L"DATA1"),
-    };
-    variable_t *var = &vars[0];
+    uint8_t buf[64];
+    size_t i, bufsz;
+    uint32_t attr;
     uint32_t attrs[] = {
         EFI_VARIABLE_BOOTSERVICE_ACCESS,
         EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
         EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
-        EFI_VARIABLE_NON_VOLATILE | \
-            EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS
+        EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                EFI_VARIABLE_RUNTIME_ACCESS,
     };
-    size_t i;
-    UTF16 name[MAX_VARIABLE_NAME_SIZE] = { 0 };
-    uint8_t data[MAX_VARIABLE_DATA_SIZE];
-    size_t datasz = MAX_VARIABLE_DATA_SIZE;
-    uint32_t attr;
-    EFI_GUID guid = DEFAULT_GUID;
 
     efi_at_runtime = false;
 
-    memcpy(name, var->name, var->namesz);
+    for (i = 0; i < ARRAY_SIZE(attrs); i++) {
+        munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                                 RTC_DATA, sizeof(RTC_DATA),
+                                 attrs[i]) == EFI_SUCCESS);
+
+        munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                                 RTC_DATA, 0, attrs[i]) == EFI_SUCCESS);
+        munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                                 RTC_DATA, 0, attrs[i]) == EFI_NOT_FOUND);
+
+        bufsz = sizeof(buf);
+        munit_assert(storage_get(RTC, sizeof_wchar(RTC), &default_guid, &attr,
+                                 buf, &bufsz) == EFI_NOT_FOUND);
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_used_tracks_data(const MunitParameter params[],
+                                         void *data)
+{
+    uint64_t base;
+
+    munit_assert_uint64(storage_used(), ==, 0);
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    base = storage_used();
+    munit_assert_uint64(base, >, sizeof_wchar(RTC) + sizeof(RTC_DATA));
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR | EFI_VARIABLE_APPEND_WRITE) ==
+                 EFI_SUCCESS);
+    munit_assert_uint64(storage_used(), ==, base + sizeof(CHEER_DATA));
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert_uint64(storage_used(), ==, base);
+
+    munit_assert(storage_remove(RTC, sizeof_wchar(RTC), &default_guid) ==
+                 EFI_SUCCESS);
+    munit_assert_uint64(storage_used(), ==, 0);
+    munit_assert_uint64(storage_remaining(), ==, storage_quota());
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_quota(const MunitParameter params[], void *data)
+{
+    uint8_t buf[KB(1)] = { 0 };
+
+    storage_set_quota(sizeof(buf) + KB(1));
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             buf, sizeof(buf), DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             buf, sizeof(buf), DEFAULT_ATTR) ==
+                 EFI_OUT_OF_RESOURCES);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             buf, sizeof(buf),
+                             DEFAULT_ATTR | EFI_VARIABLE_APPEND_WRITE) ==
+                 EFI_OUT_OF_RESOURCES);
+    munit_assert_uint64(storage_used(), <=, storage_quota());
+    munit_assert_uint64(storage_remaining(), ==,
+                        storage_quota() - storage_used());
+
+    /* Deleting always works, and frees up space */
+    munit_assert(storage_remove(RTC, sizeof_wchar(RTC), &default_guid) ==
+                 EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             buf, sizeof(buf), DEFAULT_ATTR) == EFI_SUCCESS);
+
+    return MUNIT_OK;
+}
+
+/**
+ * A snapshot shares data with the store but is not affected by later changes.
+ */
+static MunitResult test_snapshot(const MunitParameter params[], void *data)
+{
+    variable_t snap[2] = { { 0 } };
+    variable_t *var;
+    size_t i, n;
 
-    for (i=0; i<sizeof(attrs)/sizeof(attrs[0]); i++) {
-        status = storage_set(var->name, &var->guid, var->data, var->datasz, attrs[i]);
-        munit_assert(status == EFI_SUCCESS);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS) == EFI_SUCCESS);
 
-        returned_status = storage_set(var->name, &var->guid, var->data, 0, attrs[i]);
-        status = storage_set(var->name, &var->guid, var->data, 0, attrs[i]);
+    n = storage_snapshot(snap, ARRAY_SIZE(snap), true);
+    munit_assert_size(n, ==, 1);
 
-        munit_assert(returned_status == EFI_SUCCESS && status == EFI_NOT_FOUND);
+    var = storage_find_variable(RTC, sizeof_wchar(RTC), &default_guid);
+    munit_assert_ptr_equal(snap[0].data, var->data);
 
-        status = storage_get(name, &guid, &attr, data, &datasz);
-        munit_assert(status == EFI_NOT_FOUND);
+    /* Changing the store copies the data instead of touching the snapshot */
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_remove(RTC, sizeof_wchar(RTC), &default_guid) ==
+                 EFI_SUCCESS);
+
+    munit_assert_size(snap[0].datasz, ==, sizeof(RTC_DATA));
+    munit_assert(memcmp(snap[0].data, RTC_DATA, sizeof(RTC_DATA)) == 0);
+
+    for (i = 0; i < n; i++)
+        variable_destroy_noalloc(&snap[i]);
+
+    return MUNIT_OK;
+}
+
+struct changes {
+    size_t deleted;
+    size_t changed;
+    uint64_t last_gen;
+    bool in_order;
+};
+
+static void count_change(const variable_t *var, bool deleted, void *opaque)
+{
+    struct changes *c = opaque;
+
+    if (deleted) {
+        c->deleted++;
+
+        /* Deletions come first, in generation order */
+        if (c->changed || var->last_modified_gen < c->last_gen)
+            c->in_order = false;
+
+        c->last_gen = var->last_modified_gen;
+    } else {
+        c->changed++;
     }
 }
 
-#define DO_TEST(test) do { pre_test(); test(); post_test(); } while( 0 )
+static MunitResult test_generation(const MunitParameter params[], void *data)
+{
+    struct changes c = { .in_order = true };
+    uint64_t gen;
+    variable_t *var;
+
+    munit_assert_uint64(storage_generation(), ==, 0);
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    gen = storage_generation();
+    munit_assert_uint64(gen, ==, 2);
+
+    /* Failed changes do not count */
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS) ==
+                 EFI_INVALID_PARAMETER);
+    munit_assert_uint64(storage_generation(), ==, gen);
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR | EFI_VARIABLE_APPEND_WRITE) ==
+                 EFI_SUCCESS);
+    var = storage_find_variable(RTC, sizeof_wchar(RTC), &default_guid);
+    munit_assert_uint64(var->last_modified_gen, ==, gen + 1);
+
+    munit_assert(storage_remove(CHEER, sizeof_wchar(CHEER), &default_guid) ==
+                 EFI_SUCCESS);
+    munit_assert_uint64(storage_generation(), ==, gen + 2);
+
+    munit_assert_int(storage_changes_since(gen, count_change, &c), ==, 0);
+    munit_assert_size(c.deleted, ==, 1);
+    munit_assert_size(c.changed, ==, 1);
+    munit_assert(c.in_order);
+
+    memset(&c, 0, sizeof(c));
+    munit_assert_int(storage_changes_since(storage_generation(), count_change,
+                                           &c), ==, 0);
+    munit_assert_size(c.deleted + c.changed, ==, 0);
+
+    /* Once pruned, older deletions can no longer be reported */
+    storage_prune_tombstones(storage_generation());
+    munit_assert_int(storage_changes_since(gen, count_change, &c), ==, -1);
+
+    return MUNIT_OK;
+}
 
-void test_storage(void)
+static MunitResult test_transaction(const MunitParameter params[],
+                                    void *data)
 {
-    EFI_GUID default_guid = DEFAULT_GUID;
-
-    variable_create_noalloc(&var1, RTC, RTC_DATA, sizeof(RTC_DATA),
-                            &default_guid, DEFAULT_ATTR, NULL);
-    variable_create_noalloc(&var2, CHEER, CHEER_DATA, sizeof(CHEER_DATA),
-                            &default_guid, DEFAULT_ATTR, NULL);
-
-    DO_TEST(test_set_and_get);
-    DO_TEST(test_set_and_get2);
-    DO_TEST(test_next);
-    DO_TEST(test_next_after_remove);
-    DO_TEST(test_set_different_attrs);
-    DO_TEST(test_set_different_attrs_delete_first);
-
-    variable_destroy_noalloc(&var1);
-    variable_destroy_noalloc(&var2);
+    struct changes c = { .in_order = true };
+    UTF16 name[16];
+    size_t namesz, used;
+    uint64_t gen;
+    variable_t *var;
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    gen = storage_generation();
+    used = storage_used();
+
+    /* Aborting undoes every change */
+    munit_assert(storage_begin() == EFI_SUCCESS);
+    munit_assert(storage_begin() == EFI_ALREADY_STARTED);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR | EFI_VARIABLE_APPEND_WRITE) ==
+                 EFI_SUCCESS);
+    munit_assert(storage_remove(CHEER, sizeof_wchar(CHEER), &default_guid) ==
+                 EFI_SUCCESS);
+    namesz = make_name(name, ARRAY_SIZE(name), 0);
+    munit_assert(storage_set(name, namesz, &default_guid, RTC_DATA,
+                             sizeof(RTC_DATA), DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert_uint64(storage_generation(), ==, gen + 1);
+    storage_abort();
+
+    munit_assert_uint64(storage_generation(), ==, gen);
+    munit_assert_size(storage_used(), ==, used);
+    munit_assert_size(storage_count(), ==, 2);
+    munit_assert_ptr_null(storage_find_variable(name, namesz, &default_guid));
+
+    var = storage_find_variable(RTC, sizeof_wchar(RTC), &default_guid);
+    munit_assert_ptr_not_null(var);
+    munit_assert_size(var->datasz, ==, sizeof(RTC_DATA));
+    munit_assert_memory_equal(sizeof(RTC_DATA), var->data, RTC_DATA);
+
+    var = storage_find_variable(CHEER, sizeof_wchar(CHEER), &default_guid);
+    munit_assert_ptr_not_null(var);
+    munit_assert_memory_equal(sizeof(CHEER_DATA), var->data, CHEER_DATA);
+
+    munit_assert_int(storage_changes_since(gen, count_change, &c), ==, 0);
+    munit_assert_size(c.deleted + c.changed, ==, 0);
+
+    /* Committed changes all share one generation */
+    munit_assert(storage_begin() == EFI_SUCCESS);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_remove(CHEER, sizeof_wchar(CHEER), &default_guid) ==
+                 EFI_SUCCESS);
+    storage_commit();
+
+    munit_assert_uint64(storage_generation(), ==, gen + 1);
+    munit_assert_size(storage_count(), ==, 1);
+    var = storage_find_variable(RTC, sizeof_wchar(RTC), &default_guid);
+    munit_assert_memory_equal(sizeof(CHEER_DATA), var->data, CHEER_DATA);
+
+    munit_assert_int(storage_changes_since(gen, count_change, &c), ==, 0);
+    munit_assert_size(c.deleted, ==, 1);
+    munit_assert_size(c.changed, ==, 1);
+
+    return MUNIT_OK;
 }
+
+/**
+ * Only variables of the relevant attribute class are visited when
+ * enumerating at runtime, and only non-volatile changes need persisting.
+ */
+static MunitResult test_attribute_classes(const MunitParameter params[],
+                                          void *data)
+{
+    UTF16 name[16];
+    size_t namesz, cnt;
+    uint32_t attrs;
+    uint64_t nv_gen;
+    unsigned int i;
+    variable_t *var;
+
+    for (i = 0; i < MANY_VARS; i++) {
+        namesz = make_name(name, ARRAY_SIZE(name), i);
+        attrs = EFI_VARIABLE_BOOTSERVICE_ACCESS;
+
+        if (i % 2)
+            attrs |= EFI_VARIABLE_NON_VOLATILE;
+
+        if (i % 3 == 0)
+            attrs |= EFI_VARIABLE_RUNTIME_ACCESS;
+
+        munit_assert(storage_set(name, namesz, &default_guid, RTC_DATA,
+                                 sizeof(RTC_DATA), attrs) == EFI_SUCCESS);
+    }
+
+    munit_assert_size(storage_count_nonvolatile(), ==, MANY_VARS / 2);
+
+    efi_at_runtime = true;
+    name[0] = 0;
+    cnt = 0;
+
+    for (var = storage_next_variable(name, 0, &default_guid); var;
+         var = storage_next_variable(var->name, var->namesz, &var->guid)) {
+        munit_assert(var->attrs & EFI_VARIABLE_RUNTIME_ACCESS);
+        cnt++;
+    }
+
+    efi_at_runtime = false;
+    munit_assert_size(cnt, ==, (MANY_VARS + 2) / 3);
+
+    /* Volatile changes do not move the non-volatile generation */
+    nv_gen = storage_nv_generation();
+    namesz = make_name(name, ARRAY_SIZE(name), 0);
+    munit_assert(storage_set(name, namesz, &default_guid, CHEER_DATA,
+                             sizeof(CHEER_DATA),
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                     EFI_VARIABLE_RUNTIME_ACCESS) ==
+                 EFI_SUCCESS);
+    munit_assert_uint64(storage_nv_generation(), ==, nv_gen);
+
+    /* Deleting a non-volatile variable does, even with attrs == 0 */
+    namesz = make_name(name, ARRAY_SIZE(name), 1);
+    munit_assert(storage_set(name, namesz, &default_guid, NULL, 0, 0) ==
+                 EFI_SUCCESS);
+    munit_assert_uint64(storage_nv_generation(), >, nv_gen);
+    munit_assert_size(storage_count_nonvolatile(), ==, MANY_VARS / 2 - 1);
+
+    return MUNIT_OK;
+}
+
+/* Aborting a change of attributes puts the variable back in its classes */
+static MunitResult test_abort_attrs_change(const MunitParameter params[],
+                                           void *data)
+{
+    size_t cnt;
+    UTF16 name[16];
+    variable_t *var;
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert_size(storage_count_nonvolatile(), ==, 1);
+
+    munit_assert(storage_begin() == EFI_SUCCESS);
+    munit_assert(storage_remove(RTC, sizeof_wchar(RTC), &default_guid) ==
+                 EFI_SUCCESS);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS) == EFI_SUCCESS);
+    munit_assert_size(storage_count_nonvolatile(), ==, 0);
+    storage_abort();
+
+    var = storage_find_variable(RTC, sizeof_wchar(RTC), &default_guid);
+    munit_assert_ptr_not_null(var);
+    munit_assert_uint32(var->attrs, ==, DEFAULT_ATTR);
+    munit_assert_size(storage_count(), ==, 1);
+    munit_assert_size(storage_count_nonvolatile(), ==, 1);
+
+    efi_at_runtime = true;
+    name[0] = 0;
+    cnt = 0;
+
+    for (var = storage_next_variable(name, 0, &default_guid); var;
+         var = storage_next_variable(var->name, var->namesz, &var->guid))
+        cnt++;
+
+    efi_at_runtime = false;
+    munit_assert_size(cnt, ==, 1);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_cached_lookup(const MunitParameter params[],
+                                      void *data)
+{
+    uint32_t rtc_hash = variable_hash(RTC, sizeof_wchar(RTC), &default_guid);
+    uint32_t cheer_hash = variable_hash(CHEER, sizeof_wchar(CHEER),
+                                        &default_guid);
+    variable_t *var;
+
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             RTC_DATA, sizeof(RTC_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+
+    var = storage_find_variable_cached(RTC, sizeof_wchar(RTC), &default_guid,
+                                       rtc_hash);
+    munit_assert_ptr_not_null(var);
+    munit_assert_ptr_equal(storage_find_variable_cached(RTC, sizeof_wchar(RTC),
+                                                        &default_guid,
+                                                        rtc_hash), var);
+
+    /* A different key is never served from the cache */
+    munit_assert_ptr_null(storage_find_variable_cached(
+            CHEER, sizeof_wchar(CHEER), &default_guid, cheer_hash));
+
+    /* Nor is a variable that was removed and set again */
+    munit_assert(storage_remove(RTC, sizeof_wchar(RTC), &default_guid) ==
+                 EFI_SUCCESS);
+    munit_assert_ptr_null(storage_find_variable_cached(
+            RTC, sizeof_wchar(RTC), &default_guid, rtc_hash));
+    munit_assert(storage_set(CHEER, sizeof_wchar(CHEER), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+    munit_assert(storage_set(RTC, sizeof_wchar(RTC), &default_guid,
+                             CHEER_DATA, sizeof(CHEER_DATA),
+                             DEFAULT_ATTR) == EFI_SUCCESS);
+
+    var = storage_find_variable_cached(RTC, sizeof_wchar(RTC), &default_guid,
+                                       rtc_hash);
+    munit_assert_ptr_equal(var, storage_find_variable(RTC, sizeof_wchar(RTC),
+                                                      &default_guid));
+    munit_assert_size(var->datasz, ==, sizeof(CHEER_DATA));
+
+    return MUNIT_OK;
+}
+
+static void *setup(const MunitParameter params[], void *data)
+{
+    storage_destroy();
+    return NULL;
+}
+
+static void tear_down(void *fixture)
+{
+    storage_destroy();
+}
+
+#define DEFINE_TEST(test_func)                                          \
+    { (char*) #test_func, test_func,                                    \
+        setup, tear_down, MUNIT_SUITE_OPTION_NONE, NULL }
+
+MunitTest storage_tests[] = {
+    DEFINE_TEST(test_set_and_get),
+    DEFINE_TEST(test_guid_is_part_of_key),
+    DEFINE_TEST(test_name_terminator),
+    DEFINE_TEST(test_find_after_remove),
+    DEFINE_TEST(test_grow_and_shrink),
+    DEFINE_TEST(test_next_after_remove),
+    DEFINE_TEST(test_next_with_concurrent_changes),
+    DEFINE_TEST(test_next),
+    DEFINE_TEST(test_set_different_attrs),
+    DEFINE_TEST(test_set_different_attrs_delete_first),
+    DEFINE_TEST(test_used_tracks_data),
+    DEFINE_TEST(test_quota),
+    DEFINE_TEST(test_snapshot),
+    DEFINE_TEST(test_generation),
+    DEFINE_TEST(test_transaction),
+    DEFINE_TEST(test_attribute_classes),
+    DEFINE_TEST(test_abort_attrs_change),
+    DEFINE_TEST(test_cached_lookup),
+    { 0 }
+};
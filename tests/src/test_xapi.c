@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <sys/socket.h>
@@ -8,6 +10,7 @@
 
 #include "munit/munit.h"
 
+#include "base64.h"
 #include "storage.h"
 #include "common.h"
 #include "log.h"
@@ -41,9 +44,7 @@ static variable_t vars[2];
 #define BUFFER_MAX (4096*4)
 #define VAR_MAX 512
 
-char *bytes_to_base64(uint8_t *buffer, size_t length);
-int base64_to_bytes(uint8_t *plaintext, size_t n, char *encoded,
-                    size_t encoded_size);
+int xapi_notify(void);
 
 MunitResult test_base64(const MunitParameter *params, void* data)
 {
@@ -64,7 +65,7 @@ MunitResult test_base64(const MunitParameter *params, void* data)
     sz = fread(base64, 1, BUFFER_MAX, fd);
     fclose(fd);
 
-    ret = base64_to_bytes(buffer, BUFFER_MAX, base64, sz);
+    ret = base64_decode(buffer, base64, sz);
     munit_assert(ret >= 0);
 
     var_num = ret = from_bytes_to_vars(vars, VAR_MAX, buffer, ret);
@@ -87,8 +88,8 @@ static MunitResult test_bytes(const MunitParameter *params, void* data)
 {
     uint8_t bytes[4096] = { 0 };
     uint8_t *p = (uint8_t *)bytes;
-    variable_t orig = {{ 0 }};
-    variable_t var = {{ 0 }};
+    variable_t orig = { 0 };
+    variable_t var = { 0 };
 
     /* Setup */
     variable_create_noalloc(&orig, L"FOO", sizeof(L"FOO"), (uint8_t *)L"BAR",
@@ -109,7 +110,7 @@ static MunitResult test_var_copy(const MunitParameter *params, void *data)
     uint8_t buf[4096] = { 0 };
     uint8_t *p;
     const uint8_t *unserial_ptr;
-    variable_t orig = {{ 0 }};
+    variable_t orig = { 0 };
     variable_t *var = NULL;
 
     /* Setup */
@@ -137,12 +138,12 @@ static MunitResult test_var_copy(const MunitParameter *params, void *data)
  */
 static MunitResult test_list_serialization(const MunitParameter *params, void *data)
 {
-    char *base64;
+    char base64[BASE64_ENCODED_SIZE(4096) + 1];
     uint8_t buf[4096] = { 0 };
     uint8_t *p = (uint8_t *)buf;
     uint8_t bytes[4096] = { 0 };
     variable_t *orig;
-    variable_t var = {{ 0 }};
+    variable_t var = { 0 };
 
     /* Setup */
     orig = variable_create(L"FOO", sizeof(L"FOO"), (uint8_t *)L"BAR",
@@ -150,23 +151,397 @@ static MunitResult test_list_serialization(const MunitParameter *params, void *d
 
     /* Convert variable into bytes, and then bytes into base64 */
     serialize_variable_list(&p, 4096, orig, 1);
-    base64 = bytes_to_base64(buf, list_size(orig, 1));
+    base64_encode(base64, buf, list_size(orig, 1));
 
     /* Convert base64 to bytes, then bytes back to variable */
-    base64_to_bytes(bytes, 4096, base64, strlen(base64));
+    base64_decode(bytes, base64, strlen(base64));
     from_bytes_to_vars(&var, 1, bytes, 4096);
 
     /* Assert the original variable and the decoded variable are equal */
     munit_assert(variable_eq(&var, orig));
 
     /* Cleanup */
-    free(base64);
     variable_destroy(orig);
     variable_destroy_noalloc(&var);
 
     return MUNIT_OK;
 }
 
+/* A fake XAPI at the other end of the mock socket, counting requests */
+static struct {
+    int fd;
+    bool closed;
+    char request[512 * 1024];
+    size_t request_len;
+    char response[640 * 1024];
+    size_t response_len;
+    size_t response_off;
+    unsigned int connections;
+    unsigned int logins;
+    unsigned int lookups;
+    unsigned int messages;
+    unsigned int logouts;
+    unsigned int sets;
+    bool expire; /* Answer the next message.create with SESSION_INVALID */
+    bool hangup; /* Close the connection after the next response */
+    bool broken; /* Answer VM.get_NVRAM with an HTTP error */
+    char nvram[512 * 1024]; /* The list last set, which VM.get_NVRAM returns */
+} fake;
+
+#define FAKE_SUCCESS                                                    \
+    "<?xml version=\"1.0\"?><methodResponse><params><param><value>"     \
+    "<struct><member><name>Status</name><value>Success</value></member>" \
+    "<member><name>Value</name><value>%s</value></member></struct>"     \
+    "</value></param></params></methodResponse>"
+
+#define FAKE_SESSION_INVALID                                            \
+    "<?xml version=\"1.0\"?><methodResponse><params><param><value>"     \
+    "<struct><member><name>Status</name><value>Failure</value></member>" \
+    "<member><name>ErrorDescription</name><value><array><data>"         \
+    "<value>SESSION_INVALID</value><value>%s</value></data></array>"    \
+    "</value></member></struct></value></param></params>"               \
+    "</methodResponse>"
+
+static void fake_open(int fd)
+{
+    fake.fd = fd;
+    fake.closed = false;
+    fake.request_len = 0;
+    fake.response_len = 0;
+    fake.response_off = 0;
+    fake.connections++;
+}
+
+#define FAKE_NVRAM                                                      \
+    "<struct><member><name>EFI-variables</name><value>%s</value>"       \
+    "</member></struct>"
+
+/* Keep the list set by a VM.set_NVRAM_EFI_variables request */
+static void fake_set_nvram(const char *request)
+{
+    const char *param = "DUMMYVM</string></value></param>"
+                        "<param><value><string>";
+    const char *start, *end;
+
+    start = strstr(request, param);
+    munit_assert_ptr_not_null(start);
+    start += strlen(param);
+    end = strstr(start, "</string>");
+    munit_assert_ptr_not_null(end);
+    munit_assert_size(end - start, <, sizeof(fake.nvram));
+
+    memcpy(fake.nvram, start, end - start);
+    fake.nvram[end - start] = '\0';
+}
+
+static void fake_respond(void)
+{
+    static char body[576 * 1024];
+    static char value[sizeof(fake.nvram) + 128];
+    char *request = fake.request;
+    int code = 200;
+
+    snprintf(value, sizeof(value), "OpaqueRef:session%u", fake.logins);
+
+    if (strstr(request, "session.login_with_password")) {
+        snprintf(value, sizeof(value), "OpaqueRef:session%u", ++fake.logins);
+        snprintf(body, sizeof(body), FAKE_SUCCESS, value);
+    } else if (strstr(request, "message.create") && fake.expire) {
+        fake.expire = false;
+        snprintf(body, sizeof(body), FAKE_SESSION_INVALID, value);
+    } else {
+        if (strstr(request, "VM.get_by_uuid"))
+            fake.lookups++;
+        else if (strstr(request, "message.create"))
+            fake.messages++;
+        else if (strstr(request, "session.logout"))
+            fake.logouts++;
+        else if (strstr(request, "VM.set_NVRAM_EFI_variables"))
+            fake.sets++, fake_set_nvram(request);
+
+        snprintf(body, sizeof(body), FAKE_SUCCESS, "OpaqueRef:x");
+    }
+
+    /* A new VM's NVRAM has no variables */
+    if (strstr(request, "VM.get_NVRAM")) {
+        if (fake.nvram[0])
+            snprintf(value, sizeof(value), FAKE_NVRAM, fake.nvram);
+        else
+            snprintf(value, sizeof(value), "<struct></struct>");
+
+        snprintf(body, sizeof(body), FAKE_SUCCESS, value);
+        code = fake.broken ? 500 : 200;
+    }
+
+    fake.response_len = snprintf(fake.response, sizeof(fake.response),
+                                 "HTTP/1.1 %d OK\r\n"
+                                 "Content-Type: text/xml\r\n"
+                                 "Content-Length: %zu\r\n\r\n%s",
+                                 code, strlen(body), body);
+    fake.response_off = 0;
+    fake.request_len = 0;
+
+    /* Like XAPI timing out an idle connection, without telling */
+    if (fake.hangup) {
+        fake.hangup = false;
+        fake.closed = true;
+    }
+}
+
+static ssize_t fake_send(int fd, const void *buf, size_t len)
+{
+    char *end, *cl;
+
+    munit_assert_int(fd, ==, fake.fd);
+
+    if (fake.closed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    munit_assert_size(fake.request_len + len, <, sizeof(fake.request));
+    memcpy(fake.request + fake.request_len, buf, len);
+    fake.request_len += len;
+    fake.request[fake.request_len] = '\0';
+
+    end = strstr(fake.request, "\r\n\r\n");
+    cl = strstr(fake.request, "Content-Length: ");
+
+    if (end && cl && fake.request_len >= (size_t)(end + 4 - fake.request) +
+                                         strtoul(cl + 16, NULL, 10))
+        fake_respond();
+
+    return len;
+}
+
+static ssize_t fake_recv(int fd, void *buf, size_t len)
+{
+    munit_assert_int(fd, ==, fake.fd);
+
+    if (len > fake.response_len - fake.response_off)
+        len = fake.response_len - fake.response_off;
+
+    memcpy(buf, fake.response + fake.response_off, len);
+    fake.response_off += len;
+
+    return len;
+}
+
+static const struct mock_socket_ops fake_ops = {
+    .open = fake_open,
+    .send = fake_send,
+    .recv = fake_recv,
+};
+
+static void fake_start(void)
+{
+    char socket_arg[] = "socket:/var/lib/xcp/xapi";
+    char uuid_arg[] = "uuid:ffffffff-ffff-ffff-ffff-ffffffffffff";
+
+    memset(&fake, 0, sizeof(fake));
+    mock_socket_set_ops(&fake_ops);
+
+    munit_assert_int(xapi_parse_arg(socket_arg), ==, 0);
+    munit_assert_int(xapi_parse_arg(uuid_arg), ==, 0);
+}
+
+static void fake_stop(void)
+{
+    /* Logs out and closes the connection */
+    xapi_cleanup();
+    mock_socket_set_ops(NULL);
+}
+
+static MunitResult test_keep_alive(const MunitParameter *params, void *data)
+{
+    fake_start();
+
+    /* One connection and one session for all requests */
+    munit_assert_int(xapi_notify(), ==, 0);
+    munit_assert_int(xapi_notify(), ==, 0);
+    munit_assert_uint(fake.connections, ==, 1);
+    munit_assert_uint(fake.logins, ==, 1);
+    munit_assert_uint(fake.lookups, ==, 1);
+    munit_assert_uint(fake.messages, ==, 2);
+
+    /* A connection closed by XAPI is opened again */
+    fake.hangup = true;
+    munit_assert_int(xapi_notify(), ==, 0);
+    munit_assert_int(xapi_notify(), ==, 0);
+    munit_assert_uint(fake.connections, ==, 2);
+    munit_assert_uint(fake.logins, ==, 1);
+    munit_assert_uint(fake.messages, ==, 4);
+
+    /* An expired session is replaced and the request made again */
+    fake.expire = true;
+    munit_assert_int(xapi_notify(), ==, 0);
+    munit_assert_uint(fake.connections, ==, 2);
+    munit_assert_uint(fake.logins, ==, 2);
+    munit_assert_uint(fake.lookups, ==, 2);
+    munit_assert_uint(fake.messages, ==, 5);
+
+    fake_stop();
+    munit_assert_uint(fake.logouts, ==, 1);
+
+    return MUNIT_OK;
+}
+
+#define NVRAM_VARS 40
+
+static MunitResult test_set_nvram(const MunitParameter *params, void *data)
+{
+    static uint8_t expected[256 * 1024], decoded[256 * 1024];
+    const char *param = "DUMMYVM</string></value></param>"
+                        "<param><value><string>";
+    variable_t snapshot[NVRAM_VARS] = { 0 };
+    UTF16 name[] = { 'V', 'A', 'R', 0, 0 };
+    uint8_t value[4000];
+    char *body, *start, *end;
+    uint8_t *p = expected;
+    size_t i, size;
+    ssize_t len;
+
+    storage_set_quota(UINT64_MAX);
+
+    /* Several chunks of the list are encoded */
+    for (i = 0; i < NVRAM_VARS; i++) {
+        name[3] = 'A' + i;
+        memset(value, i, sizeof(value));
+        munit_assert(storage_set(name, sizeof(name), &default_guid, value,
+                                 sizeof(value), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
+
+    munit_assert_size(storage_snapshot(snapshot, NVRAM_VARS, true), ==,
+                      NVRAM_VARS);
+    size = list_size(snapshot, NVRAM_VARS);
+    munit_assert_size(size, <=, sizeof(expected));
+    munit_assert_int(serialize_variable_list(&p, size, snapshot, NVRAM_VARS),
+                     >=, 0);
+
+    for (i = 0; i < NVRAM_VARS; i++)
+        variable_destroy_noalloc(&snapshot[i]);
+
+    fake_start();
+
+    munit_assert_int(xapi_set(xapi_snapshot()), ==, 0);
+    munit_assert_uint(fake.sets, ==, 1);
+
+    /* The Content-Length is the length of the body, and the list is whole */
+    body = strstr(fake.request, "\r\n\r\n") + 4;
+    munit_assert_size(strtoul(strstr(fake.request, "Content-Length: ") + 16,
+                              NULL, 10), ==, strlen(body));
+
+    start = strstr(body, param);
+    munit_assert_ptr_not_null(start);
+    start += strlen(param);
+    end = strstr(start, "</string>");
+    munit_assert_ptr_not_null(end);
+
+    len = base64_decode(decoded, start, end - start);
+    munit_assert_int(len, ==, size);
+    munit_assert_memory_equal(size, decoded, expected);
+
+    /* The request is written again on a fresh connection if XAPI closed it */
+    fake.hangup = true;
+    munit_assert_int(xapi_set(xapi_snapshot()), ==, 0);
+    munit_assert_int(xapi_set(xapi_snapshot()), ==, 0);
+    munit_assert_uint(fake.connections, ==, 2);
+    munit_assert_uint(fake.sets, ==, 3);
+
+    fake_stop();
+
+    return MUNIT_OK;
+}
+
+#define BIG_VARS 3
+#define BIG_DATA_SIZE 100000
+
+/* A list larger than a MSG_SIZE response is read back whole */
+static MunitResult test_get_nvram(const MunitParameter *params, void *data)
+{
+    static uint8_t value[BIG_DATA_SIZE];
+    UTF16 name[] = { 'B', 'I', 'G', 0, 0 };
+    variable_t *read;
+    size_t i;
+
+    storage_set_quota(UINT64_MAX);
+
+    for (i = 0; i < BIG_VARS; i++) {
+        name[3] = 'A' + i;
+        memset(value, i, sizeof(value));
+        munit_assert(storage_set(name, sizeof(name), &default_guid, value,
+                                 sizeof(value), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
+
+    fake_start();
+
+    /* A new VM has no variables */
+    munit_assert_int(xapi_variables_request(&read), ==, 0);
+
+    munit_assert_int(xapi_set(xapi_snapshot()), ==, 0);
+    munit_assert_size(strlen(fake.nvram), >, MSG_SIZE);
+
+    munit_assert_int(xapi_variables_request(&read), ==, BIG_VARS);
+
+    for (i = 0; i < BIG_VARS; i++) {
+        name[3] = 'A' + i;
+        memset(value, i, sizeof(value));
+        munit_assert_size(read[i].namesz, ==, sizeof(name) - sizeof(UTF16));
+        munit_assert_memory_equal(read[i].namesz, read[i].name, name);
+        munit_assert_size(read[i].datasz, ==, sizeof(value));
+        munit_assert_memory_equal(sizeof(value), read[i].data, value);
+        variable_destroy_noalloc(&read[i]);
+    }
+
+    free(read);
+
+    /* Starting without the VM's variables would lose them */
+    fake.broken = true;
+    munit_assert_int(xapi_variables_request(&read), <, 0);
+
+    fake_stop();
+
+    return MUNIT_OK;
+}
+
+#define LOADED_VARS 3
+
+/* A varstore saved under a larger quota is loaded whole */
+static MunitResult test_load_over_quota(const MunitParameter *params,
+                                        void *data)
+{
+    UTF16 name[] = { 'O', 'L', 'D', 0, 0 };
+    uint8_t value[1000];
+    size_t i;
+
+    storage_set_quota(UINT64_MAX);
+
+    for (i = 0; i < LOADED_VARS; i++) {
+        name[3] = 'A' + i;
+        memset(value, i, sizeof(value));
+        munit_assert(storage_set(name, sizeof(name), &default_guid, value,
+                                 sizeof(value), DEFAULT_ATTR) == EFI_SUCCESS);
+    }
+
+    fake_start();
+    munit_assert_int(xapi_set(xapi_snapshot()), ==, 0);
+
+    storage_destroy();
+    storage_set_quota(sizeof(value));
+
+    munit_assert_int(xapi_init(false), ==, 0);
+    munit_assert_size(storage_count(), ==, LOADED_VARS);
+
+    /* The guest is still held to it */
+    munit_assert_uint64(storage_quota(), ==, sizeof(value));
+    munit_assert(storage_set(v1, v1_len, &default_guid, (uint8_t *)D1, d1_len,
+                             DEFAULT_ATTR) == EFI_OUT_OF_RESOURCES);
+
+    fake_stop();
+
+    return MUNIT_OK;
+}
+
 static void xapi_tear_down(void *fixture)
 {
     storage_destroy();
@@ -204,6 +579,10 @@ MunitTest xapi_tests[] = {
     DEFINE_TEST(test_var_copy),
     DEFINE_TEST(test_bytes),
     DEFINE_TEST(test_list_serialization),
+    DEFINE_TEST(test_keep_alive),
+    DEFINE_TEST(test_set_nvram),
+    DEFINE_TEST(test_get_nvram),
+    DEFINE_TEST(test_load_over_quota),
     { (char*)"test_base64", test_base64,
         NULL, NULL, MUNIT_SUITE_OPTION_NONE, NULL },
     { 0 }
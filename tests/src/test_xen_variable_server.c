@@ -1,10 +1,13 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <uchar.h>
 
 #include "munit/munit.h"
 
+#include "backend.h"
 #include "storage.h"
 #include "common.h"
 #include "log.h"
@@ -484,8 +487,8 @@ test_query_variable_info(const MunitParameter *params, void *data)
         remaining_storage_size = unserialize_uint64(&ptr);
         max_variable_size = unserialize_uint64(&ptr);
 
-        munit_assert_long(max_storage_size, =, MAX_STORAGE_SIZE);
-        munit_assert_long(remaining_storage_size, =, MAX_STORAGE_SIZE);
+        munit_assert_long(max_storage_size, =, DEFAULT_STORAGE_QUOTA);
+        munit_assert_long(remaining_storage_size, =, DEFAULT_STORAGE_QUOTA);
         munit_assert_long(max_variable_size, =, MAX_VARIABLE_SIZE);
 
         attrs >>= 1;
@@ -494,8 +497,547 @@ test_query_variable_info(const MunitParameter *params, void *data)
     return MUNIT_OK;
 }
 
+/**
+ * Test that GetVariable() requests with a name that is too long or not a
+ * whole number of UTF16 characters are rejected before any lookup.
+ */
+static MunitResult
+test_malformed_name(const MunitParameter *params, void *data)
+{
+    EFI_GUID guid = DEFAULT_GUID;
+    uint8_t *ptr;
+
+    set_rtc_variable(comm_buf);
+
+    /* One character beyond the longest name */
+    ptr = comm_buf;
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, COMMAND_GET_VARIABLE);
+    serialize_uintn(&ptr, MAX_VARIABLE_NAME_SIZE + sizeof(UTF16));
+    memset(ptr, 'A', MAX_VARIABLE_NAME_SIZE + sizeof(UTF16));
+    ptr += MAX_VARIABLE_NAME_SIZE + sizeof(UTF16);
+    serialize_guid(&ptr, &guid);
+    serialize_uintn(&ptr, 4096);
+    serialize_boolean(&ptr, false);
+
+    xen_variable_server_handle_request(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_OUT_OF_RESOURCES);
+
+    /* "RTC" with half a character more */
+    ptr = comm_buf;
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, COMMAND_GET_VARIABLE);
+    serialize_uintn(&ptr, 3 * sizeof(UTF16) + 1);
+    memcpy(ptr, rtcnamebytes, 3 * sizeof(UTF16) + 1);
+    ptr += 3 * sizeof(UTF16) + 1;
+    serialize_guid(&ptr, &guid);
+    serialize_uintn(&ptr, 4096);
+    serialize_boolean(&ptr, false);
+
+    xen_variable_server_handle_request(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_DEVICE_ERROR);
+
+    return MUNIT_OK;
+}
+
+/* Batches */
+
+#define BATCH_VARS 100
+#define BATCH_NAME_CHARS 100
+
+/* A long, unique name for variable i */
+static void batch_name(char16_t *name, unsigned int i)
+{
+    unsigned int j;
+
+    for (j = 0; j < BATCH_NAME_CHARS; j++)
+        name[j] = 'A' + (j + i) % 26;
+
+    name[0] = '0' + (i / 100) % 10;
+    name[1] = '0' + (i / 10) % 10;
+    name[2] = '0' + i % 10;
+    name[BATCH_NAME_CHARS] = 0;
+}
+
+static MunitResult test_get_variables_batch(const MunitParameter *params,
+                                            void *data)
+{
+    char16_t missing[] = { 'X', 'Y', 'Z', 0 };
+    EFI_GUID guid = DEFAULT_GUID;
+    XEN_VARIABLE_BATCH_ENTRY entries[3] = { 0 };
+    uint32_t rtc_data = 0, mtc_data = 0;
+    unsigned long exits;
+
+    set_rtc_variable(comm_buf);
+    set_mtc_variable(comm_buf);
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    entries[0].VariableName = (char16_t *)rtcnamebytes;
+    entries[0].VendorGuid = &guid;
+    entries[0].DataSize = sizeof(rtc_data);
+    entries[0].Data = &rtc_data;
+    entries[1].VariableName = (char16_t *)mtcnamebytes;
+    entries[1].VendorGuid = &guid;
+    entries[1].DataSize = 1;
+    entries[1].Data = &mtc_data;
+    entries[2].VariableName = missing;
+    entries[2].VendorGuid = &guid;
+
+    exits = mock_xen_variable_server_exits();
+    munit_assert(XenGetVariablesBatch(entries, 3) == EFI_SUCCESS);
+    munit_assert_ulong(mock_xen_variable_server_exits(), ==, exits + 1);
+
+    munit_assert(entries[0].Status == EFI_SUCCESS);
+    munit_assert_uint32(entries[0].Attributes, ==, DEFAULT_ATTR);
+    munit_assert_uint64(entries[0].DataSize, ==, sizeof(rtc_data));
+    munit_assert_uint32(rtc_data, ==, 0xdeadbeef);
+
+    munit_assert(entries[1].Status == EFI_BUFFER_TOO_SMALL);
+    munit_assert_uint64(entries[1].DataSize, ==, sizeof(mtc_data));
+
+    munit_assert(entries[2].Status == EFI_NOT_FOUND);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_set_variables_batch(const MunitParameter *params,
+                                            void *data)
+{
+    static char16_t names[BATCH_VARS][BATCH_NAME_CHARS + 1];
+    XEN_VARIABLE_BATCH_ENTRY entries[BATCH_VARS] = { 0 };
+    uint32_t values[BATCH_VARS], out[BATCH_VARS];
+    EFI_GUID guid = DEFAULT_GUID;
+    unsigned long exits;
+    unsigned int i;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    for (i = 0; i < BATCH_VARS; i++) {
+        batch_name(names[i], i);
+        values[i] = i;
+        entries[i].VariableName = names[i];
+        entries[i].VendorGuid = &guid;
+        entries[i].Attributes = DEFAULT_ATTR;
+        entries[i].DataSize = sizeof(values[i]);
+        entries[i].Data = &values[i];
+    }
+
+    /* Runtime access requires boot service access */
+    entries[1].Attributes = EFI_VARIABLE_RUNTIME_ACCESS;
+
+    exits = mock_xen_variable_server_exits();
+    munit_assert(XenSetVariablesBatch(entries, BATCH_VARS) == EFI_SUCCESS);
+    munit_assert_ulong(mock_xen_variable_server_exits(), ==,
+                       exits + (BATCH_VARS + MAX_BATCH_ENTRIES - 1) /
+                                       MAX_BATCH_ENTRIES);
+
+    for (i = 0; i < BATCH_VARS; i++) {
+        munit_assert(entries[i].Status ==
+                     (i == 1 ? EFI_INVALID_PARAMETER : EFI_SUCCESS));
+        entries[i].DataSize = sizeof(out[i]);
+        entries[i].Data = &out[i];
+    }
+
+    munit_assert(XenGetVariablesBatch(entries, BATCH_VARS) == EFI_SUCCESS);
+
+    for (i = 0; i < BATCH_VARS; i++) {
+        if (i == 1) {
+            munit_assert(entries[i].Status == EFI_NOT_FOUND);
+            continue;
+        }
+
+        munit_assert(entries[i].Status == EFI_SUCCESS);
+        munit_assert_uint32(out[i], ==, i);
+    }
+
+    return MUNIT_OK;
+}
+
+/* Odd sized data puts the names after it at odd offsets */
+static MunitResult test_set_variables_batch_odd_data(
+        const MunitParameter *params, void *data)
+{
+    static char16_t names[BATCH_VARS][BATCH_NAME_CHARS + 1];
+    XEN_VARIABLE_BATCH_ENTRY entries[BATCH_VARS] = { 0 };
+    uint8_t values[BATCH_VARS][3], out[BATCH_VARS][3];
+    EFI_GUID guid = DEFAULT_GUID;
+    unsigned int i;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    for (i = 0; i < BATCH_VARS; i++) {
+        batch_name(names[i], i);
+        memset(values[i], i, sizeof(values[i]));
+        entries[i].VariableName = names[i];
+        entries[i].VendorGuid = &guid;
+        entries[i].Attributes = DEFAULT_ATTR;
+        entries[i].DataSize = 1 + i % 3;
+        entries[i].Data = values[i];
+    }
+
+    munit_assert(XenSetVariablesBatch(entries, BATCH_VARS) == EFI_SUCCESS);
+
+    for (i = 0; i < BATCH_VARS; i++) {
+        munit_assert(entries[i].Status == EFI_SUCCESS);
+        entries[i].DataSize = sizeof(out[i]);
+        entries[i].Data = out[i];
+    }
+
+    munit_assert(XenGetVariablesBatch(entries, BATCH_VARS) == EFI_SUCCESS);
+
+    for (i = 0; i < BATCH_VARS; i++) {
+        munit_assert(entries[i].Status == EFI_SUCCESS);
+        munit_assert_uint64(entries[i].DataSize, ==, 1 + i % 3);
+        munit_assert_memory_equal(entries[i].DataSize, out[i], values[i]);
+    }
+
+    return MUNIT_OK;
+}
+
+#define ALL_NAMES_VARS 400
+
+static void count_name(char16_t *name, EFI_GUID *guid, void *context)
+{
+    unsigned int *seen = context;
+    unsigned int i = (name[0] - '0') * 100 + (name[1] - '0') * 10 +
+                     (name[2] - '0');
+
+    assert(i < ALL_NAMES_VARS);
+    seen[i]++;
+}
+
+static MunitResult test_get_all_names(const MunitParameter *params,
+                                      void *data)
+{
+    char16_t name[BATCH_NAME_CHARS + 1];
+    unsigned int seen[ALL_NAMES_VARS] = { 0 };
+    EFI_GUID guid = DEFAULT_GUID;
+    uint32_t val = 0;
+    unsigned long exits;
+    unsigned int i;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+
+    for (i = 0; i < ALL_NAMES_VARS; i++) {
+        batch_name(name, i);
+        XenSetVariable(name, &guid, DEFAULT_ATTR, sizeof(val), &val);
+        xen_variable_server_handle_request(comm_buf);
+        munit_assert(getstatus(comm_buf) == EFI_SUCCESS);
+    }
+
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    /* The names do not fit the shared memory at once */
+    exits = mock_xen_variable_server_exits();
+    munit_assert(XenGetAllNames(count_name, seen) == EFI_SUCCESS);
+    munit_assert_ulong(mock_xen_variable_server_exits(), >, exits + 1);
+
+    for (i = 0; i < ALL_NAMES_VARS; i++)
+        munit_assert_uint(seen[i], ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* Ring mode */
+
+static MunitResult test_ring(const MunitParameter *params, void *data)
+{
+    char16_t bigname[] = { 'B', 'i', 'g', 0 };
+    char16_t missing[] = { 'X', 'Y', 'Z', 0 };
+    XEN_VARIABLE_BATCH_ENTRY entries[10] = { 0 };
+    static uint8_t ring_buf[SHMEM_PAGES * PAGE_SIZE];
+    static uint8_t big[1000], out[10][sizeof(big) * 2];
+    EFI_GUID guid = DEFAULT_GUID;
+    unsigned long exits;
+    unsigned int i;
+
+    set_rtc_variable(comm_buf);
+    XenSetVariable(bigname, &guid, DEFAULT_ATTR, sizeof(big), big);
+    xen_variable_server_handle_request(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_SUCCESS);
+
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    /* Slot counts must be powers of 2 */
+    munit_assert(XenVariableRingInit(ring_buf, 3, 512) == EFI_UNSUPPORTED);
+    munit_assert(XenVariableRingInit(ring_buf, 8, 512) == EFI_SUCCESS);
+
+    for (i = 0; i < ARRAY_SIZE(entries); i++) {
+        entries[i].VariableName = i % 3 == 0 ? (char16_t *)rtcnamebytes :
+                                  i % 3 == 1 ? bigname : missing;
+        entries[i].VendorGuid = &guid;
+        entries[i].DataSize = sizeof(out[i]);
+        entries[i].Data = out[i];
+    }
+
+    /* One kick per ring full of requests */
+    exits = mock_xen_variable_server_exits();
+    munit_assert(XenGetVariablesRing(entries, ARRAY_SIZE(entries)) ==
+                 EFI_SUCCESS);
+    munit_assert_ulong(mock_xen_variable_server_exits(), ==, exits + 2);
+
+    for (i = 0; i < ARRAY_SIZE(entries); i++) {
+        switch (i % 3) {
+        case 0:
+            munit_assert(entries[i].Status == EFI_SUCCESS);
+            munit_assert_uint64(entries[i].DataSize, ==, sizeof(uint32_t));
+            break;
+        case 1:
+            /* Does not fit the slot, whatever the guest's buffer */
+            munit_assert(entries[i].Status == EFI_BUFFER_TOO_SMALL);
+            munit_assert_uint64(entries[i].DataSize, ==, sizeof(big));
+            break;
+        default:
+            munit_assert(entries[i].Status == EFI_NOT_FOUND);
+            break;
+        }
+    }
+
+    /* Single requests keep working next to the ring */
+    set_mtc_variable(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_SUCCESS);
+
+    return MUNIT_OK;
+}
+
+/* Chunked transfers */
+
+#define CHUNKED_SIZE (MAX_VARIABLE_DATA_SIZE * 3 + 100)
+
+static MunitResult test_chunked_set_and_get(const MunitParameter *params,
+                                            void *data)
+{
+    char16_t name[] = { 'd', 'b', 'x', 0 };
+    static uint8_t in[CHUNKED_SIZE], out[CHUNKED_SIZE];
+    EFI_GUID guid = DEFAULT_GUID;
+    uint64_t outsz = sizeof(out);
+    unsigned long exits;
+    uint32_t attrs;
+    size_t i;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = i * 7;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    exits = mock_xen_variable_server_exits();
+    munit_assert(XenSetVariableChunked(name, &guid, DEFAULT_ATTR, sizeof(in),
+                                       in) == EFI_SUCCESS);
+    munit_assert_ulong(mock_xen_variable_server_exits(), ==, exits + 4);
+
+    munit_assert(XenGetVariableChunked(name, &guid, &attrs, &outsz, out) ==
+                 EFI_SUCCESS);
+    munit_assert_uint64(outsz, ==, sizeof(in));
+    munit_assert_uint32(attrs, ==, DEFAULT_ATTR);
+    munit_assert_memory_equal(sizeof(in), in, out);
+
+    /* Too large for a single GetVariable response, whatever the buffer */
+    outsz = sizeof(out);
+    XenGetVariable(name, &guid, &attrs, &outsz, out);
+    munit_assert(getstatus(comm_buf) == EFI_BUFFER_TOO_SMALL);
+
+    outsz = 10;
+    munit_assert(XenGetVariableChunked(name, &guid, &attrs, &outsz, out) ==
+                 EFI_BUFFER_TOO_SMALL);
+    munit_assert_uint64(outsz, ==, sizeof(in));
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_chunk_order(const MunitParameter *params, void *data)
+{
+    char16_t name[] = { 'd', 'b', 'x', 0 };
+    static uint8_t chunk[MAX_VARIABLE_DATA_SIZE];
+    EFI_GUID guid = DEFAULT_GUID;
+    uint64_t total = sizeof(chunk) * 2;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    /* Not started */
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR, total,
+                                     sizeof(chunk), sizeof(chunk), chunk) ==
+                 EFI_ABORTED);
+
+    /* A gap drops the transfer */
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR, total, 0, 100,
+                                     chunk) == EFI_SUCCESS);
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR, total, 200,
+                                     100, chunk) == EFI_ABORTED);
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR, total, 100,
+                                     100, chunk) == EFI_ABORTED);
+
+    /* Larger than any variable */
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR,
+                                     MAX_CHUNKED_DATA_SIZE + 1, 0, 100,
+                                     chunk) == EFI_OUT_OF_RESOURCES);
+
+    /* Nothing is set until the last chunk */
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR, total, 0,
+                                     sizeof(chunk), chunk) == EFI_SUCCESS);
+    munit_assert_ptr_null(storage_find_variable(name, sizeof(name) - 2,
+                                                &guid));
+    munit_assert(XenSetVariableChunk(name, &guid, DEFAULT_ATTR, total,
+                                     sizeof(chunk), sizeof(chunk), chunk) ==
+                 EFI_SUCCESS);
+    munit_assert_ptr_not_null(storage_find_variable(name, sizeof(name) - 2,
+                                                    &guid));
+
+    return MUNIT_OK;
+}
+
+/* Only chunked transfers leave a variable above MAX_VARIABLE_DATA_SIZE */
+static MunitResult test_append_limit(const MunitParameter *params,
+                                     void *data)
+{
+    char16_t name[] = { 'A', 'p', 'p', 0 };
+    static uint8_t half[MAX_VARIABLE_DATA_SIZE / 2 + 1];
+    static uint8_t big[MAX_VARIABLE_DATA_SIZE + 1];
+    static uint8_t out[MAX_VARIABLE_DATA_SIZE];
+    EFI_GUID guid = DEFAULT_GUID;
+    uint64_t outsz = sizeof(out);
+    uint32_t attrs;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+
+    XenSetVariable(name, &guid, DEFAULT_ATTR, sizeof(half), half);
+    xen_variable_server_handle_request(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_SUCCESS);
+
+    XenSetVariable(name, &guid, DEFAULT_ATTR | EFI_VARIABLE_APPEND_WRITE,
+                   sizeof(half), half);
+    xen_variable_server_handle_request(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_OUT_OF_RESOURCES);
+
+    /* It is still readable at once */
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+    XenGetVariable(name, &guid, &attrs, &outsz, out);
+    munit_assert(getstatus(comm_buf) == EFI_SUCCESS);
+    munit_assert_uint64(storage_find_variable(name, sizeof(name) - 2,
+                                              &guid)->datasz, ==,
+                        sizeof(half));
+
+    /* Set in chunks it may go beyond, but appending to it then still fails */
+    munit_assert(XenSetVariableChunked(name, &guid, DEFAULT_ATTR,
+                                       sizeof(big), big) == EFI_SUCCESS);
+
+    mock_xen_variable_server_set_handler(NULL);
+    XenSetVariable(name, &guid, DEFAULT_ATTR | EFI_VARIABLE_APPEND_WRITE, 1,
+                   half);
+    xen_variable_server_handle_request(comm_buf);
+    munit_assert(getstatus(comm_buf) == EFI_OUT_OF_RESOURCES);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_chunk_staging_budget(const MunitParameter *params,
+                                             void *data)
+{
+    char16_t names[3][2] = { { 'a', 0 }, { 'b', 0 }, { 'c', 0 } };
+    static uint8_t chunk[100];
+    EFI_GUID guid = DEFAULT_GUID;
+    unsigned int i;
+
+    mock_xen_variable_server_set_buffer(comm_buf);
+    mock_xen_variable_server_set_handler(xen_variable_server_handle_request);
+
+    _Static_assert(CHUNK_STAGING_BUDGET < 3 * MAX_CHUNKED_DATA_SIZE,
+                   "three transfers must not fit the budget");
+
+    for (i = 0; i < 3; i++)
+        munit_assert(XenSetVariableChunk(names[i], &guid, DEFAULT_ATTR,
+                                         MAX_CHUNKED_DATA_SIZE, 0,
+                                         sizeof(chunk), chunk) ==
+                     EFI_SUCCESS);
+
+    /* The least recently used transfer made room for the last one */
+    munit_assert(XenSetVariableChunk(names[0], &guid, DEFAULT_ATTR,
+                                     MAX_CHUNKED_DATA_SIZE, sizeof(chunk),
+                                     sizeof(chunk), chunk) == EFI_ABORTED);
+
+    for (i = 1; i < 3; i++)
+        munit_assert(XenSetVariableChunk(names[i], &guid, DEFAULT_ATTR,
+                                         MAX_CHUNKED_DATA_SIZE, sizeof(chunk),
+                                         sizeof(chunk), chunk) ==
+                     EFI_SUCCESS);
+
+    /* Drop them */
+    for (i = 1; i < 3; i++)
+        munit_assert(XenSetVariableChunk(names[i], &guid, DEFAULT_ATTR,
+                                         MAX_CHUNKED_DATA_SIZE, 0, 0, chunk) ==
+                     EFI_INVALID_PARAMETER);
+
+    return MUNIT_OK;
+}
+
+/* Set by a reader once it got the store */
+static volatile int reader_done;
+static pthread_t reader_thread;
+static bool read_during_notify;
+
+static void *reader(void *opaque)
+{
+    storage_read_lock();
+    storage_unlock();
+    __atomic_store_n(&reader_done, 1, __ATOMIC_SEQ_CST);
+
+    return NULL;
+}
+
+/* Like a slow XAPI call, while another vCPU reads a variable */
+static int reading_notify(void)
+{
+    struct timespec ts = { 0, 10000000 };
+    int i;
+
+    reader_done = 0;
+    munit_assert_int(pthread_create(&reader_thread, NULL, reader, NULL), ==,
+                     0);
+
+    for (i = 0; i < 100 && !__atomic_load_n(&reader_done, __ATOMIC_SEQ_CST);
+         i++)
+        nanosleep(&ts, NULL);
+
+    read_during_notify = reader_done;
+
+    return 0;
+}
+
+static struct backend notify_backend = {
+    .notify = reading_notify,
+};
+
+/**
+ * Test that a secure boot failure notification does not hold the store while
+ * XAPI is called.
+ */
+static MunitResult test_notify_unlocked(const MunitParameter *params,
+                                        void *data)
+{
+    uint8_t *ptr = comm_buf;
+
+    backend = &notify_backend;
+    read_during_notify = false;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, COMMAND_NOTIFY_SB_FAILURE);
+
+    xen_variable_server_handle_request(comm_buf);
+    pthread_join(reader_thread, NULL);
+    backend = NULL;
+
+    munit_assert(getstatus(comm_buf) == EFI_SUCCESS);
+    munit_assert(read_during_notify);
+
+    return MUNIT_OK;
+}
+
 static void tear_down(void* fixture)
 {
+    mock_xen_variable_server_set_handler(NULL);
     storage_destroy();
 }
 
@@ -517,5 +1059,16 @@ MunitTest xen_variable_server_tests[] = {
     DEFINE_TEST(test_query_variable_info),
     DEFINE_TEST(test_query_variable_info_bad_attrs),
     DEFINE_TEST(test_valid_attrs),
+    DEFINE_TEST(test_malformed_name),
+    DEFINE_TEST(test_get_variables_batch),
+    DEFINE_TEST(test_set_variables_batch),
+    DEFINE_TEST(test_set_variables_batch_odd_data),
+    DEFINE_TEST(test_get_all_names),
+    DEFINE_TEST(test_ring),
+    DEFINE_TEST(test_chunked_set_and_get),
+    DEFINE_TEST(test_chunk_order),
+    DEFINE_TEST(test_chunk_staging_budget),
+    DEFINE_TEST(test_append_limit),
+    DEFINE_TEST(test_notify_unlocked),
     { 0 }
 };
@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "munit/munit.h"
+
+#include "base64.h"
+#include "common.h"
+#include "serializer.h"
+#include "test_common.h"
+#include "xmlrpc.h"
+#include "bigrequest2.h"
+
+#define RESPONSE(status, member, value)                                 \
+    "<?xml version=\"1.0\"?>\n"                                         \
+    "<methodResponse><params><param><value><struct>\n"                  \
+    "  <member><name>Status</name><value>" status "</value></member>\n" \
+    "  <member><name>" member "</name><value>" value "</value></member>\n" \
+    "</struct></value></param></params></methodResponse>\n"
+
+static int parse(const char *xml, const char *key, char *out, size_t size)
+{
+    return xmlrpc_parse_response(xml, strlen(xml), key, out, size);
+}
+
+static MunitResult test_success(const MunitParameter params[], void *data)
+{
+    char out[64];
+
+    munit_assert_int(parse(RESPONSE("Success", "Value", "OpaqueRef:1"), NULL,
+                           out, sizeof(out)), ==, XMLRPC_SUCCESS);
+    munit_assert_string_equal(out, "OpaqueRef:1");
+
+    /* Typed values, entities and empty values */
+    munit_assert_int(parse(RESPONSE("Success", "Value",
+                                    " <string>a&amp;b&#x3c;&#62;</string> "),
+                           NULL, out, sizeof(out)), ==, XMLRPC_SUCCESS);
+    munit_assert_string_equal(out, "a&b<>");
+
+    munit_assert_int(parse(RESPONSE("Success", "Value", "<string/>"), NULL,
+                           out, sizeof(out)), ==, XMLRPC_SUCCESS);
+    munit_assert_string_equal(out, "");
+
+    /* Only the status */
+    munit_assert_int(parse(RESPONSE("Success", "Value", "<array><data/>"
+                                                        "</array>"),
+                           NULL, NULL, 0), ==, XMLRPC_SUCCESS);
+
+    /* The value must fit */
+    munit_assert_int(parse(RESPONSE("Success", "Value", "OpaqueRef:1"), NULL,
+                           out, 11), ==, -1);
+    munit_assert_int(parse(RESPONSE("Success", "Value", "OpaqueRef:1"), NULL,
+                           out, 12), ==, XMLRPC_SUCCESS);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_failure(const MunitParameter params[], void *data)
+{
+    char out[64];
+
+    munit_assert_int(parse(RESPONSE("Failure", "ErrorDescription",
+                                    "<array><data>"
+                                    "<value>SESSION_INVALID</value>"
+                                    "<value>OpaqueRef:1</value>"
+                                    "</data></array>"),
+                           NULL, out, sizeof(out)), ==, XMLRPC_FAILURE);
+    munit_assert_string_equal(out, "SESSION_INVALID");
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_struct_member(const MunitParameter params[],
+                                      void *data)
+{
+    static char b64[8192];
+    static uint8_t bytes[8192];
+    const char *body = strstr(BIG_REQUEST2, "\r\n\r\n") + 4;
+    char out[64];
+    int ret;
+
+    munit_assert_int(xmlrpc_parse_response(body, strlen(body),
+                                           "EFI-variables", b64, sizeof(b64)),
+                     ==, XMLRPC_SUCCESS);
+
+    ret = base64_decode(bytes, b64, strlen(b64));
+    munit_assert_int(ret, >, 0);
+    munit_assert_int(variable_list_count(bytes, ret), >, 0);
+
+    /* Members other than the one asked for are skipped, whatever they are */
+    munit_assert_int(parse(RESPONSE("Success", "Value",
+                                    "<struct>"
+                                    "<member><name>a</name><value><struct>"
+                                    "<member><name>key</name>"
+                                    "<value>nested</value></member>"
+                                    "</struct></value></member>"
+                                    "<member><name>b</name><value><array>"
+                                    "<data><value><i4>1</i4></value></data>"
+                                    "</array></value></member>"
+                                    "<member><name>key</name>"
+                                    "<value>found</value></member>"
+                                    "</struct>"),
+                           "key", out, sizeof(out)), ==, XMLRPC_SUCCESS);
+    munit_assert_string_equal(out, "found");
+
+    munit_assert_int(parse(RESPONSE("Success", "Value",
+                                    "<struct></struct>"),
+                           "key", out, sizeof(out)), ==, XMLRPC_MISSING);
+
+    return MUNIT_OK;
+}
+
+static MunitResult test_malformed(const MunitParameter params[], void *data)
+{
+    const char *bad[] = {
+        "",
+        RESPONSE("Unknown", "Value", "x"),
+        RESPONSE("Success", "Value", "&bogus;"),
+        RESPONSE("Success", "Value", "&#0;"),
+        RESPONSE("Success", "Value", "<string>x</int>"),
+        RESPONSE("Success", "Value", "x<string>y</string>"),
+        RESPONSE("Success", "Value", "<value>nested</value>"),
+        RESPONSE("Success", "Value", "<struct><member><name>k</name>"
+                                     "</member></struct>"),
+        RESPONSE("Success", "Value", "x") "trailing",
+    };
+    const char *good = RESPONSE("Success", "Value", "<string>x</string>");
+    char deep[1024], xml[2048], out[64];
+    size_t i, len;
+
+    for (i = 0; i < ARRAY_SIZE(bad); i++)
+        munit_assert_int(parse(bad[i], NULL, out, sizeof(out)), ==, -1);
+
+    /* No response cut short is one, only the final newline is optional */
+    for (len = 0; len < strlen(good) - 1; len++)
+        munit_assert_int(xmlrpc_parse_response(good, len, NULL, out,
+                                               sizeof(out)), ==, -1);
+
+    munit_assert_int(xmlrpc_parse_response(good, len, NULL, out, sizeof(out)),
+                     ==, XMLRPC_SUCCESS);
+
+    /* Nesting is bounded */
+    strcpy(deep, "");
+
+    for (i = 0; i < 20; i++)
+        strcat(deep, "<array><data><value>");
+
+    strcat(deep, "x");
+
+    for (i = 0; i < 20; i++)
+        strcat(deep, "</value></data></array>");
+
+    snprintf(xml, sizeof(xml), RESPONSE("Success", "Value", "%s"), deep);
+    munit_assert_int(parse(xml, NULL, NULL, 0), ==, -1);
+
+    return MUNIT_OK;
+}
+
+#define DEFINE_TEST(test_func)                                          \
+    { (char*) #test_func, test_func,                                    \
+        NULL, NULL, MUNIT_SUITE_OPTION_NONE, NULL }
+
+MunitTest xmlrpc_tests[] = {
+    DEFINE_TEST(test_success),
+    DEFINE_TEST(test_failure),
+    DEFINE_TEST(test_struct_member),
+    DEFINE_TEST(test_malformed),
+    { 0 }
+};
@@ -28,6 +28,13 @@ MunitSuite other_suites[] = {
         1,
         MUNIT_SUITE_OPTION_NONE
     },
+    {
+        (char*) "base64/",
+        base64_tests,
+        NULL,
+        1,
+        MUNIT_SUITE_OPTION_NONE
+    },
     {
         (char*) "db/",
         db_tests,
@@ -56,6 +63,27 @@ MunitSuite other_suites[] = {
         1,
         MUNIT_SUITE_OPTION_NONE
     },
+    {
+        (char*) "persist/",
+        persist_tests,
+        NULL,
+        1,
+        MUNIT_SUITE_OPTION_NONE
+    },
+    {
+        (char*) "pool/",
+        pool_tests,
+        NULL,
+        1,
+        MUNIT_SUITE_OPTION_NONE
+    },
+    {
+        (char*) "storage/",
+        storage_tests,
+        NULL,
+        1,
+        MUNIT_SUITE_OPTION_NONE
+    },
     {
         (char*) "xapi/",
         xapi_tests,
@@ -70,6 +98,13 @@ MunitSuite other_suites[] = {
         1,
         MUNIT_SUITE_OPTION_NONE
     },
+    {
+        (char*) "xmlrpc/",
+        xmlrpc_tests,
+        NULL,
+        1,
+        MUNIT_SUITE_OPTION_NONE
+    },
     { NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE },
 };
 